@@ -15,15 +15,231 @@
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <set>
+#include <csignal>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
 
 using namespace tinyxml2;
 
-void log(std::string s)          { std::cerr << "LOG: " << s << std::endl; }
-void log(char c)                 { std::cerr << "LOG: " << c << std::endl; }
-void log(std::string s, char c)  { std::cerr << "LOG: " << s << c << std::endl; }
+//where this thread's output goes. batch mode points every worker at the directory of the log it is running
+thread_local std::ostream *log_out = &std::cerr;
+thread_local std::string output_dir;
+
+std::string output_path(const std::string &filename) { return output_dir + filename; }
+
+void log(std::string s)          { *log_out << "LOG: " << s << std::endl; }
+void log(char c)                 { *log_out << "LOG: " << c << std::endl; }
+void log(std::string s, char c)  { *log_out << "LOG: " << s << c << std::endl; }
 void log(std::string s, int i)   { s += std::to_string(i); log(s); }
 void log(std::string s, float i) { s += std::to_string(i); log(s); }
 
+/*
+    Metrics, --metrics [PREFIX]. Counters and phase timers kept through the pipeline, written as
+    PREFIX.json and PREFIX.prom (Prometheus text format) when the program exits, after every round of
+    follow and watch mode and on SIGUSR1. The graph service answers "metrics [json]" with them.
+    Everything is behind metrics_on, a run without --metrics pays one branch per counted event. The
+    counters are atomic since batch workers and service connections build graphs at the same time.
+*/
+enum metric_phase { PHASE_READ, PHASE_PARSE, PHASE_UNIQUE_TRACES, PHASE_BUILD, PHASE_CONSOLIDATE, PHASE_TIME_DIFF, PHASE_EXPORT, PHASES };
+const char* phase_names[PHASES] = { "read", "parse", "unique_traces", "build", "consolidate", "time_diff", "export" };
+
+//why check_valid_merge turned a candidate node down
+enum merge_rejection { REJECT_LOOP, REJECT_NEXT_TIME, REJECT_ORDER, REJECT_ORDER_UNFIXABLE, REJECT_EXTRA_PATH, REJECTIONS };
+const char* rejection_names[REJECTIONS] = { "loop", "next_time", "order", "order_unfixable", "extra_path" };
+
+#define METRIC_DEPTHS 8 //recursions deeper than this share the last bucket
+
+struct build_metrics {
+
+    std::atomic<long long> phase_ns[PHASES];
+    std::atomic<long long> phase_runs[PHASES];
+    std::atomic<long long> candidates;            //check_valid_merge calls from merge_letter
+    std::atomic<long long> accepted;
+    std::atomic<long long> rejected[REJECTIONS];
+    std::atomic<long long> recursion_merges;      //merged after a recursion found the rest of the trace a place
+    std::atomic<long long> recursions[METRIC_DEPTHS]; //by depth, depth 1 in [0]
+    std::atomic<long long> recursion_depth_sum;
+    std::atomic<long long> copies;                //master_trace copies made for a recursion
+    std::atomic<long long> copy_bytes;
+    std::atomic<long long> loop_checks;
+    std::atomic<long long> loops_found;
+    std::atomic<long long> nodes_created;
+};
+
+int metrics_on = 0;
+std::string metrics_prefix;
+build_metrics metrics; //zero, as a global
+volatile sig_atomic_t metrics_requested = 0;
+thread_local int recursion_depth = 0;
+
+void metric_add(std::atomic<long long> &counter, long long n = 1) {
+
+    if (metrics_on) { counter.fetch_add(n, std::memory_order_relaxed); }
+}
+
+//adds the time from construction to destruction to a phase
+struct phase_timer {
+
+    int phase;
+    std::chrono::steady_clock::time_point start;
+
+    phase_timer(int p) : phase(p) { if (metrics_on) { start = std::chrono::steady_clock::now(); } }
+
+    ~phase_timer() {
+        if (!metrics_on) { return; }
+        metric_add(metrics.phase_ns[phase], std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        metric_add(metrics.phase_runs[phase]);
+    }
+};
+
+std::string metric_seconds(long long ns) {
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", ns / 1e9);
+    return buffer;
+}
+
+std::string metrics_json() {
+
+    std::string json = "{\n\"phases\": {";
+    for (int p = 0; p < PHASES; p++) {
+        json += std::string(p == 0 ? "\n" : ",\n") + "  \"" + phase_names[p] + "\": {\"seconds\": " + metric_seconds(metrics.phase_ns[p]) +
+                ", \"runs\": " + std::to_string(metrics.phase_runs[p]) + "}";
+    }
+
+    json += "\n},\n\"merge_candidates\": {\"tried\": " + std::to_string(metrics.candidates) +
+            ", \"accepted\": " + std::to_string(metrics.accepted) +
+            ", \"accepted_after_recursion\": " + std::to_string(metrics.recursion_merges) + ", \"rejected\": {";
+    for (int r = 0; r < REJECTIONS; r++) {
+        json += std::string(r == 0 ? "" : ", ") + "\"" + rejection_names[r] + "\": " + std::to_string(metrics.rejected[r]);
+    }
+
+    json += "}},\n\"recursion_depth\": {";
+    for (int d = 0; d < METRIC_DEPTHS; d++) {
+        json += std::string(d == 0 ? "" : ", ") + "\"" + std::to_string(d + 1) + (d == METRIC_DEPTHS - 1 ? "+" : "") + "\": " +
+                std::to_string(metrics.recursions[d]);
+    }
+
+    json += "},\n\"graph_copies\": {\"count\": " + std::to_string(metrics.copies) + ", \"bytes\": " + std::to_string(metrics.copy_bytes) + "},\n";
+    json += "\"loop_checks\": {\"count\": " + std::to_string(metrics.loop_checks) + ", \"loops_found\": " + std::to_string(metrics.loops_found) + "},\n";
+    json += "\"nodes_created\": " + std::to_string(metrics.nodes_created) + "\n}\n";
+    return json;
+}
+
+std::string metrics_prometheus() {
+
+    std::string prom;
+
+    prom += "# HELP desktop_phase_seconds_total Wall time spent in each phase of the pipeline.\n"
+            "# TYPE desktop_phase_seconds_total counter\n";
+    for (int p = 0; p < PHASES; p++) {
+        prom += std::string("desktop_phase_seconds_total{phase=\"") + phase_names[p] + "\"} " + metric_seconds(metrics.phase_ns[p]) + "\n";
+    }
+    prom += "# HELP desktop_phase_runs_total Times each phase of the pipeline has run.\n"
+            "# TYPE desktop_phase_runs_total counter\n";
+    for (int p = 0; p < PHASES; p++) {
+        prom += std::string("desktop_phase_runs_total{phase=\"") + phase_names[p] + "\"} " + std::to_string(metrics.phase_runs[p]) + "\n";
+    }
+
+    prom += "# HELP desktop_merge_candidates_total Nodes tried as a merge target, by outcome.\n"
+            "# TYPE desktop_merge_candidates_total counter\n";
+    prom += "desktop_merge_candidates_total{result=\"accepted\"} " + std::to_string(metrics.accepted) + "\n";
+    for (int r = 0; r < REJECTIONS; r++) {
+        prom += std::string("desktop_merge_candidates_total{result=\"rejected\",reason=\"") + rejection_names[r] + "\"} " +
+                std::to_string(metrics.rejected[r]) + "\n";
+    }
+    prom += "# HELP desktop_recursion_merges_total Merges made after a recursion placed the rest of the trace.\n"
+            "# TYPE desktop_recursion_merges_total counter\n"
+            "desktop_recursion_merges_total " + std::to_string(metrics.recursion_merges) + "\n";
+
+    prom += "# HELP desktop_recursion_depth Depth of each recursive merge attempt.\n"
+            "# TYPE desktop_recursion_depth histogram\n";
+    long long cumulative = 0;
+    for (int d = 0; d < METRIC_DEPTHS - 1; d++) {
+        cumulative += metrics.recursions[d];
+        prom += "desktop_recursion_depth_bucket{le=\"" + std::to_string(d + 1) + "\"} " + std::to_string(cumulative) + "\n";
+    }
+    cumulative += metrics.recursions[METRIC_DEPTHS - 1];
+    prom += "desktop_recursion_depth_bucket{le=\"+Inf\"} " + std::to_string(cumulative) + "\n";
+    prom += "desktop_recursion_depth_sum " + std::to_string(metrics.recursion_depth_sum) + "\n";
+    prom += "desktop_recursion_depth_count " + std::to_string(cumulative) + "\n";
+
+    prom += "# HELP desktop_graph_copies_total Graph copies made for recursive merge attempts.\n"
+            "# TYPE desktop_graph_copies_total counter\n"
+            "desktop_graph_copies_total " + std::to_string(metrics.copies) + "\n";
+    prom += "# HELP desktop_graph_copy_bytes_total Bytes of graph copied for recursive merge attempts.\n"
+            "# TYPE desktop_graph_copy_bytes_total counter\n"
+            "desktop_graph_copy_bytes_total " + std::to_string(metrics.copy_bytes) + "\n";
+    prom += "# HELP desktop_loop_checks_total Loop checks run for merge attempts.\n"
+            "# TYPE desktop_loop_checks_total counter\n"
+            "desktop_loop_checks_total " + std::to_string(metrics.loop_checks) + "\n";
+    prom += "# HELP desktop_loops_found_total Loop checks that found a loop.\n"
+            "# TYPE desktop_loops_found_total counter\n"
+            "desktop_loops_found_total " + std::to_string(metrics.loops_found) + "\n";
+    prom += "# HELP desktop_nodes_created_total Nodes added to graphs, recursion copies included.\n"
+            "# TYPE desktop_nodes_created_total counter\n"
+            "desktop_nodes_created_total " + std::to_string(metrics.nodes_created) + "\n";
+
+    return prom;
+}
+
+//PREFIX.json and PREFIX.prom, replaced whole so a scraper never reads half a file
+void write_metrics() {
+
+    if (!metrics_on) { return; }
+    metrics_requested = 0;
+
+    std::string contents[2] = { metrics_json(), metrics_prometheus() };
+    std::string files[2] = { metrics_prefix + ".json", metrics_prefix + ".prom" };
+
+    for (int f = 0; f < 2; f++) {
+        std::ofstream out(files[f] + ".tmp", std::ios::binary);
+        out << contents[f];
+        out.close();
+        if (!out) {
+            log("Error writing metrics: " + files[f]);
+            continue;
+        }
+
+        //windows won't rename over an existing file
+        if (std::rename((files[f] + ".tmp").c_str(), files[f].c_str()) != 0) {
+            std::remove(files[f].c_str());
+            if (std::rename((files[f] + ".tmp").c_str(), files[f].c_str()) != 0) { log("Error writing metrics: " + files[f]); }
+        }
+    }
+}
+
+void request_metrics(int) { metrics_requested = 1; }
+
 #define SIZE 89
 
 struct event {
@@ -40,6 +256,7 @@ struct event {
 
 struct trace {
 
+    std::string case_id; //the trace's concept:name, or its position in the log if it has none
     std::vector<event> events;
     int valid;
     std::string shorthand;
@@ -48,7 +265,7 @@ struct trace {
 
 struct event_log {
 
-    int events;
+    int events = 0;
     float average_events_per_trace;
     std::vector<std::string> activity_names;
     std::vector<trace> traces;
@@ -71,52 +288,544 @@ struct unique_trace {
     //}
 };
 
-struct node {
+/*
+    Vector of ints that keeps its first N items inside the object. Most nodes only have a few edges,
+    so a node's adjacency lists (and every copy of a master_trace) need no heap allocations.
+    Only the parts of std::vector that the graph code uses are here.
+*/
+template <int N>
+struct small_int_vector {
+
+    int* items;
+    int  count;
+    int  capacity;
+    int  inline_items[N];
+
+    small_int_vector() : items(inline_items), count(0), capacity(N) {}
+    small_int_vector(const small_int_vector &other) : items(inline_items), count(0), capacity(N) { assign(other.begin(), other.end()); }
+    small_int_vector(const std::vector<int> &other) : items(inline_items), count(0), capacity(N) { assign(other.data(), other.data() + other.size()); }
+    ~small_int_vector() { if (items != inline_items) { delete[] items; } }
+
+    small_int_vector& operator=(const small_int_vector &other) {
+        if (this != &other) { assign(other.begin(), other.end()); }
+        return *this;
+    }
 
-    int creationID;
-    char event_type;
-    std::string name;
-    int event_count;
-    float average_time;
-    std::vector<int> next_nodes;
-    std::vector<int> next_nodes_counts;
-    std::vector<int> prev_nodes;
-    int extra_node = -1;
-    int is_attempting_merge;
-    int extra_event_count;
-    float extra_average_time;
-    std::vector<std::string> unique_traces;
-    int end_count = 0;
+    //a spilled list changes owner instead of being copied, so growing a std::vector<node> copies no edges
+    small_int_vector(small_int_vector &&other) noexcept : items(inline_items), count(0), capacity(N) { take(other); }
+
+    small_int_vector& operator=(small_int_vector &&other) noexcept {
+        if (this != &other) { take(other); }
+        return *this;
+    }
+
+    //leaves other empty. an inline other fits in the inline (or larger) storage here, so this never allocates
+    void take(small_int_vector &other) noexcept {
+
+        if (other.items == other.inline_items) {
+            std::copy(other.items, other.items + other.count, items);
+            count = other.count;
+        } else {
+            if (items != inline_items) { delete[] items; }
+            items = other.items;
+            count = other.count;
+            capacity = other.capacity;
+            other.items = other.inline_items;
+            other.capacity = N;
+        }
+        other.count = 0;
+    }
 
-    int deleted = 0;
+    void reserve(int size) {
 
-    int used = 1;
+        if (size <= capacity) { return; }
 
-    float time_diff;
+        int* bigger = new int[size];
+        std::copy(items, items + count, bigger);
+        if (items != inline_items) { delete[] items; }
+        items = bigger;
+        capacity = size;
+    }
+
+    void assign(const int* first, const int* last) {
+
+        count = 0;
+        reserve(last - first);
+        std::copy(first, last, items);
+        count = last - first;
+    }
+
+    void push_back(int i) {
+
+        if (count == capacity) { reserve(capacity * 2); }
+        items[count++] = i;
+    }
+
+    int* insert(int* pos, int i) {
 
-    bool operator<(const node &other) const {
-        return time_diff > other.time_diff;  
+        int at = pos - items;
+        push_back(i);
+        std::rotate(items + at, items + count - 1, items + count);
+        return items + at;
     }
 
+    int* erase(int* pos) {
+
+        std::copy(pos + 1, items + count, pos);
+        count--;
+        return pos;
+    }
+
+    void pop_back()   { count--; }
+    void clear()      { count = 0; }
+    int size()  const { return count; }
+    bool empty() const { return count == 0; }
+
+    int& operator[](int i)             { return items[i]; }
+    const int& operator[](int i) const { return items[i]; }
+    int& back()                        { return items[count - 1]; }
+
+    int* begin()             { return items; }
+    int* end()               { return items + count; }
+    const int* begin() const { return items; }
+    const int* end()   const { return items + count; }
+};
+
+//strings stored once and referred to by index. only ever grows, so ids stay valid
+struct string_table {
+
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, int> ids;
+};
+
+int intern(string_table &table, const std::string &s) {
+
+    std::unordered_map<std::string, int>::iterator it = table.ids.find(s);
+    if (it != table.ids.end()) { return it->second; }
+
+    int id = table.strings.size();
+    table.strings.push_back(s);
+    table.ids[s] = id;
+
+    return id;
+}
+
+/*
+    Only what the graph walks need is kept in a node, so nodes_container stays small and a copy of it
+    is cheap. The name lives in master_trace::names and the variants that passed through the node in
+    master_trace::variant_bits. The scratch state of a merge attempt lives in master_trace (attempt_*),
+    since only one node is ever attempting a merge at a time.
+*/
+struct node {
+
+    int creationID;
+    int name_id;
+    char event_type;
+    char used = 1;
+    char deleted = 0;
+    int event_count;
+    int end_count = 0;
+    float average_time;
+    small_int_vector<4> next_nodes;
+    small_int_vector<4> next_nodes_counts;
+    small_int_vector<4> prev_nodes;
 };
 
 /*
-    nodes never get removed from the container.
-    this is to simplify working with indexes, 
-    it also works since we will never run out of memory on any of the examples. (not even close)
-    so if anyone build on this you'll need to address this if you plan on using event logs of infinite size.
+    a node's index in nodes_container is its creationID and is what every other structure refers to it by.
+    nodes are not removed while building, dropped nodes (sliding window) are marked deleted and their slot
+    is reused. compact_graph squeezes them out for good and renumbers the rest.
 */
+struct graph_journal;
+
 struct master_trace {
 
     std::vector<node> nodes_container;
     std::vector<int>  base_nodes;
+    std::vector<int>  free_nodes; //deleted nodes whose slot gets reused by add_new_node
+
+    //activity names and variant shorthands. shared between copies of the graph since they only grow
+    std::shared_ptr<string_table> names    = std::make_shared<string_table>();
+    std::shared_ptr<string_table> variants = std::make_shared<string_table>();
+
+    //which variants passed through which node, node i owns words [i * variant_words, (i + 1) * variant_words)
+    std::vector<unsigned long long> variant_bits;
+    int variant_words = 1;
+
+    //the node currently attempting a merge, the time and count it would get and the node it would be linked from
+    int attempt_node = -1;
+    int attempt_prev = -1;
+    int attempt_count = 0;
+    float attempt_time = 0;
 
     int total_node_count;
     int node_to_merge;
     int last_count;
     int recursion = 0;
     int has_recursed = 0;
+    int retracted = 0; //cases were taken back out (sliding window), which can leave edges out of time order
+
+    graph_journal *journal = nullptr; //gets every change merge_node and add_new_node make, only while building
+
+};
+
+//roughly what copying the graph costs, for the metrics
+long long graph_bytes(const master_trace &mt) {
+
+    return mt.nodes_container.size() * sizeof(node) + (mt.base_nodes.size() + mt.free_nodes.size()) * sizeof(int) +
+           mt.variant_bits.size() * sizeof(unsigned long long);
+}
+
+const std::string& node_name(const master_trace &mt, const node &n) {
+
+    return mt.names->strings[n.name_id];
+}
+
+int is_attempting_merge(const master_trace &mt, int node_index) {
+
+    return node_index == mt.attempt_node;
+}
+
+//the node a merge attempt would link this node to, -1 if none
+int extra_node(const master_trace &mt, int node_index) {
+
+    return node_index == mt.attempt_prev ? mt.attempt_node : -1;
+}
+
+void set_node_variant(master_trace &mt, int node_index, int variant, int value) {
+
+    //out of bits, give every node more words
+    if (variant >= mt.variant_words * 64) {
+
+        int words = std::max(mt.variant_words * 2, variant / 64 + 1);
+        std::vector<unsigned long long> bits(mt.nodes_container.size() * words, 0);
+        for (int i = 0; i * mt.variant_words < mt.variant_bits.size(); i++) {
+            std::copy(mt.variant_bits.begin() + i * mt.variant_words, mt.variant_bits.begin() + (i + 1) * mt.variant_words,
+                      bits.begin() + i * words);
+        }
+        mt.variant_bits.swap(bits);
+        mt.variant_words = words;
+    }
+
+    if (mt.variant_bits.size() < (node_index + 1) * mt.variant_words) {
+        mt.variant_bits.resize(mt.nodes_container.size() * mt.variant_words, 0);
+    }
+
+    unsigned long long &word = mt.variant_bits[node_index * mt.variant_words + variant / 64];
+    unsigned long long bit = 1ULL << (variant % 64);
+    word = value ? (word | bit) : (word & ~bit);
+}
+
+void add_node_variant(master_trace &mt, int node_index, const std::string &shorthand) {
+
+    set_node_variant(mt, node_index, intern(*mt.variants, shorthand), 1);
+}
+
+int node_has_variant(const master_trace &mt, int node_index, int variant) {
 
+    int word = node_index * mt.variant_words + variant / 64;
+    if (variant >= mt.variant_words * 64 || word >= mt.variant_bits.size()) { return 0; }
+
+    return (mt.variant_bits[word] >> (variant % 64)) & 1;
+}
+
+void clear_node_variants(master_trace &mt, int node_index) {
+
+    for (int i = node_index * mt.variant_words; i < (node_index + 1) * mt.variant_words && i < mt.variant_bits.size(); i++) {
+        mt.variant_bits[i] = 0;
+    }
+}
+
+std::vector<std::string> node_variant_names(const master_trace &mt, int node_index) {
+
+    std::vector<std::string> names;
+    for (int v = 0; v < mt.variants->strings.size(); v++) {
+        if (node_has_variant(mt, node_index, v)) { names.push_back(mt.variants->strings[v]); }
+    }
+
+    return names;
+}
+
+/*
+    Shared scratch for walking the graph. Visited marks are stamped with a generation number instead
+    of being cleared, so starting a walk is O(1) and once the buffers have grown to the graph size a
+    walk does not allocate. Each function that walks the graph keeps its own thread local graph_walk,
+    which keeps nested walks (check_valid_merge -> check_for_loops) apart.
+
+    The walk starts at the base nodes, which are queued but not marked, so a start node reachable from
+    another one is still visited where the old per-function loops visited it.
+*/
+struct graph_walk {
+
+    std::vector<int> pending;     //stack for depth first, queue for breadth first
+    std::vector<int> positions;   //per pending entry, next kid to look at (check_for_loops)
+    std::vector<unsigned> seen;   //== generation when the node has been queued
+    std::vector<unsigned> done;   //== generation when the node has been visited
+    unsigned generation = 0;
+    int head = 0;                 //next queue entry when breadth first
+    int breadth_first = 0;
+};
+
+void walk_begin(graph_walk &walk, const master_trace &mt, int breadth_first = 0) {
+
+    if (walk.seen.size() < mt.nodes_container.size()) {
+        walk.seen.resize(mt.nodes_container.size(), 0);
+        walk.done.resize(mt.nodes_container.size(), 0);
+    }
+
+    //wrapped around, old stamps could look current again
+    if (++walk.generation == 0) {
+        std::fill(walk.seen.begin(), walk.seen.end(), 0);
+        std::fill(walk.done.begin(), walk.done.end(), 0);
+        walk.generation = 1;
+    }
+
+    walk.head = 0;
+    walk.breadth_first = breadth_first;
+    walk.pending.assign(mt.base_nodes.begin(), mt.base_nodes.end());
+}
+
+//queues node_index unless it already has been queued or visited in this walk
+void walk_push(graph_walk &walk, int node_index) {
+
+    if (node_index == -1 || walk.seen[node_index] == walk.generation) { return; }
+
+    walk.seen[node_index] = walk.generation;
+    walk.pending.push_back(node_index);
+}
+
+//next node to visit, -1 when the walk is done
+int walk_next(graph_walk &walk) {
+
+    while (walk.head < walk.pending.size()) {
+
+        int node_index;
+        if (walk.breadth_first) {
+            node_index = walk.pending[walk.head++];
+        } else {
+            node_index = walk.pending.back();
+            walk.pending.pop_back();
+        }
+
+        if (walk.done[node_index] == walk.generation) { continue; }
+
+        walk.seen[node_index] = walk.done[node_index] = walk.generation;
+        return node_index;
+    }
+
+    return -1;
+}
+
+//live nodes, every node after all of its parents (Kahn). edges from a node to itself are left out with
+//ignore_self_loops. returns how many nodes are left out: on a cycle or only reachable through one, 0 if none
+int topological_order(const master_trace &mt, std::vector<int> &order, int ignore_self_loops = 0) {
+
+    static thread_local std::vector<int> in_degree;
+
+    order.clear();
+    in_degree.assign(mt.nodes_container.size(), 0);
+
+    int live = 0;
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        const node &n = mt.nodes_container[i];
+        if (n.deleted) { continue; }
+
+        live++;
+        for (int kid_index : n.next_nodes) {
+            if (kid_index != i || !ignore_self_loops) { in_degree[kid_index]++; }
+        }
+    }
+
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+        if (!mt.nodes_container[i].deleted && in_degree[i] == 0) { order.push_back(i); }
+    }
+
+    for (int r = 0; r < order.size(); r++) {
+        int i = order[r];
+        for (int kid_index : mt.nodes_container[i].next_nodes) {
+            if ((kid_index != i || !ignore_self_loops) && --in_degree[kid_index] == 0) { order.push_back(kid_index); }
+        }
+    }
+
+    return live - order.size();
+}
+
+/*
+    Invariant checker, one O(V + E) pass over the graph:
+      - flow: a node's incoming edge counts add up to its event_count (start nodes have no incoming edges,
+        all their cases start there) and its outgoing edge counts plus end_count add up to event_count too
+      - start/end: end_count is within event_count and as many cases start as end
+      - time order: a kid's average_time is not before its parent's
+      - loops: nodes on a cycle. an activity repeated back to back gives a node an edge to itself, those are
+        counted as self loops on their own
+    Builds with CHECK_INVARIANTS (make debug) run it after every merged variant, otherwise it runs once at the end.
+*/
+struct invariant_report {
+
+    int flow = 0;
+    int start_end = 0;
+    int time_order = 0;
+    int self_loops = 0;
+    int in_loops = 0;
+
+    int violations() const { return flow + start_end + time_order + in_loops; }
+};
+
+invariant_report check_invariants(const master_trace &mt, std::string when, int max_logged = 5) {
+
+    static thread_local std::vector<long long> incoming;
+    static thread_local std::vector<int> order;
+    static thread_local std::vector<char> is_base;
+
+    int size = mt.nodes_container.size();
+    incoming.assign(size, 0);
+    is_base.assign(size, 0);
+
+    invariant_report report;
+    int logged = 0;
+    long long starts = 0;
+    long long ends = 0;
+
+    for (int i : mt.base_nodes) { is_base[i] = 1; }
+
+    for (int i = 0; i < size; i++) {
+
+        const node &n = mt.nodes_container[i];
+        if (n.deleted) { continue; }
+
+        long long outgoing = n.end_count;
+        for (int j = 0; j < n.next_nodes.size(); j++) {
+
+            int kid_index = n.next_nodes[j];
+            outgoing += n.next_nodes_counts[j];
+            incoming[kid_index] += n.next_nodes_counts[j];
+
+            if (kid_index == i) {
+                report.self_loops++;
+                continue;
+            }
+
+            if (mt.nodes_container[kid_index].average_time < n.average_time) {
+                report.time_order++;
+                if (logged++ < max_logged) {
+                    log("  time order: " + node_name(mt, n) + std::to_string(i) + " -> " +
+                        node_name(mt, mt.nodes_container[kid_index]) + std::to_string(kid_index));
+                }
+            }
+        }
+
+        if (outgoing != n.event_count) {
+            report.flow++;
+            if (logged++ < max_logged) { log("  flow out of " + node_name(mt, n) + std::to_string(i) + ": ", (int)outgoing); }
+        }
+
+        if (n.end_count < 0 || n.end_count > n.event_count) {
+            report.start_end++;
+            if (logged++ < max_logged) { log("  end count of " + node_name(mt, n) + std::to_string(i) + ": ", n.end_count); }
+        }
+
+        if (is_base[i]) { starts += n.event_count; }
+        ends += n.end_count;
+    }
+
+    for (int i = 0; i < size; i++) {
+
+        const node &n = mt.nodes_container[i];
+        if (n.deleted) { continue; }
+
+        long long expected = is_base[i] ? 0 : n.event_count;
+        if (incoming[i] != expected) {
+            report.flow++;
+            if (logged++ < max_logged) { log("  flow into " + node_name(mt, n) + std::to_string(i) + ": ", (int)incoming[i]); }
+        }
+    }
+
+    if (starts != ends) {
+        report.start_end++;
+        if (logged++ < max_logged) { log("  cases starting: " + std::to_string(starts) + " ending: ", (int)ends); }
+    }
+
+    //whatever the order leaves out is on a cycle or only reachable through one
+    report.in_loops = topological_order(mt, order, 1);
+
+    if (report.violations()) {
+        log("Invariant violations " + when + ": flow " + std::to_string(report.flow) + " start/end " + std::to_string(report.start_end) +
+            " time order " + std::to_string(report.time_order) + " loops " + std::to_string(report.in_loops) +
+            " (self loops " + std::to_string(report.self_loops) + ")");
+    }
+
+    return report;
+}
+
+//one merge of a variant into the graph, i.e which node each of its events ended up in.
+//used to take cases out of the graph again (see retract_case)
+struct merge_record {
+
+    int count;                 //cases of this merge still in the graph
+    std::vector<int> nodes;
+    std::vector<float> times;  //mean times of those cases, cases are taken out with their own times
+};
+
+//shorthand -> merges of that variant, oldest first
+struct merge_history {
+
+    std::unordered_map<std::string, std::deque<merge_record> > variants;
+    std::unordered_map<int, int> starts; //node -> merges that start there, see index_merge_starts
+};
+
+//graph loaded from disk that newer logs get merged on top of, instead of building from variant 0
+struct graph_snapshot {
+
+    master_trace mt;
+    std::vector<unique_trace> variants; //the variants (and their counts) that are already merged into mt
+    int loaded = 0;
+};
+
+//command line options, see README for usage
+struct run_options {
+
+    std::string event_log_filename = "Exempel/DomesticDeclarations.xes_";
+    std::string snapshot_in;
+    std::string snapshot_out;
+
+    int follow = 0;
+    int follow_once = 0;           //read what has been appended, update outputs and exit (for cron etc)
+    float follow_interval = 2;     //seconds between polls
+
+    float window_days = 0;         //only cases that started this many days before the newest one are kept, 0 keeps everything
+
+    std::string partition;         //"month" or "quarter", builds one graph per period
+    int threads = 0;               //0 uses every core
+    std::string follow_state;      //defaults to the event log name + ".follow"
+    int consolidate = 0;           //run step 3 after building
+    int conformance = 0;           //replay the log through the finished graph
+    int score_bench = 0;           //benchmark online scoring against the finished graph
+    int case_index = 0;            //write cases9999.idx
+    int export_steps = 0;          //also write the graph after every merged variant as text
+    int dot = 0;                   //also write the graph as graph9999.dot
+    int json = 0;                  //also write the graph as graph9999.json
+    int svg = 0;                   //also draw the graph as graph9999.svg
+    int baseline = 0;              //also write the baseline DFG (one node per activity) as connections9999_old.txt
+    std::string batch_dir;         //run every log in this directory
+    std::string batch_out = "batch_output"; //[LOG]/ for each log of a batch and batch.txt go here
+    std::string cache_dir;         //batch results stored by a hash of log and options, reused when they match
+    int watch = 0;                 //keep running the batch directory as logs are added or modified
+    std::string serve;             //unix domain socket the graph service listens on
+    std::vector<std::string> client_args; //--request / --load-test arguments
+    std::string client;            //"request" or "load-test"
+    std::string journal_out;       //append every build step to this journal
+    std::string journal_in;        //rebuild a step from this journal instead of building
+    std::string journal_step;      //"variant" or "variant:letter"
+    std::string query;             //"case", "node" or "edge", answered from a case index instead of building
+    std::vector<std::string> query_args;
+    std::vector<std::string> bench_dirs; //benchmark every log in these directories instead of building
+    std::string golden_dir;        //graphs the benchmarked logs must still produce
+    std::string bench_save;        //benchmark results go here
+    std::string bench_compare;     //benchmark results to compare against
+    int bench_nodes = 0;           //also benchmark building, exporting and compacting a synthetic graph this big
+    std::string metrics;           //write counters and timers to [metrics].json / .prom
+    int check_window = 0;          //replay the log through the sliding window and compare with a rebuild
 };
 
 time_t parse_timestamp(const std::string& timestamp) {
@@ -144,15 +853,16 @@ std::string time_to_string(time_t t) {
 
 XMLElement* open_xes(std::string filename, XMLDocument &doc) {
 
+    phase_timer timer(PHASE_READ);
     XMLError eResult = doc.LoadFile(filename.c_str());
     if (eResult != XML_SUCCESS) {
-        std::cerr << "Error loading file: " << eResult << std::endl;
+        log("Error loading file: " + filename + " error: ", (int)eResult);
         return nullptr;
     }
 
     XMLElement* root = doc.FirstChildElement("log");
     if (root == nullptr) {
-        std::cerr << "No <log> element found in XES file" << std::endl;
+        log("No <log> element found in XES file: " + filename);
         return nullptr;
     }
 
@@ -184,50 +894,64 @@ void generate_shorthand(event_log &e_log, trace &t) {
     }
 }
 
-void fill_event_log(XMLElement* root, event_log &data) {
+void fill_trace(XMLElement* log_trace, event_log &data) {
 
-    for (XMLElement* log_trace = root->FirstChildElement("trace"); 
-        log_trace != nullptr; log_trace = log_trace->NextSiblingElement("trace")) {
+    trace t;
+    t.valid = 0;
 
-        trace t;
-        t.valid = 0;
+    for (XMLElement* attribute = log_trace->FirstChildElement(); attribute; attribute = attribute->NextSiblingElement()) {
 
-        for (XMLElement* log_event = log_trace->FirstChildElement("event"); 
-            log_event != nullptr; log_event = log_event->NextSiblingElement("event")) {
+        const char* key = attribute->Attribute("key");
+        if (key && std::string(key) == "concept:name" && attribute->Attribute("value")) {
+            t.case_id = attribute->Attribute("value");
+        }
+    }
+    if (t.case_id.empty()) { t.case_id = std::to_string(data.traces.size()); }
 
-            data.events++;
+    for (XMLElement* log_event = log_trace->FirstChildElement("event"); 
+        log_event != nullptr; log_event = log_event->NextSiblingElement("event")) {
 
-            event e;
+        data.events++;
 
-            for (XMLElement* attribute = log_event->FirstChildElement(); attribute; attribute = attribute->NextSiblingElement()) {
+        event e;
 
-                const char* key   = attribute->Attribute("key");
-                const char* value = attribute->Attribute("value");
-                
-                if        (key && std::string(key) == "id") {
-                    e.id = std::string(value);
-                } else if (key && std::string(key) == "org:resource") {
-                    e.resource = std::string(value);
-                } else if (key && std::string(key) == "concept:name") {
-                    e.name = std::string(value);
-                    if (std::find(data.activity_names.begin(), data.activity_names.end(), e.name) == data.activity_names.end()) {
-                        data.activity_names.push_back(e.name);
-                    }
-                } else if (key && std::string(key) == "org:role") {
-                    e.role = std::string(value);
-                } else if (key && std::string(key) == "time:timestamp") {
-                    e.time = parse_timestamp(std::string(value));
+        for (XMLElement* attribute = log_event->FirstChildElement(); attribute; attribute = attribute->NextSiblingElement()) {
+
+            const char* key   = attribute->Attribute("key");
+            const char* value = attribute->Attribute("value");
+            
+            if        (key && std::string(key) == "id") {
+                e.id = std::string(value);
+            } else if (key && std::string(key) == "org:resource") {
+                e.resource = std::string(value);
+            } else if (key && std::string(key) == "concept:name") {
+                e.name = std::string(value);
+                if (std::find(data.activity_names.begin(), data.activity_names.end(), e.name) == data.activity_names.end()) {
+                    data.activity_names.push_back(e.name);
                 }
+            } else if (key && std::string(key) == "org:role") {
+                e.role = std::string(value);
+            } else if (key && std::string(key) == "time:timestamp") {
+                e.time = parse_timestamp(std::string(value));
             }
-            t.names.push_back(e.name);
-
-            t.events.push_back(e);
         }
+        t.names.push_back(e.name);
+
+        t.events.push_back(e);
+    }
+
+    generate_shorthand(data, t);
+
+    data.traces.push_back(t);
+}
 
-        generate_shorthand(data, t);
+void fill_event_log(XMLElement* root, event_log &data) {
 
-        data.traces.push_back(t);
+    phase_timer timer(PHASE_PARSE);
+    for (XMLElement* log_trace = root->FirstChildElement("trace"); 
+        log_trace != nullptr; log_trace = log_trace->NextSiblingElement("trace")) {
 
+        fill_trace(log_trace, data);
     }
 
     data.average_events_per_trace = (float)data.events / (float)data.traces.size();
@@ -257,322 +981,786 @@ std::string seconds_to_timedelta_string(float seconds) {
     int secs = total_seconds;
 
     // Format: "X days HH:MM:SS"
-    std::ostringstream ss;
-    ss << days << " days ";
-    ss << std::setfill('0') << std::setw(2) << hours << ":"
-       << std::setw(2) << minutes << ":"
-       << std::setw(2) << secs;
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%d days %02d:%02d:%02d", days, hours, minutes, secs);
 
-    return ss.str();
+    return buffer;
 }
 
-//done
-void export_data(master_trace& mt, std::string ii) {
-    std::string conn_out = "connections" + ii + ".txt";
-    std::string time_out = "timestamps"  + ii + ".txt";
+/*
+    What every export format writes: the nodes in the order the graph walk reaches them, the edges in
+    that same order (each one once, the same edge listed twice in next_nodes would otherwise repeat), the
+    base nodes and the nodes that cases end in.
+*/
+struct export_view {
 
-    std::ofstream connections(conn_out);
-    std::ofstream timestamps(time_out);
+    std::vector<int> nodes;
+    std::vector<std::pair<int, int> > edges; //parent and the edge's position in parent.next_nodes
+    std::vector<int> exits;
+};
 
-    if (!connections || !timestamps) {
-        std::cerr << "Error opening file for writing." << std::endl;
-        exit(1);
-    }
+void collect_export(const master_trace& mt, export_view &view) {
 
-    std::vector<int> node_indexes;
+    static thread_local graph_walk walk;
     int parent_index = -1;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
-    std::vector<int> visited;
+    walk_begin(walk, mt);
 
-    std::vector<int> exit_node_indexes;
+    std::unordered_set<long long> edges_written;
 
-    std::vector<std::string> connection_strings;
-    std::vector<std::string> timestamp_strings;
+    while((parent_index = walk_next(walk)) != -1) {
 
-    while(!node_indexes.empty()) {
+	    const node& parent = mt.nodes_container[parent_index];
+        view.nodes.push_back(parent_index);
 
-        parent_index = node_indexes.back();
-        node_indexes.pop_back();
-	    node& parent = mt.nodes_container[parent_index];
-        visited.push_back(parent_index);
+        for (int i = 0; i < parent.next_nodes.size(); i++) {
+
+      	    int kid_index = parent.next_nodes[i];
 
-        std::string parent_s = parent.name + std::to_string(parent.creationID);
-        std::string timestamp = seconds_to_timedelta_string(parent.average_time);
-        std::string timestamp_out = parent_s + " | " + timestamp;
+            if (edges_written.insert(((long long)parent_index << 32) | (unsigned int)kid_index).second) {
+                view.edges.push_back(std::make_pair(parent_index, i));
+            }
 
-        if (std::find(timestamp_strings.begin(), timestamp_strings.end(), timestamp_out) == timestamp_strings.end()) {
-            timestamps << timestamp_out << std::endl;
-            timestamp_strings.push_back(timestamp_out);
+            walk_push(walk, kid_index);
         }
 
-        
+        if (parent.end_count != 0) {
+            view.exits.push_back(parent_index);
+        }
+    }
+}
 
-        for (int i = 0; i < parent.next_nodes.size(); i++) {
+std::string node_label(const master_trace& mt, int node_index) {
 
-      	    int kid_index = parent.next_nodes[i];
-    	    node& kid = mt.nodes_container[kid_index];
-            
-            std::string kid_s    = kid.name + std::to_string(kid.creationID);
-            std::string count    = std::to_string(parent.next_nodes_counts[i]);
-            std::string connection_out = parent_s + "," + kid_s + "," + count;
+    const node& n = mt.nodes_container[node_index];
+    return node_name(mt, n) + std::to_string(n.creationID);
+}
 
+//renders the graph as connections.txt / timestamps.txt
+void render_export(const master_trace& mt, std::string &connections, std::string &timestamps) {
 
-            if (std::find(connection_strings.begin(), connection_strings.end(), connection_out) == connection_strings.end()) {
-                connections << connection_out << std::endl;
-                connection_strings.push_back(connection_out);
-            }
+    export_view view;
+    collect_export(mt, view);
+
+    for (int i : view.nodes) {
+        timestamps += node_label(mt, i) + " | " + seconds_to_timedelta_string(mt.nodes_container[i].average_time) + "\n";
+    }
+
+    for (const std::pair<int, int> &edge : view.edges) {
+
+        const node& parent = mt.nodes_container[edge.first];
+        connections += node_label(mt, edge.first) + "," + node_label(mt, parent.next_nodes[edge.second]) + "," +
+                       std::to_string(parent.next_nodes_counts[edge.second]) + "\n";
+    }
 
-            if (std::find(visited.begin(), visited.end(), kid_index) == visited.end()) {
+    // Start nodes
+    for (int i : mt.base_nodes) {
+        connections += "Start:" + node_label(mt, i) + "," + std::to_string(mt.nodes_container[i].event_count) + "\n";
+    }
 
-                node_indexes.insert(node_indexes.end(), kid_index);
-                visited.push_back(kid_index);
-            }            
+    // End nodes
+    for (int i : view.exits) {
+        connections += "End:" + node_label(mt, i) + "," + std::to_string(mt.nodes_container[i].end_count) + "\n";
+    }
+}
 
+//escapes a string for a quoted DOT id or a JSON string, both use backslash escapes
+std::string quote_escape(const std::string &s) {
+
+    std::string out;
+    for (char c : s) {
+        if      (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (c == '\n')             { out += "\\n"; }
+        else if ((unsigned char)c < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
         }
+        else { out += c; }
+    }
 
-        if (parent.end_count != 0) {
+    return out;
+}
 
-            int exists_already = 0;
-            for (int e_i :  exit_node_indexes) {
+//floats are written with enough digits to read back the same value
+std::string number_string(double d) {
 
-                if (parent_index == e_i) {
-                    exists_already = 1;
-                }
-            }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", d);
+    return buffer;
+}
 
-            if (exists_already == 0) {
-                exit_node_indexes.push_back(parent_index);
-            }
+/*
+    Graphviz DOT, drawn like the timeline view generate_graph.py produces: one box per node labelled with
+    its name and mean time, edges labelled and weighted by count, and start/end circles linked to the
+    base and exit nodes. Nodes are n[INDEX], the mean time is also kept in seconds as a node attribute.
+*/
+std::string render_dot(const master_trace& mt) {
 
-        }
+    export_view view;
+    collect_export(mt, view);
+
+    int max_count = 1;
+    for (const std::pair<int, int> &edge : view.edges) {
+        max_count = std::max(max_count, mt.nodes_container[edge.first].next_nodes_counts[edge.second]);
     }
 
-    // Start nodes
-    for (int i : mt.base_nodes) {
+    std::string dot = "digraph master_trace {\n";
+    dot += "    node [shape=box, style=\"rounded,filled\", fillcolor=\"#ececec\", fontname=\"Arial\"];\n";
+    dot += "    start [shape=circle, label=\"\", fillcolor=\"#32cd32\", style=filled];\n";
+    dot += "    end [shape=circle, label=\"\", fillcolor=\"#ffa500\", style=filled];\n";
+
+    for (int i : view.nodes) {
+        const node& n = mt.nodes_container[i];
+        dot += "    n" + std::to_string(i) + " [label=\"" + quote_escape(node_label(mt, i)) + "\\n" +
+               seconds_to_timedelta_string(n.average_time) + "\", seconds=" + number_string(n.average_time) +
+               ", count=" + std::to_string(n.event_count) + "];\n";
+    }
 
-	   node& n = mt.nodes_container[i];
-        std::string start_output = n.name + std::to_string(n.creationID);
-        std::string count    = std::to_string(n.event_count);
-        connections << "Start:" << start_output << "," << count << std::endl;
+    for (const std::pair<int, int> &edge : view.edges) {
+        const node& parent = mt.nodes_container[edge.first];
+        int count = parent.next_nodes_counts[edge.second];
+        dot += "    n" + std::to_string(edge.first) + " -> n" + std::to_string(parent.next_nodes[edge.second]) +
+               " [label=\"" + std::to_string(count) + "\", penwidth=" + number_string(1 + 4.0 * count / max_count) + "];\n";
+    }
 
+    for (int i : mt.base_nodes) {
+        dot += "    start -> n" + std::to_string(i) + " [label=\"" + std::to_string(mt.nodes_container[i].event_count) + "\"];\n";
     }
 
-    // End nodes
-    for (int i : exit_node_indexes) {
+    for (int i : view.exits) {
+        dot += "    n" + std::to_string(i) + " -> end [label=\"" + std::to_string(mt.nodes_container[i].end_count) + "\"];\n";
+    }
+
+    dot += "}\n";
+    return dot;
+}
 
-	    node& n = mt.nodes_container[i];
-        std::string output = n.name + std::to_string(n.creationID);
-        std::string count  = std::to_string(n.end_count);
-        connections << "End:" << output << "," << count << std::endl;
+/*
+    The whole graph as one JSON document:
+        {"nodes": [{"id", "label", "name", "seconds", "count", "end"}...],
+         "edges": [{"from", "to", "count"}...],
+         "start": [{"node", "count"}...], "end": [{"node", "count"}...]}
+    ids are node indexes (the number in the label), times are mean seconds.
+*/
+std::string render_json(const master_trace& mt) {
+
+    export_view view;
+    collect_export(mt, view);
+
+    std::string json = "{\n\"nodes\": [";
+    for (int k = 0; k < view.nodes.size(); k++) {
+        int i = view.nodes[k];
+        const node& n = mt.nodes_container[i];
+        json += std::string(k == 0 ? "\n" : ",\n") + "  {\"id\": " + std::to_string(i) +
+                ", \"label\": \"" + quote_escape(node_label(mt, i)) + "\", \"name\": \"" + quote_escape(node_name(mt, n)) +
+                "\", \"seconds\": " + number_string(n.average_time) + ", \"count\": " + std::to_string(n.event_count) +
+                ", \"end\": " + std::to_string(n.end_count) + "}";
+    }
 
+    json += "\n],\n\"edges\": [";
+    for (int k = 0; k < view.edges.size(); k++) {
+        const node& parent = mt.nodes_container[view.edges[k].first];
+        json += std::string(k == 0 ? "\n" : ",\n") + "  {\"from\": " + std::to_string(view.edges[k].first) +
+                ", \"to\": " + std::to_string(parent.next_nodes[view.edges[k].second]) +
+                ", \"count\": " + std::to_string(parent.next_nodes_counts[view.edges[k].second]) + "}";
     }
 
+    json += "\n],\n\"start\": [";
+    for (int k = 0; k < mt.base_nodes.size(); k++) {
+        int i = mt.base_nodes[k];
+        json += std::string(k == 0 ? "" : ", ") + "{\"node\": " + std::to_string(i) +
+                ", \"count\": " + std::to_string(mt.nodes_container[i].event_count) + "}";
+    }
 
-    connections.close();
-    timestamps.close();
+    json += "],\n\"end\": [";
+    for (int k = 0; k < view.exits.size(); k++) {
+        int i = view.exits[k];
+        json += std::string(k == 0 ? "" : ", ") + "{\"node\": " + std::to_string(i) +
+                ", \"count\": " + std::to_string(mt.nodes_container[i].end_count) + "}";
+    }
 
+    json += "]\n}\n";
+    return json;
 }
 
-void export_data(master_trace& mt, int ii) {
+//runs job(i) for every i in [0, count) on a pool of worker threads, which write to the caller's output dir
+template <typename F>
+void parallel_for(int count, int threads, F job) {
 
-    std::string s = std::to_string(ii);
-    export_data(mt, s);
+    if (threads <= 0) { threads = std::thread::hardware_concurrency(); }
+    if (threads <= 0) { threads = 1; }
+    threads = std::min(threads, count);
+
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    std::string dir = output_dir;
+
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&]() {
+            output_dir = dir;
+            int i;
+            while ((i = next++) < count) { job(i); }
+        }));
+    }
 
+    for (std::thread &w : workers) { w.join(); }
 }
 
-//done
-float calc_time_diff_event(node& node, std::vector<trace> &traces) {
+/*
+    Timeline layout, draws the graph as SVG without pm4py. Like pm4py's timeline view, time runs downwards:
+    every distinct mean time is a layer, so how far down a node is drawn is fixed by its average_time.
+    Start and end get a layer of their own above and below the rest.
+
+    Sugiyama-style: an edge spanning several layers goes through a dummy vertex in each layer in between,
+    then the order within the layers is improved by barycenter sweeps. The sweeps are run from LAYOUT_RUNS
+    starting orders on the thread pool, the order with the fewest crossings wins (the lowest run on ties)
+    so the picture does not depend on the thread count.
+*/
+#define LAYOUT_RUNS   8
+#define LAYOUT_SWEEPS 12
 
-    float sum = 0;
+#define LAYOUT_X      170  //room for a node in a layer
+#define LAYOUT_DUMMY  24   //room for an edge passing through a layer
+#define LAYOUT_Y      80   //between layers
+#define LAYOUT_AXIS   130  //room for the time axis on the left
+#define LAYOUT_MARGIN 30
+#define BOX_W         140
+#define BOX_H         34
 
-    for (int i = 0; i < traces.size(); i++) {
+#define VERTEX_START -1
+#define VERTEX_END   -2
+#define VERTEX_DUMMY -3
 
-        for (int j = 0; j < node.unique_traces.size(); j++) {
+struct layout_edge {
 
-            if (node.unique_traces[j] == traces[i].shorthand) {
+    std::vector<int> vertices; //from the edge's source to its target, dummies in between
+    int count;
+};
 
-                for (int k = 0; k < traces[i].events.size(); k++) {
+struct timeline_layout {
 
-                    //we finally found a hit!
-                    if (node.event_type == traces[i].events[k].type && traces[i].events[k].used == 0) {
+    std::vector<int> vertex_node;               //node index or VERTEX_*
+    std::vector<int> vertex_layer;
+    std::vector<std::vector<int> > up;          //neighbours in the layer above
+    std::vector<std::vector<int> > down;        //neighbours in the layer below
+    std::vector<std::vector<int> > layers;      //vertices of each layer, in drawing order
+    std::vector<float> layer_time;
+    std::vector<layout_edge> edges;
+    std::vector<int> node_vertex;               //vertex of each node, -1 if not drawn
+};
 
-                        float rel_time = traces[i].events[k].time - traces[i].events[0].time;
-                        float diff = node.average_time - rel_time;
-                        float abs_diff = diff < 0 ? -diff : diff;
-                        sum =+ abs_diff;
+int add_vertex(timeline_layout &layout, int node_index, int layer) {
 
-                        traces[i].events[k].used = 1;
-                    }
-                }
-            }
+    int v = layout.vertex_node.size();
+    layout.vertex_node.push_back(node_index);
+    layout.vertex_layer.push_back(layer);
+    layout.up.push_back(std::vector<int>());
+    layout.down.push_back(std::vector<int>());
+    layout.layers[layer].push_back(v);
+    return v;
+}
+
+//links from and to through a dummy vertex in every layer between them
+void add_layout_edge(timeline_layout &layout, int from, int to, int count) {
+
+    layout_edge edge;
+    edge.count = count;
+    edge.vertices.push_back(from);
+
+    int from_layer = layout.vertex_layer[from];
+    int to_layer = layout.vertex_layer[to];
+    int step = to_layer > from_layer ? 1 : -1;
+
+    if (from_layer != to_layer) {
+        for (int l = from_layer + step; l != to_layer; l += step) {
+            edge.vertices.push_back(add_vertex(layout, VERTEX_DUMMY, l));
         }
     }
+    edge.vertices.push_back(to);
+
+    for (int i = 0; i + 1 < edge.vertices.size() && from_layer != to_layer; i++) {
+        int a = edge.vertices[i];
+        int b = edge.vertices[i + 1];
+        if (step < 0) { std::swap(a, b); }
+        layout.down[a].push_back(b);
+        layout.up[b].push_back(a);
+    }
 
-    return sum;
+    layout.edges.push_back(edge);
 }
 
-//done
-float calc_time_diff(master_trace& mt, int event_count, std::vector<trace> &traces) {
+void build_timeline_layout(const master_trace& mt, const export_view &view, timeline_layout &layout) {
 
-    float sum = 0;
+    std::vector<float> times;
+    for (int i : view.nodes) { times.push_back(mt.nodes_container[i].average_time); }
+    std::sort(times.begin(), times.end());
+    times.erase(std::unique(times.begin(), times.end()), times.end());
 
-    for (trace &t : traces) {
-        for (event &e : t.events) {
-            e.used = 0;
-        }
+    layout.layer_time = times;
+    layout.layers.resize(times.size() + 2);
+    layout.node_vertex.assign(mt.nodes_container.size(), -1);
+
+    int start = add_vertex(layout, VERTEX_START, 0);
+    for (int i : view.nodes) {
+        int layer = 1 + std::lower_bound(times.begin(), times.end(), mt.nodes_container[i].average_time) - times.begin();
+        layout.node_vertex[i] = add_vertex(layout, i, layer);
     }
+    int end = add_vertex(layout, VERTEX_END, times.size() + 1);
 
-    std::vector<int> node_indexes;
-    int parent_index = -1;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
+    for (int i : mt.base_nodes) {
+        if (layout.node_vertex[i] != -1) { add_layout_edge(layout, start, layout.node_vertex[i], mt.nodes_container[i].event_count); }
+    }
+
+    for (const std::pair<int, int> &edge : view.edges) {
+        const node& parent = mt.nodes_container[edge.first];
+        add_layout_edge(layout, layout.node_vertex[edge.first], layout.node_vertex[parent.next_nodes[edge.second]],
+                        parent.next_nodes_counts[edge.second]);
+    }
 
-    while(!node_indexes.empty()) {
+    for (int i : view.exits) {
+        add_layout_edge(layout, layout.node_vertex[i], end, mt.nodes_container[i].end_count);
+    }
+}
+
+//crossings between the segments of two neighbouring layers, counted as inversions with a fenwick tree
+long long count_crossings(const timeline_layout &layout, const std::vector<int> &position, int layer) {
+
+    std::vector<std::pair<int, int> > segments;
+    for (int v : layout.layers[layer]) {
+        for (int kid : layout.down[v]) { segments.push_back(std::make_pair(position[v], position[kid])); }
+    }
+    std::sort(segments.begin(), segments.end());
+
+    int size = layout.layers[layer + 1].size();
+    std::vector<int> tree(size + 1, 0);
+    long long crossings = 0;
+    int seen = 0;
 
-        parent_index = node_indexes.back();
-        node_indexes.pop_back();
-	node& parent = mt.nodes_container[parent_index];
+    for (const std::pair<int, int> &segment : segments) {
 
-        sum += calc_time_diff_event(parent, traces);
+        int not_above = 0;
+        for (int i = segment.second + 1; i > 0; i -= i & -i) { not_above += tree[i]; }
+        crossings += seen - not_above;
 
-        node_indexes.insert(node_indexes.begin(), parent.next_nodes.begin(), parent.next_nodes.end());
+        for (int i = segment.second + 1; i <= size; i += i & -i) { tree[i]++; }
+        seen++;
     }
 
-    for (trace &t : traces) {
-        for (event &e : t.events) {
-            if (e.used != 1) {
-                log("Error - missed event when calculating time diff");
-                exit(1);
-            }
+    return crossings;
+}
+
+long long total_crossings(const timeline_layout &layout, const std::vector<int> &position) {
+
+    long long crossings = 0;
+    for (int l = 0; l + 1 < layout.layers.size(); l++) { crossings += count_crossings(layout, position, l); }
+    return crossings;
+}
+
+//orders a layer by the mean position of each vertex's neighbours, vertices without any keep their place
+void sort_by_barycenter(std::vector<int> &layer, const std::vector<std::vector<int> > &neighbours, std::vector<int> &position) {
+
+    std::vector<std::pair<double, int> > keyed;
+    for (int v : layer) {
+        double key = position[v];
+        if (!neighbours[v].empty()) {
+            key = 0;
+            for (int n : neighbours[v]) { key += position[n]; }
+            key /= neighbours[v].size();
         }
+        keyed.push_back(std::make_pair(key, v));
     }
 
-    sum /= event_count;
+    std::stable_sort(keyed.begin(), keyed.end(),
+        [](const std::pair<double, int> &a, const std::pair<double, int> &b) { return a.first < b.first; });
+
+    for (int i = 0; i < layer.size(); i++) {
+        layer[i] = keyed[i].second;
+        position[layer[i]] = i;
+    }
+}
 
-    return sum;
+void set_positions(const std::vector<std::vector<int> > &layers, std::vector<int> &position) {
 
+    for (const std::vector<int> &layer : layers) {
+        for (int i = 0; i < layer.size(); i++) { position[layer[i]] = i; }
+    }
 }
 
-std::vector<unique_trace> step_1_calc_unique_traces(std::vector<trace> &traces) {
+//barycenter sweeps down and up from one starting order, keeps the best order seen
+long long reduce_crossings(const timeline_layout &layout, std::vector<std::vector<int> > &layers, int run) {
 
-    std::vector<unique_trace> unique_traces;
+    //run 0 starts from the order of the graph walk, the others from a shuffle of it
+    std::mt19937 random(run);
+    for (int l = 0; l < layers.size() && run != 0; l++) {
+        for (int i = layers[l].size() - 1; i > 0; i--) { std::swap(layers[l][i], layers[l][random() % (i + 1)]); }
+    }
 
-    for (int i = 0; i < traces.size(); i++) {
-    //for (int i = 0; i < 500; i++) {
+    std::vector<int> position(layout.vertex_node.size());
+    set_positions(layers, position);
 
-        trace t = traces[i];
+    std::vector<std::vector<int> > best = layers;
+    long long best_crossings = total_crossings(layout, position);
 
-        //each unique trace, checking for match
-        int new_unique = 1;
-        int ut_index_match = -1;
-        for (int j = 0; j < unique_traces.size(); j++) {
+    for (int sweep = 0; sweep < LAYOUT_SWEEPS && best_crossings > 0; sweep++) {
 
-            if (unique_traces[j].shorthand == t.shorthand) { 
-                new_unique = 0;
-                ut_index_match = j;
-            }
-        }
+        for (int l = 1; l < layers.size(); l++)      { sort_by_barycenter(layers[l], layout.up, position); }
+        for (int l = layers.size() - 2; l >= 0; l--) { sort_by_barycenter(layers[l], layout.down, position); }
 
-        if (new_unique) {
+        long long crossings = total_crossings(layout, position);
+        if (crossings >= best_crossings) { break; }
 
-            unique_trace new_unique;
-            new_unique.shorthand   = t.shorthand;
-            new_unique.names = t.names;
-            new_unique.count = 1;
+        best = layers;
+        best_crossings = crossings;
+    }
 
-            time_t base_time = t.events[0].time;
+    layers = best;
+    return best_crossings;
+}
 
-            for (int j = 0; j < t.events.size(); j++) {
+std::string xml_escape(const std::string &s) {
 
-                new_unique.events.push_back(t.events[j].type);
-                if (j == 0) {
-                    new_unique.times.push_back(0);
-                } else {
-                    new_unique.times.push_back(t.events[j].time - base_time); 
-                }
-            }
+    std::string out;
+    for (char c : s) {
+        if      (c == '&')  { out += "&amp;"; }
+        else if (c == '<')  { out += "&lt;"; }
+        else if (c == '>')  { out += "&gt;"; }
+        else if (c == '"')  { out += "&quot;"; }
+        else                { out += c; }
+    }
 
-            unique_traces.push_back(new_unique);
+    return out;
+}
 
-        } else {
+std::string render_svg(const master_trace& mt, int threads) {
 
-            time_t base_time = t.events[0].time;
+    export_view view;
+    collect_export(mt, view);
 
-            for (int k = 1; k < t.events.size(); k++) {
+    timeline_layout layout;
+    build_timeline_layout(mt, view, layout);
 
-                unique_traces[ut_index_match].times[k] = merge_time(1, t.events[k].time - base_time, 
-                    unique_traces[ut_index_match].count, unique_traces[ut_index_match].times[k]);    
+    std::vector<std::vector<std::vector<int> > > orders(LAYOUT_RUNS, layout.layers);
+    std::vector<long long> crossings(LAYOUT_RUNS);
+    parallel_for(LAYOUT_RUNS, threads, [&](int run) { crossings[run] = reduce_crossings(layout, orders[run], run); });
+
+    int best = std::min_element(crossings.begin(), crossings.end()) - crossings.begin();
+    layout.layers = orders[best];
+
+    //every layer is centered on the widest one
+    std::vector<int> layer_width(layout.layers.size(), 0);
+    for (int l = 0; l < layout.layers.size(); l++) {
+        for (int v : layout.layers[l]) { layer_width[l] += layout.vertex_node[v] == VERTEX_DUMMY ? LAYOUT_DUMMY : LAYOUT_X; }
+    }
+    int widest = *std::max_element(layer_width.begin(), layer_width.end());
+
+    std::vector<double> x(layout.vertex_node.size());
+    std::vector<double> y(layout.vertex_node.size());
+    for (int l = 0; l < layout.layers.size(); l++) {
+        double left = LAYOUT_MARGIN + LAYOUT_AXIS + (widest - layer_width[l]) / 2.0;
+        for (int v : layout.layers[l]) {
+            int room = layout.vertex_node[v] == VERTEX_DUMMY ? LAYOUT_DUMMY : LAYOUT_X;
+            x[v] = left + room / 2.0;
+            y[v] = LAYOUT_MARGIN + (l + 0.5) * LAYOUT_Y;
+            left += room;
+        }
+    }
+
+    int width = 2 * LAYOUT_MARGIN + LAYOUT_AXIS + widest;
+    int height = 2 * LAYOUT_MARGIN + layout.layers.size() * LAYOUT_Y;
+
+    std::string svg = "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" + std::to_string(width) + "\" height=\"" +
+                      std::to_string(height) + "\" font-family=\"Arial\" font-size=\"12\">\n";
+    svg += "<defs><marker id=\"arrow\" viewBox=\"0 0 10 10\" refX=\"10\" refY=\"5\" markerWidth=\"6\" markerHeight=\"6\" "
+           "orient=\"auto-start-reverse\"><path d=\"M0,0 L10,5 L0,10 z\" fill=\"#444\"/></marker></defs>\n";
+    svg += "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n";
+
+    //time axis, one tick per layer
+    for (int l = 0; l < layout.layer_time.size(); l++) {
+        std::string ty = number_string(LAYOUT_MARGIN + (l + 1.5) * LAYOUT_Y);
+        svg += "<line x1=\"" + std::to_string(LAYOUT_MARGIN + LAYOUT_AXIS - 10) + "\" y1=\"" + ty + "\" x2=\"" + std::to_string(width - LAYOUT_MARGIN) +
+               "\" y2=\"" + ty + "\" stroke=\"#ddd\" stroke-dasharray=\"4 4\"/>\n";
+        svg += "<text x=\"" + std::to_string(LAYOUT_MARGIN) + "\" y=\"" + ty + "\" dy=\"4\" fill=\"#666\">" +
+               seconds_to_timedelta_string(layout.layer_time[l]) + "</text>\n";
+    }
+
+    int max_count = 1;
+    for (const layout_edge &edge : layout.edges) { max_count = std::max(max_count, edge.count); }
+
+    for (const layout_edge &edge : layout.edges) {
+
+        int from = edge.vertices.front();
+        int to = edge.vertices.back();
+        std::string path;
+
+        if (edge.vertices.size() == 2 && layout.vertex_layer[from] == layout.vertex_layer[to]) {
+            //same time on both ends, bow out below the layer
+            double bow = y[from] + BOX_H / 2 + 20 + std::abs(x[to] - x[from]) / 8;
+            path = "M" + number_string(x[from]) + "," + number_string(y[from] + BOX_H / 2) + " Q" +
+                   number_string((x[from] + x[to]) / 2) + "," + number_string(bow) + " " +
+                   number_string(x[to]) + "," + number_string(y[to] + BOX_H / 2);
+        } else {
+            //start and end on the box edge that faces the rest of the edge
+            for (int i = 0; i < edge.vertices.size(); i++) {
+                int v = edge.vertices[i];
+                double py = y[v];
+                if (i == 0) { py += (y[edge.vertices[1]] > y[v] ? 1 : -1) * BOX_H / 2.0; }
+                if (i == edge.vertices.size() - 1) { py += (y[edge.vertices[i - 1]] > y[v] ? 1 : -1) * BOX_H / 2.0; }
+                path += (i == 0 ? "M" : " L") + number_string(x[v]) + "," + number_string(py);
             }
+        }
+
+        svg += "<path d=\"" + path + "\" fill=\"none\" stroke=\"#444\" stroke-width=\"" +
+               number_string(1 + 4.0 * edge.count / max_count) + "\" marker-end=\"url(#arrow)\"/>\n";
+
+        int label = edge.vertices.size() > 2 ? edge.vertices[1] : to;
+        double lx = edge.vertices.size() > 2 ? x[label] : (x[from] + x[to]) / 2;
+        double ly = edge.vertices.size() > 2 ? y[label] : (y[from] + y[to]) / 2;
+        svg += "<text x=\"" + number_string(lx + 6) + "\" y=\"" + number_string(ly) + "\" fill=\"#444\">" +
+               std::to_string(edge.count) + "</text>\n";
+    }
 
-            unique_traces[ut_index_match].count++;
+    for (int v = 0; v < layout.vertex_node.size(); v++) {
+
+        int n = layout.vertex_node[v];
+        if (n == VERTEX_DUMMY) { continue; }
+
+        if (n == VERTEX_START || n == VERTEX_END) {
+            svg += "<circle cx=\"" + number_string(x[v]) + "\" cy=\"" + number_string(y[v]) + "\" r=\"" +
+                   std::to_string(BOX_H / 2) + "\" fill=\"" + (n == VERTEX_START ? "#32cd32" : "#ffa500") + "\"/>\n";
+            continue;
         }
+
+        svg += "<rect x=\"" + number_string(x[v] - BOX_W / 2) + "\" y=\"" + number_string(y[v] - BOX_H / 2) + "\" width=\"" +
+               std::to_string(BOX_W) + "\" height=\"" + std::to_string(BOX_H) + "\" rx=\"8\" fill=\"#ececec\" stroke=\"#333\"/>\n";
+        svg += "<text x=\"" + number_string(x[v]) + "\" y=\"" + number_string(y[v]) + "\" dy=\"4\" text-anchor=\"middle\">" +
+               xml_escape(node_label(mt, n)) + " (" + std::to_string(mt.nodes_container[n].event_count) + ")</text>\n";
     }
 
-    return unique_traces;
+    svg += "</svg>\n";
+
+    log("Layout crossings: " + std::to_string(crossings[best]) + " run: ", best);
+    return svg;
 }
 
+//1 on success
+int write_export(std::string filename, const std::string &contents) {
 
+    std::ofstream out(output_path(filename), std::ios::binary);
+    if (!out) {
+        log("Error opening file for writing: " + output_path(filename));
+        return 0;
+    }
 
-int loop(std::vector<int> &node_indexes, std::vector<int> &visited, master_trace &mt) {
+    out.write(contents.data(), contents.size());
+    return 1;
+}
 
-    int parent_index = node_indexes.back();
-    visited.insert(visited.begin(), parent_index);
-    
-    const node& parent = mt.nodes_container[parent_index];
+//done
+int export_data(const master_trace& mt, std::string ii) {
 
-    for (int i : parent.next_nodes) {
+    phase_timer timer(PHASE_EXPORT);
+    std::string connections;
+    std::string timestamps;
+    render_export(mt, connections, timestamps);
 
-        //loop found
-        if (std::find(node_indexes.begin(), node_indexes.end(), i) != node_indexes.end()) {
+    return write_export("connections" + ii + ".txt", connections) &&
+           write_export("timestamps"  + ii + ".txt", timestamps);
+}
 
-            return 1;
-        }
+int export_data(const master_trace& mt, int ii) {
 
-        if (std::find(visited.begin(), visited.end(), i) == visited.end()) {
+    std::string s = std::to_string(ii);
+    return export_data(mt, s);
 
-            node_indexes.insert(node_indexes.end(), i);
-            if (loop(node_indexes, visited, mt)) {
-                return 1;
-            }
+}
+
+//graph[ii].dot / .json / .svg, written next to connections[ii].txt when asked for. 1 on success
+int export_formats(const master_trace& mt, std::string ii, const run_options &opts) {
+
+    if (opts.dot  && !write_export("graph" + ii + ".dot",  render_dot(mt)))  { return 0; }
+    if (opts.json && !write_export("graph" + ii + ".json", render_json(mt))) { return 0; }
+    if (opts.svg  && !write_export("graph" + ii + ".svg",  render_svg(mt, opts.threads))) { return 0; }
+    return 1;
+}
+
+/*
+    Step exports (connections0.txt, connections1.txt...) are written on a background thread, so building
+    never waits on the disk. The builder hands over a copy of the nodes and names (the names table keeps
+    growing while the builder runs, so it can't be shared). At most EXPORT_QUEUE copies wait at a time.
+    The files go to the output directory of the thread that started the exporter (a batch job's directory).
+*/
+#define EXPORT_QUEUE 8
+
+struct background_exporter {
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::pair<std::shared_ptr<const master_trace>, std::string> > jobs;
+    int stopping = 0;
+    std::thread worker;
+
+    std::string output_dir;  //output_dir is per thread, this is the starting thread's
+    int failed = 0;          //exports that could not be written
+};
+
+void run_exporter(background_exporter &exporter) {
+
+    output_dir = exporter.output_dir;
+
+    while (true) {
+
+        std::pair<std::shared_ptr<const master_trace>, std::string> job;
+        {
+            std::unique_lock<std::mutex> guard(exporter.lock);
+            exporter.changed.wait(guard, [&]() { return !exporter.jobs.empty() || exporter.stopping; });
+            if (exporter.jobs.empty()) { return; }
+
+            job = exporter.jobs.front();
+            exporter.jobs.pop_front();
         }
+        exporter.changed.notify_all();
 
+        if (!export_data(*job.first, job.second)) { exporter.failed++; }
     }
+}
 
-    if (parent.extra_node != -1) {
+void start_exporter(background_exporter &exporter) {
 
-        if (std::find(node_indexes.begin(), node_indexes.end(), parent.extra_node) != node_indexes.end()) {
+    exporter.output_dir = output_dir;
+    exporter.worker = std::thread(run_exporter, std::ref(exporter));
+}
 
-            return 1;
-        }
+void export_in_background(background_exporter &exporter, const master_trace &mt, std::string ii) {
+
+    std::shared_ptr<master_trace> copy = std::make_shared<master_trace>();
+    copy->nodes_container = mt.nodes_container;
+    copy->base_nodes = mt.base_nodes;
+    copy->names = std::make_shared<string_table>(*mt.names);
 
-        if (std::find(visited.begin(), visited.end(), parent.extra_node) == visited.end()) {
+    std::unique_lock<std::mutex> guard(exporter.lock);
+    exporter.changed.wait(guard, [&]() { return exporter.jobs.size() < EXPORT_QUEUE; });
+    exporter.jobs.push_back(std::make_pair(std::shared_ptr<const master_trace>(copy), ii));
+    guard.unlock();
+    exporter.changed.notify_all();
+}
 
-            node_indexes.insert(node_indexes.end(), parent.extra_node);
+//writes what is still queued and stops the thread, returns how many exports failed
+int finish_exporter(background_exporter &exporter) {
 
-            if (loop(node_indexes, visited, mt)) {
-                return 1;
+    {
+        std::lock_guard<std::mutex> guard(exporter.lock);
+        exporter.stopping = 1;
+    }
+    exporter.changed.notify_all();
+    exporter.worker.join();
+    return exporter.failed;
+}
+
+//adds t to the variant it belongs to (updating its count and running mean times) or creates a new variant.
+//variant_index maps shorthand -> index in unique_traces and is kept in sync
+void add_trace_to_unique_traces(std::vector<unique_trace> &unique_traces,
+                                std::unordered_map<std::string, int> &variant_index, const trace &t) {
+
+    std::unordered_map<std::string, int>::iterator it = variant_index.find(t.shorthand);
+    time_t base_time = t.events[0].time;
+
+    if (it == variant_index.end()) {
+
+        unique_trace new_unique;
+        new_unique.shorthand   = t.shorthand;
+        new_unique.names = t.names;
+        new_unique.count = 1;
+
+        for (int j = 0; j < t.events.size(); j++) {
+
+            new_unique.events.push_back(t.events[j].type);
+            if (j == 0) {
+                new_unique.times.push_back(0);
+            } else {
+                new_unique.times.push_back(t.events[j].time - base_time); 
             }
         }
-            
+
+        variant_index[t.shorthand] = unique_traces.size();
+        unique_traces.push_back(new_unique);
+
+    } else {
+
+        unique_trace &ut = unique_traces[it->second];
+
+        for (int k = 1; k < t.events.size(); k++) {
+
+            ut.times[k] = merge_time(1, t.events[k].time - base_time, ut.count, ut.times[k]);    
+        }
+
+        ut.count++;
     }
+}
+
+std::vector<unique_trace> step_1_calc_unique_traces(std::vector<trace> &traces) {
 
-    node_indexes.pop_back();
+    phase_timer timer(PHASE_UNIQUE_TRACES);
+    std::vector<unique_trace> unique_traces;
+    std::unordered_map<std::string, int> variant_index;
 
-    return 0;
+    for (int i = 0; i < traces.size(); i++) {
+    //for (int i = 0; i < 500; i++) {
+
+        add_trace_to_unique_traces(unique_traces, variant_index, traces[i]);
+    }
 
+    return unique_traces;
 }
 
-//1 if loop exists
+
+
+//1 if loop exists. depth first with an explicit stack, walk.seen marks the nodes on the current path.
+//the base nodes all start out on the path, so a start node reachable from another start node counts as a loop
 int check_for_loops(master_trace &mt) {
 
-    std::vector<int> node_indexes;
-    std::vector<int> visited;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
+    metric_add(metrics.loop_checks);
 
-    while(!node_indexes.empty()) {
+    static thread_local graph_walk walk;
+    walk_begin(walk, mt);
 
-        if (loop(node_indexes, visited, mt)) {
+    std::vector<int> &path = walk.pending;
+    std::vector<int> &positions = walk.positions;
+    positions.assign(path.size(), 0);
+    for (int i : path) { walk.seen[i] = walk.generation; }
 
-            return 1;
+    while (!path.empty()) {
+
+        int parent_index = path.back();
+        const node& parent = mt.nodes_container[parent_index];
+        int kid_count = parent.next_nodes.size();
+
+        if (positions.back() == 0) { walk.done[parent_index] = walk.generation; }
+
+        //kids first, then the node a merge attempt would add
+        int next = -1;
+        while (next == -1 && positions.back() <= kid_count) {
+
+            int pos = positions.back()++;
+            int kid_index = pos < kid_count ? parent.next_nodes[pos] : extra_node(mt, parent_index);
+            if (kid_index == -1) { continue; }
+
+            //loop found
+            if (walk.seen[kid_index] == walk.generation) {
+                metric_add(metrics.loops_found);
+                return 1;
+            }
+
+            if (walk.done[kid_index] != walk.generation) { next = kid_index; }
+        }
+
+        if (next != -1) {
+            path.push_back(next);
+            positions.push_back(0);
+            walk.seen[next] = walk.generation;
+        } else {
+            walk.seen[parent_index] = 0;
+            path.pop_back();
+            positions.pop_back();
         }
     }
 
@@ -584,52 +1772,57 @@ int check_for_loops(master_trace &mt) {
 int check_valid_merge(master_trace& mt, float next_time, unique_trace t, int trace_index, int skip_loop) {
 
     if (!skip_loop) {
-        if (check_for_loops(mt)) { return -1; }
+        if (check_for_loops(mt)) {
+            metric_add(metrics.rejected[REJECT_LOOP]);
+            return -1;
+        }
     }
 
     int check_next_time = 1;
     if (next_time < 0) { check_next_time = 0; }
 
-    std::vector<int> visited;
-    std::vector<int> node_indexes;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
+    static thread_local graph_walk walk;
+    walk_begin(walk, mt);
     int parent_index = -1;
 
-    while(!node_indexes.empty()) {
+    while((parent_index = walk_next(walk)) != -1) {
 
-        parent_index = node_indexes.back(); 
-        node_indexes.pop_back();
         const node& parent = mt.nodes_container[parent_index];	
-        visited.push_back(parent_index);
 
+        int parent_attempting = is_attempting_merge(mt, parent_index);
         float parent_time = parent.average_time;
-        if (parent.is_attempting_merge) {
+        if (parent_attempting) {
 
             parent_time = merge_time(parent.event_count, parent.average_time, 
-                                     parent.extra_event_count, parent.extra_average_time);
+                                     mt.attempt_count, mt.attempt_time);
         }
 
-        if (check_next_time && parent.is_attempting_merge && parent_time > next_time) {
+        if (check_next_time && parent_attempting && parent_time > next_time) {
             //log("rejected because next time");
+            metric_add(metrics.rejected[REJECT_NEXT_TIME]);
             return 0;
         }
 
         for (int i : parent.next_nodes) {
 
             const node& kid = mt.nodes_container[i];
+            int kid_attempting = is_attempting_merge(mt, i);
 
             float kid_time = kid.average_time;
-            if (kid.is_attempting_merge) {
+            if (kid_attempting) {
 
                 kid_time = merge_time(kid.event_count, kid.average_time, 
-                                      kid.extra_event_count, kid.extra_average_time);
+                                      mt.attempt_count, mt.attempt_time);
             }
 
             if (kid_time < parent_time) {
 
-                if (parent.is_attempting_merge) {
+                if (parent_attempting) {
 
-                    if (kid.used) { return -1; }
+                    if (kid.used) {
+                        metric_add(metrics.rejected[REJECT_ORDER_UNFIXABLE]);
+                        return -1;
+                    }
                     int found = 0;
                     for (int j = trace_index + 1; j < t.shorthand.size(); j++) {
                         if (kid.event_type == t.shorthand[j]) { 
@@ -643,31 +1836,54 @@ int check_valid_merge(master_trace& mt, float next_time, unique_trace t, int tra
                     }
 
 
-                    if (!found) { return -1; }
+                    if (!found) {
+                        metric_add(metrics.rejected[REJECT_ORDER_UNFIXABLE]);
+                        return -1;
+                    }
 
                     //log("           match rejected! - parent attemptin merge");
                     
                     //log("           Offending nodes:");
                     //log("               parent: " + parent.name + " time: ", parent_time);
                     //log("               kid: " + kid.name + " time: ", kid_time);
+                    metric_add(metrics.rejected[REJECT_ORDER]);
                     return 0;
 
-                } else if (!kid.is_attempting_merge){
+                } else if (!kid_attempting){
 
 		            if (mt.recursion || mt.has_recursed) {
     			        //log("		match rejected. Would have failed but we are recursing");
-                        if (kid.used && parent.used) { return -1; }
+                        if (kid.used && parent.used) {
+                            metric_add(metrics.rejected[REJECT_ORDER_UNFIXABLE]);
+                            return -1;
+                        }
+                        metric_add(metrics.rejected[REJECT_ORDER]);
     			        return 0;
 		            }
 
+                    //neither node takes part in the attempt, so it didn't cause this. a graph that had cases taken
+                    //back out (sliding window) can be left with edges like this, they don't stop other merges.
+                    //anywhere else the builder broke the time order itself
+                    if (mt.retracted) {
+                        walk_push(walk, i);
+                        continue;
+                    }
+
                     log("           failed merge - no merge attempt - SHOULD NOT OCCUR");
                     log("           Offending nodes:");
-                    log("               parent: " + parent.name + std::to_string(parent.creationID) + " time: ", parent_time);
-                    log("               kid: " + kid.name + std::to_string(kid.creationID) + " time: ", kid_time);
+                    log("               parent: " + node_name(mt, parent) + std::to_string(parent.creationID) + " time: ", parent_time);
+                    log("               kid: " + node_name(mt, kid) + std::to_string(kid.creationID) + " time: ", kid_time);
+#ifdef DESKTOP_LIBRARY
+                    throw std::runtime_error("graph has an edge out of time order");
+#else
                     export_data(mt, "END");
                     exit(0);
+#endif
+                }
+                if (parent.used) {
+                    metric_add(metrics.rejected[REJECT_ORDER_UNFIXABLE]);
+                    return -1;
                 }
-                if (parent.used) { return -1; }
                 int found = 0;
                 for (int j = trace_index + 1; j < t.shorthand.size(); j++) {
                     if (parent.event_type == t.shorthand[j]) { 
@@ -680,42 +1896,37 @@ int check_valid_merge(master_trace& mt, float next_time, unique_trace t, int tra
                     }
                 }
 
-                if (!found) { return -1; }
+                if (!found) {
+                    metric_add(metrics.rejected[REJECT_ORDER_UNFIXABLE]);
+                    return -1;
+                }
                 //log("           match rejected! - kid attemptin merge");
+                metric_add(metrics.rejected[REJECT_ORDER]);
                 return 0;
             }
 
-            
-            if (std::find(visited.begin(), visited.end(), i) == visited.end()) {
-                node_indexes.insert(node_indexes.end(), i);
-                visited.push_back(i);
-            }
+
+            walk_push(walk, i);
         }
 
 	//this assumes that 1 node is only ever 
-        if (parent.extra_node != -1) {
+        int parent_extra = extra_node(mt, parent_index);
+        if (parent_extra != -1) {
             
-	        const node& kid = mt.nodes_container[parent.extra_node];
-
-            if (!kid.is_attempting_merge) {
-                log("           error - checkvalidmerge");
-                exit(0);
-            }
+	        const node& kid = mt.nodes_container[parent_extra];
 
             float kid_time = merge_time(kid.event_count, kid.average_time, 
-                                  kid.extra_event_count, kid.extra_average_time);
+                                  mt.attempt_count, mt.attempt_time);
 
             if (kid_time < parent.average_time) {
                 //log("           match rejected via extra path - hmm!");
                 //log("               parent: " + parent.name + " time: ", parent.average_time);
                 //log("               kid: " + kid.name + " time: ", kid_time);
+                metric_add(metrics.rejected[REJECT_EXTRA_PATH]);
                 return 0;
             }
 
-            if (std::find(visited.begin(), visited.end(), parent.extra_node) == visited.end()) {
-                node_indexes.insert(node_indexes.end(), parent.extra_node);
-                visited.push_back(parent.extra_node);
-            }
+            walk_push(walk, parent_extra);
         }
     }
 
@@ -727,67 +1938,191 @@ int check_valid_merge(master_trace& mt, float next_time, unique_trace t, int tra
 //done
 std::vector<int> get_closest_nodes(master_trace &mt, char event_type, float event_time) {
 
-    std::vector<int> closest_indexes;
+    std::vector<std::pair<float, int> > candidates;
 
-    int j = 0;
-    for (node& n : mt.nodes_container) {
+    for (int j = 0; j < mt.nodes_container.size(); j++) {
+
+        node& n = mt.nodes_container[j];
         
-        if (n.event_type == event_type && n.used == 0) {
-            n.time_diff = n.average_time - event_time;
-            n.time_diff = n.time_diff < 0 ? n.time_diff * -1 : n.time_diff;
+        if (n.event_type == event_type && n.used == 0 && n.deleted == 0) {
+            float time_diff = n.average_time - event_time;
+            time_diff = time_diff < 0 ? time_diff * -1 : time_diff;
+            candidates.push_back(std::make_pair(time_diff, j));
+        }
+    }
 
-            int already_exists = 0;
+    //furthest first, nodes with the same diff stay in container order
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const std::pair<float, int> &a, const std::pair<float, int> &b) { return a.first > b.first; });
 
-            for (int i : closest_indexes) {
+    std::vector<int> closest_indexes;
+    closest_indexes.reserve(candidates.size());
+    for (const std::pair<float, int> &c : candidates) { closest_indexes.push_back(c.second); }
 
-                if (i == n.creationID) { 
-                    already_exists = 1; 
-                }
-            }
+    return closest_indexes;
+}
 
-            if (!already_exists) { 
 
-		        int place = 0;
-		        for (int i : closest_indexes) {
+/*
+    Build journal. merge_node and add_new_node append every change they make to the graph as it happens,
+    and rebuild_from_journal replays them to reconstruct the graph at any step. Only written with --journal.
+
+    Layout (native byte order): magic "BWJL", version, then records that each start with a type byte
+        'a' name        length, bytes     (activity names, ids are given out in order)
+        'n' new node    index, name id, event type, event count, end count, average time
+        'u' merge       index, event count, end count, average time
+        'l' new edge    from, to, count   (appended to from's edges)
+        'c' edge count  from, edge slot, count
+        'b' base node   index             (appended to the base nodes)
+        's' step        variant, letter   (letter 0 once the variant is fully merged)
+
+    Copies of the graph made while looking ahead (recursion) are not journaled, only the graph being built is.
+*/
+#define JOURNAL_MAGIC   0x4C4A5742 // "BWJL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_FLUSH   (1 << 20)
+
+struct graph_journal {
 
-        			float other_diff = mt.nodes_container[i].time_diff;			
-        			if (n.time_diff > other_diff) {
-        				break;
-        			}
-			
-			        place++;
-		        }
+    std::ofstream out;
+    std::string buffer;
+    int names = 0;
+    long long steps = 0;
+};
 
-                closest_indexes.insert(closest_indexes.begin() + place, j);
-            }
+template <typename T>
+void journal_put(std::string &buffer, T value) { buffer.append((const char*)&value, sizeof(value)); }
 
-        }
+void flush_journal(graph_journal &journal) {
 
-        j++;
+    journal.out.write(journal.buffer.data(), journal.buffer.size());
+    journal.buffer.clear();
+}
+
+//1 on success
+int open_journal(graph_journal &journal, std::string filename) {
 
+    journal.out.open(filename, std::ios::binary);
+    if (!journal.out) {
+        log("Error opening journal for writing: " + filename);
+        return 0;
     }
 
-    return closest_indexes;
+    journal_put<int>(journal.buffer, JOURNAL_MAGIC);
+    journal_put<int>(journal.buffer, JOURNAL_VERSION);
+    return 1;
 }
 
+void close_journal(graph_journal &journal) {
 
-//done
-int merge_node(master_trace& mt, int merge_index, int prev_index, std::string shorthand, int end_node) {
+    flush_journal(journal);
+    journal.out.close();
+}
 
-    node& n = mt.nodes_container[merge_index];
+//the journal changes to mt should go to, nullptr when there is none
+graph_journal* journal_of(const master_trace &mt) {
 
-    n.average_time = merge_time(n.event_count, n.average_time,
-                                 n.extra_event_count, n.extra_average_time);
-    n.event_count += n.extra_event_count;
-    
-    if (end_node) {
-        n.end_count += n.extra_event_count;
-    }
+    return mt.recursion == 0 ? mt.journal : nullptr;
+}
 
-    if (prev_index != -1) {
+void journal_new_node(const master_trace &mt, int index) {
 
-    	node& prev_n = mt.nodes_container[prev_index];
-        //add check so a node does not point to same node twice or more
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+    std::string &buffer = journal->buffer;
+
+    const std::vector<std::string> &names = mt.names->strings;
+    for (; journal->names < names.size(); journal->names++) {
+        buffer += 'a';
+        journal_put<int>(buffer, names[journal->names].size());
+        buffer += names[journal->names];
+    }
+
+    const node &n = mt.nodes_container[index];
+    buffer += 'n';
+    journal_put<int>(buffer, index);
+    journal_put<int>(buffer, n.name_id);
+    journal_put<char>(buffer, n.event_type);
+    journal_put<int>(buffer, n.event_count);
+    journal_put<int>(buffer, n.end_count);
+    journal_put<float>(buffer, n.average_time);
+}
+
+void journal_merged_node(const master_trace &mt, int index) {
+
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+
+    const node &n = mt.nodes_container[index];
+    journal->buffer += 'u';
+    journal_put<int>(journal->buffer, index);
+    journal_put<int>(journal->buffer, n.event_count);
+    journal_put<int>(journal->buffer, n.end_count);
+    journal_put<float>(journal->buffer, n.average_time);
+}
+
+void journal_new_edge(const master_trace &mt, int from, int to, int count) {
+
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+
+    journal->buffer += 'l';
+    journal_put<int>(journal->buffer, from);
+    journal_put<int>(journal->buffer, to);
+    journal_put<int>(journal->buffer, count);
+}
+
+void journal_edge_count(const master_trace &mt, int from, int slot) {
+
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+
+    journal->buffer += 'c';
+    journal_put<int>(journal->buffer, from);
+    journal_put<int>(journal->buffer, slot);
+    journal_put<int>(journal->buffer, mt.nodes_container[from].next_nodes_counts[slot]);
+}
+
+void journal_base_node(const master_trace &mt, int index) {
+
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+
+    journal->buffer += 'b';
+    journal_put<int>(journal->buffer, index);
+}
+
+//marks the end of a step, everything appended before it belongs to the graph as of (variant, letter)
+void journal_step(const master_trace &mt, int variant, int letter) {
+
+    graph_journal *journal = journal_of(mt);
+    if (journal == nullptr) { return; }
+
+    journal->buffer += 's';
+    journal_put<int>(journal->buffer, variant);
+    journal_put<int>(journal->buffer, letter);
+    journal->steps++;
+
+    if (journal->buffer.size() >= JOURNAL_FLUSH) { flush_journal(*journal); }
+}
+
+//done
+int merge_node(master_trace& mt, int merge_index, int prev_index, std::string shorthand, int end_node) {
+
+    node& n = mt.nodes_container[merge_index];
+
+    n.average_time = merge_time(n.event_count, n.average_time,
+                                 mt.attempt_count, mt.attempt_time);
+    n.event_count += mt.attempt_count;
+    
+    if (end_node) {
+        n.end_count += mt.attempt_count;
+    }
+
+    if (prev_index != -1) {
+
+    	node& prev_n = mt.nodes_container[prev_index];
+        //add check so a node does not point to same node twice or more
         int already_exists = 0;
         int exists_index = -1;
 
@@ -801,22 +2136,22 @@ int merge_node(master_trace& mt, int merge_index, int prev_index, std::string sh
 
         if (already_exists) {
             //log("       prev node exists and has this name already. only updating edge count");
-            prev_n.next_nodes_counts[exists_index] += n.extra_event_count;
+            prev_n.next_nodes_counts[exists_index] += mt.attempt_count;
+            journal_edge_count(mt, prev_index, exists_index);
         } else {
             prev_n.next_nodes.push_back(merge_index);
-            prev_n.next_nodes_counts.push_back(n.extra_event_count);
+            prev_n.next_nodes_counts.push_back(mt.attempt_count);
+            journal_new_edge(mt, prev_index, merge_index, mt.attempt_count);
             //log("       MERGE - prev node existed. added to " + prev_n.name + "'s next nodes");
         }
     } 
+    journal_merged_node(mt, merge_index);
     
-    if (prev_index != -1) {
-        mt.nodes_container[prev_index].extra_node = -1;
-    }
-
-    n.is_attempting_merge = 0;
-    n.extra_event_count   = 0;
-    n.extra_average_time  = 0;
-    n.unique_traces.push_back(shorthand);
+    mt.attempt_prev  = -1;
+    mt.attempt_node  = -1;
+    mt.attempt_count = 0;
+    mt.attempt_time  = 0;
+    add_node_variant(mt, merge_index, shorthand);
 
     n.used = 1;
 
@@ -828,44 +2163,53 @@ int merge_node(master_trace& mt, int merge_index, int prev_index, std::string sh
 //done
 int add_new_node(master_trace& mt, const unique_trace& ut, int i, int prev_node_index, int end_node, int recursion) {
 
+    metric_add(metrics.nodes_created);
+
     //log("NEW NODE CREATED - NAME: " + ut.names[i], mt.total_node_count);
 	
     node new_node;
-    new_node.creationID = mt.total_node_count;
-    if (new_node.creationID > 1000) {
-        log("CreationID over 1000. Something must be wrong. Aborting");
-        exit(0);
-    }   
-    mt.total_node_count++;
+    int reuse_slot = -1;
+
+    if (!mt.free_nodes.empty()) {
+        reuse_slot = mt.free_nodes.back();
+        mt.free_nodes.pop_back();
+        new_node.creationID = reuse_slot;
+    } else {
+        new_node.creationID = mt.total_node_count;
+        mt.total_node_count++;
+    }
 
     new_node.event_type          = ut.events[i];
-    new_node.name                = ut.names[i];
+    new_node.name_id             = intern(*mt.names, ut.names[i]);
     new_node.average_time        = ut.times[i];
     new_node.event_count         = ut.count;
-    new_node.unique_traces.push_back(ut.shorthand);
-    new_node.is_attempting_merge = 0;
     new_node.end_count = 0;
     new_node.deleted = 0;
-    new_node.time_diff = 0;
-    new_node.extra_event_count = 0;
-    new_node.extra_average_time = 0;
-    new_node.extra_node = -1;
 
     if (end_node) {
         new_node.end_count = new_node.event_count;
     }
 
-    mt.nodes_container.push_back(new_node);
+    if (reuse_slot != -1) {
+        mt.nodes_container[reuse_slot] = new_node;
+        clear_node_variants(mt, reuse_slot);
+    } else {
+        mt.nodes_container.push_back(new_node);
+    }
+    add_node_variant(mt, new_node.creationID, ut.shorthand);
+    journal_new_node(mt, new_node.creationID);
 
     if (prev_node_index != -1) {
         mt.nodes_container[prev_node_index].next_nodes.push_back(new_node.creationID);
         mt.nodes_container[prev_node_index].next_nodes_counts.push_back(new_node.event_count);
+        journal_new_edge(mt, prev_node_index, new_node.creationID, new_node.event_count);
     } else {
         mt.base_nodes.push_back(new_node.creationID);
+        journal_base_node(mt, new_node.creationID);
         //log("       Added alternate start with name:" + new_node.name);
     }
 
-    if (recursion == 0) { log("Node created - " + new_node.name + std::to_string(new_node.creationID) + " ", new_node.average_time); }
+    if (recursion == 0) { log("Node created - " + ut.names[i] + std::to_string(new_node.creationID) + " ", new_node.average_time); }
 
     return new_node.creationID;
 }
@@ -910,17 +2254,16 @@ int merge_letter(master_trace &mt, unique_trace t, int prev_node_index, int trac
 
         node_index = closest_indexes.back();
         closest_indexes.pop_back();
-	    node& node_ptr = mt.nodes_container[node_index];
-        node_ptr.is_attempting_merge = 1;
-        node_ptr.extra_event_count   = event_count;
-        node_ptr.extra_average_time  = event_time;
+        mt.attempt_node  = node_index;
+        mt.attempt_count = event_count;
+        mt.attempt_time  = event_time;
 
         int skip_loop = 0;
         if (prev_node_index != -1) {
-	       mt.nodes_container[prev_node_index].extra_node = node_index;
+	       mt.attempt_prev = prev_node_index;
 
            for (int i : mt.nodes_container[prev_node_index].next_nodes) {
-                if (i == mt.nodes_container[prev_node_index].extra_node) {
+                if (i == node_index) {
                     skip_loop = 1;
                 }
             }
@@ -935,12 +2278,14 @@ int merge_letter(master_trace &mt, unique_trace t, int prev_node_index, int trac
 
                   
 
+        metric_add(metrics.candidates);
         can_merge = check_valid_merge(mt, next_time, t, trace_index, skip_loop);
 
     	//log("can merge: ", can_merge);
 
     	if (can_merge == 1) {
 
+           metric_add(metrics.accepted);
            merged_index = merge_node(mt, node_index, prev_node_index, shorthand, end_node);
     	   has_merged = 1;
 
@@ -951,11 +2296,17 @@ int merge_letter(master_trace &mt, unique_trace t, int prev_node_index, int trac
     	    //copy mastertrace
     	    master_trace mt_copy = mt;
     	    mt_copy.recursion = 1;
+            metric_add(metrics.copies);
+            if (metrics_on) { metric_add(metrics.copy_bytes, graph_bytes(mt)); }
     	    //merge node
     	    merge_node(mt_copy, node_index, prev_node_index, shorthand, end_node);
     	    //recursion
     	    //log("R E C U R S I O N !-----------------------------------------------------------------");
+            recursion_depth++;
+            metric_add(metrics.recursions[std::min(recursion_depth, METRIC_DEPTHS) - 1]);
+            metric_add(metrics.recursion_depth_sum, recursion_depth);
             int res_index = merge_letter(mt_copy, t, node_index, trace_index + 1, size);
+            recursion_depth--;
     	    //log("E N D OF R E C U R S I O N&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&"); 
 
             if (res_index != -1) {
@@ -972,6 +2323,7 @@ int merge_letter(master_trace &mt, unique_trace t, int prev_node_index, int trac
                     
                 }
 
+                metric_add(metrics.recursion_merges);
                 merged_index = merge_node(mt, node_index, prev_node_index, shorthand, end_node);
     		    has_merged = 1;
                 mt.has_recursed = 1;
@@ -981,13 +2333,10 @@ int merge_letter(master_trace &mt, unique_trace t, int prev_node_index, int trac
 
         }
 
-        if (prev_node_index != -1) {
-	       mt.nodes_container[prev_node_index].extra_node = -1;
-        }
-
-        node_ptr.is_attempting_merge = 0;
-        node_ptr.extra_event_count   = 0;
-        node_ptr.extra_average_time  = 0;
+        mt.attempt_prev  = -1;
+        mt.attempt_node  = -1;
+        mt.attempt_count = 0;
+        mt.attempt_time  = 0;
     }
 
     if (has_merged == 0) {
@@ -1012,9 +2361,188 @@ void clear_used_nodes(master_trace& mt) {
     }
 }
 
-//done
-void merge_master_trace(master_trace& mt, unique_trace t, int detailed) {
+//reads values out of a journal held in memory, ok drops to 0 on the first read past the end
+struct journal_reader {
+
+    const std::string &data;
+    size_t pos;
+    int ok;
+};
+
+template <typename T>
+T journal_get(journal_reader &r) {
+
+    T value = T();
+    if (r.pos + sizeof(T) > r.data.size()) { r.ok = 0; return value; }
+    memcpy(&value, r.data.data() + r.pos, sizeof(T));
+    r.pos += sizeof(T);
+    return value;
+}
+
+//node indexes and sizes must stay sane, otherwise a corrupt file could make us allocate gigabytes
+int journal_index(journal_reader &r) {
+
+    int i = journal_get<int>(r);
+    if (i < 0 || i > (1 << 28)) { r.ok = 0; return 0; }
+    return i;
+}
+
+/*
+    Replays filename into mt up to the end of step (variant, letter), letter 0 being the whole variant.
+    1 when the step was found. mt is left as it was on failure.
+*/
+int rebuild_from_journal(std::string filename, int variant, int letter, master_trace &mt) {
 
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        log("Error opening journal: " + filename);
+        return 0;
+    }
+
+    std::stringstream contents;
+    contents << in.rdbuf();
+    std::string data = contents.str();
+    journal_reader r = { data, 0, 1 };
+
+    if (journal_get<int>(r) != JOURNAL_MAGIC) {
+        log("Not a build journal");
+        return 0;
+    }
+
+    int version = journal_get<int>(r);
+    if (version != JOURNAL_VERSION) {
+        log("Unsupported journal version: ", version);
+        return 0;
+    }
+
+    master_trace rebuilt;
+    rebuilt.total_node_count = 0;
+    rebuilt.node_to_merge = -1;
+    rebuilt.last_count = 0;
+
+    while (r.ok && r.pos < data.size()) {
+
+        char type = data[r.pos++];
+
+        if (type == 'a') {
+
+            int length = journal_index(r);
+            if (!r.ok || r.pos + length > data.size()) { r.ok = 0; break; }
+            intern(*rebuilt.names, data.substr(r.pos, length));
+            r.pos += length;
+
+        } else if (type == 'n') {
+
+            int i = journal_index(r);
+            for (int k = rebuilt.nodes_container.size(); k <= i; k++) {
+                rebuilt.nodes_container.push_back(node());
+                rebuilt.nodes_container[k].name_id = -1; //not described yet
+            }
+
+            node &n = rebuilt.nodes_container[i];
+            n = node();
+            n.creationID   = i;
+            n.name_id      = journal_get<int>(r);
+            n.event_type   = journal_get<char>(r);
+            n.event_count  = journal_get<int>(r);
+            n.end_count    = journal_get<int>(r);
+            n.average_time = journal_get<float>(r);
+            n.used         = 0;
+            if (n.name_id < 0 || n.name_id >= rebuilt.names->strings.size()) { r.ok = 0; }
+
+        } else if (type == 'u') {
+
+            int i = journal_index(r);
+            if (i >= rebuilt.nodes_container.size()) { r.ok = 0; break; }
+
+            node &n = rebuilt.nodes_container[i];
+            n.event_count  = journal_get<int>(r);
+            n.end_count    = journal_get<int>(r);
+            n.average_time = journal_get<float>(r);
+
+        } else if (type == 'l') {
+
+            int from = journal_index(r);
+            int to = journal_index(r);
+            int count = journal_get<int>(r);
+            if (from >= rebuilt.nodes_container.size()) { r.ok = 0; break; }
+
+            rebuilt.nodes_container[from].next_nodes.push_back(to);
+            rebuilt.nodes_container[from].next_nodes_counts.push_back(count);
+
+        } else if (type == 'c') {
+
+            int from = journal_index(r);
+            int slot = journal_index(r);
+            int count = journal_get<int>(r);
+            if (from >= rebuilt.nodes_container.size() || slot >= rebuilt.nodes_container[from].next_nodes.size()) {
+                r.ok = 0;
+                break;
+            }
+
+            rebuilt.nodes_container[from].next_nodes_counts[slot] = count;
+
+        } else if (type == 'b') {
+
+            rebuilt.base_nodes.push_back(journal_index(r));
+
+        } else if (type == 's') {
+
+            int step_variant = journal_get<int>(r);
+            int step_letter = journal_get<int>(r);
+            if (!r.ok) { break; }
+            if (step_variant != variant || step_letter != letter) { continue; }
+
+            //every index has to point at a node the journal described before the graph is handed out
+            int size = rebuilt.nodes_container.size();
+            for (int i : rebuilt.base_nodes) {
+                if (i >= size) { log("Journal has invalid base node: ", i); return 0; }
+            }
+            for (const node &n : rebuilt.nodes_container) {
+                if (n.name_id < 0) { log("Journal is missing a node"); return 0; }
+                for (int kid : n.next_nodes) {
+                    if (kid >= size) { log("Journal has invalid edge to node: ", kid); return 0; }
+                }
+            }
+            rebuilt.total_node_count = size;
+
+            mt = rebuilt;
+            return 1;
+
+        } else {
+            r.ok = 0;
+        }
+    }
+
+    if (!r.ok) { log("Journal is truncated or corrupt"); }
+    else       { log("Step not found in journal"); }
+    return 0;
+}
+
+//answers --journal-step. step is "12" for the graph after variant 12 (connections12.txt) or "12:3" for the
+//graph after its third letter (connections12_3.txt)
+int export_journal_step(const std::string &filename, const std::string &step) {
+
+    int variant = std::atoi(step.c_str());
+    int letter = 0;
+    size_t colon = step.find(':');
+    if (colon != std::string::npos) { letter = std::atoi(step.c_str() + colon + 1); }
+
+    master_trace mt;
+    if (!rebuild_from_journal(filename, variant, letter, mt)) { return 1; }
+
+    std::string suffix = std::to_string(variant);
+    if (letter != 0) { suffix += "_" + std::to_string(letter); }
+    if (!export_data(mt, suffix)) { return 1; }
+
+    log("Step rebuilt: connections" + suffix + ".txt");
+    return 0;
+}
+
+//returns the node each event was merged into
+std::vector<int> merge_master_trace(master_trace& mt, unique_trace t, int variant = 0) {
+
+    std::vector<int> path;
     int prev_node_index = -1;
     mt.has_recursed = 0;
     for (int i = 0; i < t.events.size(); i++) {
@@ -1023,18 +2551,49 @@ void merge_master_trace(master_trace& mt, unique_trace t, int detailed) {
         log("   merging mastertrace with " + t.names[i]);
 
         prev_node_index = merge_letter(mt, t, prev_node_index, i, 1);
+        path.push_back(prev_node_index);
 
-        if (detailed) {
-            std::string s = "STEP" + std::to_string(i + 1);
-            export_data(mt, s);
-        }
+        journal_step(mt, variant, i + 1);
+
+    }
 
+    return path;
+}
+
+void record_merge(merge_history *history, const unique_trace &t, const std::vector<int> &path) {
+
+    if (history == nullptr) { return; }
+
+    merge_record record;
+    record.count = t.count;
+    record.nodes = path;
+    record.times = t.times;
+    history->variants[t.shorthand].push_back(record);
+    history->starts[path[0]]++;
+}
+
+//rebuilds merge_history::starts, after the records' nodes have been renumbered
+void index_merge_starts(merge_history &history) {
+
+    history.starts.clear();
+    for (const auto &variant : history.variants) {
+        for (const merge_record &record : variant.second) { history.starts[record.nodes[0]]++; }
     }
 }
 
+//the graph is only built from the SIZE most common variants
+int variants_to_merge(const std::vector<unique_trace> &unique_traces) {
+
+    return std::min((int)unique_traces.size(), SIZE);
+}
+
 //done
-master_trace step_2_build_graph(std::vector<unique_trace> &unique_traces) {
+//journal gets every step (letter and variant) of the build, exporter (started by the caller) gets the graph after
+//every merged variant to write as text (connections0.txt, connections1.txt...) for debugging
+master_trace step_2_build_graph(std::vector<unique_trace> &unique_traces, merge_history *history = nullptr,
+                                graph_journal *journal = nullptr, background_exporter *exporter = nullptr) {
 
+    phase_timer timer(PHASE_BUILD);
     log("starting step 2!!!");
     log(" ");
     //init mastertrace
@@ -1042,6 +2601,7 @@ master_trace step_2_build_graph(std::vector<unique_trace> &unique_traces) {
     mt.base_nodes.clear();
     mt.total_node_count = 0;
     mt.node_to_merge = -1;
+    mt.journal = journal;
 
     //std::sort(unique_traces.begin(), unique_traces.end());
 
@@ -1049,365 +2609,4311 @@ master_trace step_2_build_graph(std::vector<unique_trace> &unique_traces) {
     unique_trace base_trace = unique_traces[0];
 
     int prev_node_index = -1;
+    std::vector<int> base_path;
     log("setting up base trace");
     for (int i = 0; i < base_trace.events.size(); i++) {
 
         int end_node = i == base_trace.events.size() - 1 ? 1 : 0;    
         prev_node_index = add_new_node(mt, base_trace, i, prev_node_index, end_node, 0);
+        base_path.push_back(prev_node_index);
+        journal_step(mt, 0, i + 1);
 
     }
+    record_merge(history, base_trace, base_path);
+    journal_step(mt, 0, 0);
 
     mt.last_count = base_trace.events.size();
 
-    export_data(mt, 0);
+    if (exporter != nullptr) { export_in_background(*exporter, mt, "0"); }
     //for (int i = 1; i < unique_traces.size(); i++) {
     log("going through remaining traces");
-    for (int i = 1; i < SIZE; i++) {
-        int detailed = 0;
-        if (i == 58) { detailed = 1; }
+    int variant_count = variants_to_merge(unique_traces);
+    for (int i = 1; i < variant_count; i++) {
         log("");
         log("");
         log("");
         std::string msg = "Mergine trace: " + unique_traces[i].shorthand + " NUMBER: " + std::to_string(i) + " COUNT: " + std::to_string(unique_traces[i].count);
         log(msg);
-        merge_master_trace(mt, unique_traces[i], detailed);
-        log("Trace merge done, exporting");
-        export_data(mt, i);
+        record_merge(history, unique_traces[i], merge_master_trace(mt, unique_traces[i], i));
+        journal_step(mt, i, 0);
+#ifdef CHECK_INVARIANTS
+        check_invariants(mt, "after merging " + unique_traces[i].shorthand);
+#endif
+        if (exporter != nullptr) {
+            log("Trace merge done, exporting");
+            export_in_background(*exporter, mt, std::to_string(i));
+        }
 
     }
 
+    mt.journal = nullptr;
+
     return mt;
-      
+
 }
 
+/*
+    Snapshot of a built master_trace.
 
+    Layout (native byte order):
+        magic "BWMT", version
+        activity names   (so shorthand letters stay the same between runs)
+        master_trace     (counters, base nodes, nodes with edges, counts, end counts and variant membership)
+        merged variants  (shorthand, count, names, events and mean times)
 
-//skip for now
-/*
-void swap_node(node* node1, node* pot_node) {
+    Names and variants are written as strings, not ids, so files don't depend on interning order.
+    The scratch state used while merging (attempt_*, used) is not stored.
+    Bump SNAPSHOT_VERSION whenever the layout changes, old files are then rejected instead of misread.
+*/
+#define SNAPSHOT_MAGIC   0x544D5742 // "BWMT"
+#define SNAPSHOT_VERSION 1
 
-    for (int i = 0; i < node1->prev_nodes.size(); i++) {
-        node* prev_node = node1->prev_nodes[i];
-        
-        int count = 0;
-        for (int j = 0; j < prev_node->next_nodes.size(); j++) {
+void write_int(std::ofstream &out, int i)     { out.write((const char*)&i, sizeof(i)); }
+void write_float(std::ofstream &out, float f) { out.write((const char*)&f, sizeof(f)); }
 
-            if (prev_node->next_nodes[j]->creationID == node1->creationID) {
-                prev_node->next_nodes.erase(prev_node->next_nodes.begin() + j);
-                count = prev_node->next_nodes_counts[j];
-                prev_node->next_nodes_counts.erase(prev_node->next_nodes_counts.begin() + j);
-                break;
-            }
-        }
+void write_string(std::ofstream &out, const std::string &s) {
 
-        prev_node->extra_node = nullptr;
-        prev_node->next_nodes.insert(prev_node->next_nodes.begin(), pot_node);
-        prev_node->next_nodes_counts.insert(prev_node->next_nodes_counts.begin(), count);
-    }
+    write_int(out, s.size());
+    out.write(s.data(), s.size());
 }
 
+template <typename V>
+void write_int_vector(std::ofstream &out, const V &v) {
 
-//skip for now
-//
-// Goes through graph looking for another node with the same name as node. 
-// If found, creates a merged node with those two with the correct edges. 
-// Then it checks if the graph is still valid with the new merged node.
-// If so, delete the old two nodes and keep the merged one. And exit function.
-// otherwise, delete the new merged node and try another combination.
-int inner_merge_pass(int node_index, master_trace& mt) {
+    write_int(out, v.size());
+    for (int i : v) { write_int(out, i); }
+}
 
-    std::vector<node*> nodes;
-    nodes.insert(nodes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
-    node* parent = nullptr;
+void write_string_vector(std::ofstream &out, const std::vector<std::string> &v) {
 
-    while(!nodes.empty()) {
+    write_int(out, v.size());
+    for (const std::string &s : v) { write_string(out, s); }
+}
 
-        parent = nodes.back();
-        nodes.pop_back();
-        
-        //If two nodes have the same name but are not the same node.
-        if (parent->name == node1->name && node1->creationID != parent->creationID) {
-
-            node* pot_node         = new node;
-            pot_node->event_type   = node1->event_type;
-            pot_node->name         = node1->name;
-            pot_node->extra_node   = nullptr;
-            pot_node->creationID   = mt.total_node_count;
-            pot_node->event_count  = parent->event_count + node1->event_count;
-            pot_node->average_time = merge_time(parent->event_count, parent->average_time,
-                                                node1->event_count, node1->average_time);
-
-
-            pot_node->is_attempting_merge = 1;
-            pot_node->extra_event_count   = 0;
-            pot_node->extra_average_time  = 0;
-
-            pot_node->end_count = node1->end_count + parent->end_count;
-
-            for (int i = 0; i < node1->prev_nodes.size();   i++) { node1->prev_nodes[i]->extra_node   = pot_node; }
-            for (int i = 0; i < parent->prev_nodes.size(); i++)  { parent->prev_nodes[i]->extra_node = pot_node; }
-
-            pot_node->next_nodes.insert(pot_node->next_nodes.begin(), 
-                                        parent->next_nodes.begin(), parent->next_nodes.end());
-            pot_node->next_nodes_counts.insert(pot_node->next_nodes_counts.begin(), 
-                                               parent->next_nodes_counts.begin(), parent->next_nodes_counts.end());
-            pot_node->next_nodes.insert(pot_node->next_nodes.begin(), 
-                                        node1->next_nodes.begin(), node1->next_nodes.end());
-            pot_node->next_nodes_counts.insert(pot_node->next_nodes_counts.begin(), 
-                                               node1->next_nodes_counts.begin(), node1->next_nodes_counts.end());
-            pot_node->unique_traces.insert(pot_node->unique_traces.begin(), 
-                                           parent->unique_traces.begin(), parent->unique_traces.end());
-            pot_node->unique_traces.insert(pot_node->unique_traces.begin(), 
-                                           node1->unique_traces.begin(), node1->unique_traces.end());
-            log("CheckingValidMerge");
-            int valid = check_valid_merge(mt, std::numeric_limits<float>::max(), 0);
+int read_int(std::ifstream &in)     { int i = 0;   in.read((char*)&i, sizeof(i)); return i; }
+float read_float(std::ifstream &in) { float f = 0; in.read((char*)&f, sizeof(f)); return f; }
 
-            
+//sizes are sanity checked so a truncated or foreign file can't make us allocate gigabytes
+int read_size(std::ifstream &in) {
 
-            A     D - prev_nodes  layer
-            | \ / |
-            B  B  B - node/parent layer
-            | / \ |
-            C     E - next_nodes  layer
+    int size = read_int(in);
+    if (size < 0 || size > (1 << 28)) {
+        in.setstate(std::ios::failbit);
+        return 0;
+    }
 
-            
+    return size;
+}
 
-            if (valid) {
-                log("--- MERGING ---");
-                mt.total_node_count++; //not great, since 2 nodes are killed...
+std::string read_string(std::ifstream &in) {
 
-                //Swaps prev_nodes layer pointer to pot_node from the one to be deleted. Then deletes first node.
-                swap_node(node1, pot_node);
-                delete node1;
-                swap_node(parent, pot_node);
-                delete parent;
+    std::string s(read_size(in), '\0');
+    if (!s.empty()) { in.read(&s[0], s.size()); }
+    return s;
+}
 
-                pot_node->is_attempting_merge = 0;
+std::vector<int> read_int_vector(std::ifstream &in) {
 
-                return 1;
+    std::vector<int> v(read_size(in));
+    for (int &i : v) { i = read_int(in); }
+    return v;
+}
 
-            } else {
+std::vector<std::string> read_string_vector(std::ifstream &in) {
 
-                delete pot_node;
-                for (int i = 0; i < node1->prev_nodes.size();   i++) { node1->prev_nodes[i]->extra_node  = nullptr; }
-                for (int i = 0; i < parent->prev_nodes.size(); i++)  { parent->prev_nodes[i]->extra_node = nullptr; }
-            
-            }
+    std::vector<std::string> v(read_size(in));
+    for (std::string &s : v) { s = read_string(in); }
+    return v;
+}
+
+void write_unique_traces(std::ofstream &out, const std::vector<unique_trace> &variants) {
+
+    write_int(out, variants.size());
+    for (const unique_trace &ut : variants) {
+
+        write_string(out, ut.shorthand);
+        write_int(out, ut.count);
+        write_string_vector(out, ut.names);
+        write_int(out, ut.times.size());
+        for (int i = 0; i < ut.times.size(); i++) {
+            write_int(out, ut.events[i]);
+            write_float(out, ut.times[i]);
         }
-        
+    }
+}
+
+std::vector<unique_trace> read_unique_traces(std::ifstream &in) {
 
-        for (int i = 0; i < parent->next_nodes.size(); i++) {
-            nodes.insert(nodes.begin(), parent->next_nodes[i]);
+    std::vector<unique_trace> variants(read_size(in));
+    for (unique_trace &ut : variants) {
+
+        ut.shorthand = read_string(in);
+        ut.count     = read_int(in);
+        ut.names     = read_string_vector(in);
+        int events   = read_size(in);
+        for (int i = 0; i < events; i++) {
+            ut.events.push_back(read_int(in));
+            ut.times.push_back(read_float(in));
         }
     }
 
-    return 0;
+    return variants;
+}
+
+void write_snapshot(std::ofstream &out, const master_trace &mt,
+                    const std::vector<std::string> &activity_names, const std::vector<unique_trace> &variants) {
+
+    write_int(out, SNAPSHOT_MAGIC);
+    write_int(out, SNAPSHOT_VERSION);
+
+    write_string_vector(out, activity_names);
+
+    write_int(out, mt.total_node_count);
+    write_int(out, mt.node_to_merge);
+    write_int(out, mt.last_count);
+    write_int_vector(out, mt.base_nodes);
+
+    write_int(out, mt.nodes_container.size());
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        const node &n = mt.nodes_container[i];
+        write_int(out, n.creationID);
+        write_int(out, n.event_type);
+        write_string(out, node_name(mt, n));
+        write_int(out, n.event_count);
+        write_float(out, n.average_time);
+        write_int(out, n.end_count);
+        write_int(out, n.deleted);
+        write_int_vector(out, n.next_nodes);
+        write_int_vector(out, n.next_nodes_counts);
+        write_string_vector(out, node_variant_names(mt, i));
+    }
 
+    write_unique_traces(out, variants);
 }
 
+//1 on success
+int save_snapshot(std::string filename, const master_trace &mt,
+                  const std::vector<std::string> &activity_names, const std::vector<unique_trace> &variants) {
 
-int merge_pass(master_trace& mt) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        log("Error opening snapshot for writing: " + filename);
+        return 0;
+    }
 
-    std::vector<int> node_indexes;
-    node_indexes.insert(nodes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
-    int parent_index = -1;
+    write_snapshot(out, mt, activity_names, variants);
 
-    while(!node_indexes.empty()) {
+    if (!out) {
+        log("Error writing snapshot: " + filename);
+        return 0;
+    }
 
-        parent_index = node_indexes.back();
-        node_indexes.pop_back();
-	node& parent = mt.nodes_container[parent_index];
+    log("Snapshot saved: " + filename);
+    return 1;
+}
 
-        int merge = inner_merge_pass(parent_index, mt);
+//1 on success. On failure mt, activity_names and variants are left untouched
+int read_snapshot(std::ifstream &in, master_trace &mt,
+                  std::vector<std::string> &activity_names, std::vector<unique_trace> &variants) {
 
-        if (merge) { return 1; }
+    if (read_int(in) != SNAPSHOT_MAGIC) {
+        log("Not a master_trace snapshot");
+        return 0;
+    }
 
-    	node_indexes.insert(node_indexes.begin(), parent.next_nodes.begin(), parent.next_nodes.end());
+    int version = read_int(in);
+    if (version != SNAPSHOT_VERSION) {
+        log("Unsupported snapshot version: ", version);
+        return 0;
+    }
 
+    std::vector<std::string> loaded_names = read_string_vector(in);
+
+    master_trace loaded;
+    loaded.total_node_count = read_int(in);
+    loaded.node_to_merge    = read_int(in);
+    loaded.last_count       = read_int(in);
+    loaded.base_nodes       = read_int_vector(in);
+
+    loaded.nodes_container.resize(read_size(in));
+    for (int i = 0; i < loaded.nodes_container.size(); i++) {
+
+        node &n = loaded.nodes_container[i];
+        n.creationID          = read_int(in);
+        n.event_type          = read_int(in);
+        n.name_id             = intern(*loaded.names, read_string(in));
+        n.event_count         = read_int(in);
+        n.average_time        = read_float(in);
+        n.end_count           = read_int(in);
+        n.deleted             = read_int(in);
+        n.next_nodes          = read_int_vector(in);
+        n.next_nodes_counts   = read_int_vector(in);
+        n.used                = 0;
+
+        for (const std::string &shorthand : read_string_vector(in)) {
+            add_node_variant(loaded, i, shorthand);
+        }
     }
 
-    return 0;
+    std::vector<unique_trace> loaded_variants = read_unique_traces(in);
 
-}
-*/
-//done
-void clear_prev_nodes(master_trace& mt) {
+    if (!in) {
+        log("Snapshot is truncated or corrupt");
+        return 0;
+    }
 
-    std::vector<int> node_indexes;
-    int parent_index = -1;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
-    
-    while(!node_indexes.empty()) {
+    for (int i = 0; i < loaded.nodes_container.size(); i++) {
+        if (loaded.nodes_container[i].deleted) { loaded.free_nodes.push_back(i); }
+    }
 
-        parent_index = node_indexes.back();
-        node_indexes.pop_back();
-	    node& parent = mt.nodes_container[parent_index];
+    //indexes must point inside the container, otherwise the merge code will walk off the end
+    int size = loaded.nodes_container.size();
+    for (int i : loaded.base_nodes) {
+        if (i < 0 || i >= size) { log("Snapshot has invalid base node: ", i); return 0; }
+    }
+    for (const node &n : loaded.nodes_container) {
+        if (n.next_nodes.size() != n.next_nodes_counts.size()) { log("Snapshot has mismatched edge counts"); return 0; }
+        for (int i : n.next_nodes) {
+            if (i < 0 || i >= size) { log("Snapshot has invalid edge to node: ", i); return 0; }
+        }
+    }
 
-        parent.prev_nodes.clear();
+    mt = loaded;
+    activity_names = loaded_names;
+    variants = loaded_variants;
+
+    return 1;
+}
 
-    	node_indexes.insert(node_indexes.begin(), parent.next_nodes.begin(), parent.next_nodes.end());
+int load_snapshot(std::string filename, master_trace &mt,
+                  std::vector<std::string> &activity_names, std::vector<unique_trace> &variants) {
+
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        log("Error opening snapshot: " + filename);
+        return 0;
+    }
+
+    if (!read_snapshot(in, mt, activity_names, variants)) {
+        log("Could not load snapshot: " + filename);
+        return 0;
     }
+
+    log("Snapshot loaded: " + filename + " nodes: ", (int)mt.nodes_container.size());
+    return 1;
 }
 
+/*
+    Merges the variants of a newer (cumulative) log on top of a graph loaded from a snapshot.
+    Variants that are new get merged as usual. Variants whose count grew only get the new cases merged,
+    i.e a trace with the count difference and the mean time of the new cases.
+    merged is updated to reflect the full log afterwards so it can be saved in a new snapshot.
+*/
+void merge_snapshot_delta(master_trace &mt, std::vector<unique_trace> &merged, const std::vector<unique_trace> &unique_traces,
+                          merge_history *history = nullptr) {
 
-void set_prev_nodes(master_trace& mt) {
+    std::unordered_map<std::string, int> merged_index;
+    for (int i = 0; i < merged.size(); i++) {
+        merged_index[merged[i].shorthand] = i;
+    }
 
-    std::vector<int> node_indexes;
-    int parent_index = -1;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
+    int new_variants = 0;
+    int changed_variants = 0;
+    int variant_count = variants_to_merge(unique_traces);
 
-    while(!node_indexes.empty()) {
+    for (int i = 0; i < variant_count; i++) {
 
-        parent_index = node_indexes.back();
-	    node& parent = mt.nodes_container[parent_index];
-        node_indexes.pop_back();
+        const unique_trace &ut = unique_traces[i];
+        std::unordered_map<std::string, int>::iterator it = merged_index.find(ut.shorthand);
 
-        for (int kid_index : parent.next_nodes) {
+        if (it == merged_index.end()) {
 
-            node& kid = mt.nodes_container[kid_index];
+            log("Merging new variant: " + ut.shorthand + " COUNT: " + std::to_string(ut.count));
+            record_merge(history, ut, merge_master_trace(mt, ut));
+            merged_index[ut.shorthand] = merged.size();
+            merged.push_back(ut);
+            new_variants++;
+            continue;
+        }
 
-            int already_exists = 0;
+        unique_trace &old = merged[it->second];
+        int delta_count = ut.count - old.count;
 
-            for (int prev_index : kid.prev_nodes) {
-		        node& prev_node = mt.nodes_container[prev_index];
-                if (prev_node.creationID == parent.creationID) {
-                    already_exists = 1;
-                }
-            }
+        if (delta_count < 0) {
+            log("Variant has fewer cases than in snapshot, is the log cumulative? Skipping: " + ut.shorthand);
+            continue;
+        }
 
-            if (!already_exists) {
-                kid.prev_nodes.insert(kid.prev_nodes.begin(), parent_index);
-            }
+        if (delta_count == 0) { continue; }
 
-            node_indexes.insert(node_indexes.begin(), kid_index);
+        unique_trace delta = ut;
+        delta.count = delta_count;
+        for (int j = 0; j < delta.times.size(); j++) {
+            delta.times[j] = ((ut.count * ut.times[j]) - (old.count * old.times[j])) / delta_count;
         }
+
+        log("Merging changed variant: " + ut.shorthand + " NEW CASES: " + std::to_string(delta_count));
+        record_merge(history, delta, merge_master_trace(mt, delta));
+        old = ut;
+        changed_variants++;
     }
+
+    log("Delta merge done. New variants: ", new_variants);
+    log("                  Changed variants: ", changed_variants);
 }
 
-//done
-/*
-void step_3_clean_graph(master_trace &mt) {
+//takes one value back out of a mean, the opposite of merge_time(event_count - 1, avg, 1, time)
+float unmerge_time(int event_count, float average_time, float time) {
 
-    clear_prev_nodes(mt);
+    if (event_count <= 1) { return 0; }
 
-    set_prev_nodes(mt);
+    return ((event_count * average_time) - time) / (event_count - 1);
+}
+
+//edges that reach zero are removed
+void remove_edge_count(node &from, int to_index, int count) {
+
+    for (int i = 0; i < from.next_nodes.size(); i++) {
+
+        if (from.next_nodes[i] == to_index) {
 
-    log("------------EXTRA-----------");
-    while(merge_pass(mt)) { 
-        log("Nodes were merged. Attempting again..."); 
-        clear_prev_nodes(mt);
-        set_prev_nodes(mt);
+            from.next_nodes_counts[i] -= count;
+            if (from.next_nodes_counts[i] <= 0) {
+                from.next_nodes.erase(from.next_nodes.begin() + i);
+                from.next_nodes_counts.erase(from.next_nodes_counts.begin() + i);
+            }
+            return;
+        }
     }
 }
 
-*/
-//done
-void main_algorithm(event_log &data, std::string name) {
+void remove_base_node(master_trace &mt, int index) {
 
-    //Step 1
-    std::vector<unique_trace> unique_traces = step_1_calc_unique_traces(data.traces);
-    std::sort(unique_traces.begin(), unique_traces.end());
+    std::vector<int>::iterator it = std::find(mt.base_nodes.begin(), mt.base_nodes.end(), index);
+    if (it != mt.base_nodes.end()) { mt.base_nodes.erase(it); }
+}
 
-    log("Unique Traces created: ", (int)unique_traces.size());
+//marks a node without edges deleted and puts its slot on the free list
+void free_node(master_trace &mt, int index) {
+
+    node &n = mt.nodes_container[index];
+    n.deleted = 1;
+    n.event_count = 0;
+    n.end_count = 0;
+    n.average_time = 0;
+    n.next_nodes.clear();
+    n.next_nodes_counts.clear();
+    n.prev_nodes.clear();
+    clear_node_variants(mt, index);
+    mt.free_nodes.push_back(index);
+}
 
-    for (int i = 0; i < SIZE; i++) {
-    
+//unlinks nodes that no case passes through anymore. the slots are reused by add_new_node
+void drop_nodes(master_trace &mt, const std::vector<int> &indexes) {
 
-        unique_trace &ut = unique_traces[i];
+    std::vector<int> dropped;
+    for (int i : indexes) {
+        if (!mt.nodes_container[i].deleted && mt.nodes_container[i].event_count <= 0) { dropped.push_back(i); }
+    }
+    if (dropped.empty()) { return; }
 
-        log("ShortHand: " + ut.shorthand + " i: ", i);
+    std::vector<char> is_dropped(mt.nodes_container.size(), 0);
+    for (int i : dropped) { is_dropped[i] = 1; }
 
-        //for (int i = 0; i < ut.names.size(); i++) {
+    //edges to them should already be gone since their counts reached zero, this only guards against stale
+    //ones. one pass for all of them, so expiring is linear in the graph and not in graph times dropped nodes
+    for (node &n : mt.nodes_container) {
 
-          //  std::string name = ut.names[i];
-            //float time = ut.times[i];
-            //log(name + ": ", time);
-        //}
+        if (n.deleted) { continue; }
 
+        for (int k = n.next_nodes.size() - 1; k >= 0; k--) {
+            if (is_dropped[n.next_nodes[k]]) {
+                n.next_nodes.erase(n.next_nodes.begin() + k);
+                n.next_nodes_counts.erase(n.next_nodes_counts.begin() + k);
+            }
+        }
     }
- 
 
-    //Step 2
-    master_trace mt = step_2_build_graph(unique_traces);
-    log("step2 done");
+    for (int i : dropped) {
+        if (mt.nodes_container[i].deleted) { continue; }
+        remove_base_node(mt, i);
+        free_node(mt, i);
+    }
+}
 
-   // set_prev_nodes(mt);
+/*
+    Takes one case of a variant back out of the graph, oldest merge of the variant first.
+    Node and edge counts are decremented and the case's own times (relative to its start) are taken back
+    out of each node's average, the same times the variant table takes out, so the two keep describing
+    the same cases. merged (the variants in the graph) is updated to match. Nodes that reach zero are added
+    to emptied, for drop_nodes. Returns 0 if the variant has nothing left in the graph.
+*/
+int retract_case(master_trace &mt, merge_history &history, std::vector<unique_trace> &merged, const std::string &shorthand,
+                 const std::vector<float> &times, std::vector<int> &emptied) {
 
-    //error checking
-    std::vector<int> node_indexes;
-    std::vector<int> visited;
-    int parent_index = -1;
-    node_indexes.insert(node_indexes.begin(), mt.base_nodes.begin(), mt.base_nodes.end());
+    std::unordered_map<std::string, std::deque<merge_record> >::iterator it = history.variants.find(shorthand);
+    if (it == history.variants.end() || it->second.empty()) { return 0; }
 
-    while(!node_indexes.empty()) {
+    merge_record &record = it->second.front();
+    std::vector<int> nodes = record.nodes;
+    mt.retracted = 1;
 
+    for (int k = 0; k < nodes.size(); k++) {
 
+        node &n = mt.nodes_container[nodes[k]];
+        n.average_time = unmerge_time(n.event_count, n.average_time, times[k]);
+        n.event_count--;
+        if (n.event_count <= 0) { emptied.push_back(nodes[k]); }
 
-        parent_index = node_indexes.back();
-	    node& parent = mt.nodes_container[parent_index];
-        node_indexes.pop_back();
-        visited.push_back(parent_index);
-
-        int sum = 0;
-        for (int prev_index : parent.prev_nodes) {
-	        node& prev = mt.nodes_container[prev_index];
-            //log(prev->name);
-            for (int i = 0; i < prev.next_nodes.size(); i++) {
-                int prev_next_index = prev.next_nodes[i];
-		        node& prev_next = mt.nodes_container[prev_next_index];
-                //log("?: " + prev_next->name);
-                if (prev_next.creationID == parent.creationID) {
-                    sum += prev.next_nodes_counts[i];
-                }
-            }
-        }
+        record.times[k] = unmerge_time(record.count, record.times[k], times[k]);
 
-        if (sum != parent.event_count) {
-            log("");
-            log("ERROR: " + parent.name);
-            log("SUM: ", sum);
-            log("eventcount: ", parent.event_count);
+        if (k > 0) {
+            remove_edge_count(mt.nodes_container[nodes[k - 1]], nodes[k], 1);
         }
+    }
 
-        for (int i : parent.next_nodes) {
+    mt.nodes_container[nodes.back()].end_count--;
+    record.count--;
 
-            if (std::find(visited.begin(), visited.end(), i) == visited.end()) {
+    if (record.count == 0) {
 
-                node_indexes.insert(node_indexes.end(), i);
-                visited.push_back(i);
+        it->second.pop_front();
+
+        //the variant stays on a node as long as another merge of it still passes through there
+        int variant = intern(*mt.variants, shorthand);
+        for (int i : nodes) {
+            int still_used = 0;
+            for (const merge_record &other : it->second) {
+                if (std::find(other.nodes.begin(), other.nodes.end(), i) != other.nodes.end()) { still_used = 1; }
+            }
+            if (!still_used) { set_node_variant(mt, i, variant, 0); }
+        }
+
+        if (it->second.empty()) { history.variants.erase(it); }
+
+        if (--history.starts[nodes[0]] <= 0) {
+            history.starts.erase(nodes[0]);
+            remove_base_node(mt, nodes[0]);
+        }
+    }
+
+    for (int i = 0; i < merged.size(); i++) {
+
+        if (merged[i].shorthand != shorthand) { continue; }
+
+        unique_trace &ut = merged[i];
+        if (ut.count <= 1) {
+            merged.erase(merged.begin() + i);
+        } else {
+            for (int k = 0; k < ut.times.size(); k++) {
+                ut.times[k] = unmerge_time(ut.count, ut.times[k], times[k]);
+            }
+            ut.count--;
+        }
+        break;
+    }
+
+    return 1;
+}
+
+//dropped slots worth compacting away, see compact_graph
+int needs_compaction(const master_trace &mt) {
+
+    return mt.free_nodes.size() >= 1024 && mt.free_nodes.size() * 2 > mt.nodes_container.size();
+}
+
+/*
+    Reclaims dropped nodes and nodes that can't be reached from a start node anymore. The nodes that
+    are kept move down in their current order and get their new index as creationID, so every index
+    (base_nodes, next_nodes, prev_nodes, the variant bits and the merge history) is rewritten.
+    Returns old index -> new index, -1 for removed nodes, for anyone else holding on to indexes.
+*/
+std::vector<int> compact_graph(master_trace &mt, merge_history *history = nullptr) {
+
+    static thread_local graph_walk walk;
+    int parent_index;
+    walk_begin(walk, mt);
+    while ((parent_index = walk_next(walk)) != -1) {
+        for (int kid_index : mt.nodes_container[parent_index].next_nodes) { walk_push(walk, kid_index); }
+    }
+
+    std::vector<int> remap(mt.nodes_container.size(), -1);
+    int kept = 0;
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+        if (walk.done[i] == walk.generation && !mt.nodes_container[i].deleted) { remap[i] = kept++; }
+    }
+
+    std::vector<unsigned long long> bits(kept * mt.variant_words, 0);
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        if (remap[i] == -1) { continue; }
+
+        for (int w = 0; w < mt.variant_words && i * mt.variant_words + w < mt.variant_bits.size(); w++) {
+            bits[remap[i] * mt.variant_words + w] = mt.variant_bits[i * mt.variant_words + w];
+        }
+
+        node &n = mt.nodes_container[i];
+        n.creationID = remap[i];
+        for (int &kid_index : n.next_nodes) { kid_index = remap[kid_index]; }
+
+        small_int_vector<4> prev;
+        for (int prev_index : n.prev_nodes) {
+            if (remap[prev_index] != -1) { prev.push_back(remap[prev_index]); }
+        }
+        n.prev_nodes = prev;
+
+        if (remap[i] != i) { mt.nodes_container[remap[i]] = n; }
+    }
+
+    mt.nodes_container.resize(kept);
+    mt.nodes_container.shrink_to_fit();
+    mt.variant_bits.swap(bits);
+    mt.free_nodes.clear();
+    mt.total_node_count = kept;
+    mt.attempt_node = mt.attempt_prev = -1;
+
+    for (int &i : mt.base_nodes) { i = remap[i]; }
+
+    if (history) {
+        for (auto &variant : history->variants) {
+            for (merge_record &record : variant.second) {
+                for (int &i : record.nodes) { i = remap[i]; }
+            }
+        }
+        index_merge_starts(*history);
+    }
+
+    return remap;
+}
+
+
+
+//done
+void clear_prev_nodes(master_trace& mt) {
+
+    static thread_local graph_walk walk;
+    int parent_index = -1;
+    walk_begin(walk, mt, 1);
+    
+    while((parent_index = walk_next(walk)) != -1) {
+
+	    node& parent = mt.nodes_container[parent_index];
+
+        parent.prev_nodes.clear();
+
+        for (int kid_index : parent.next_nodes) { walk_push(walk, kid_index); }
+    }
+}
+
+
+void set_prev_nodes(master_trace& mt) {
+
+    static thread_local graph_walk walk;
+    int parent_index = -1;
+    walk_begin(walk, mt, 1);
+
+    while((parent_index = walk_next(walk)) != -1) {
+
+	    node& parent = mt.nodes_container[parent_index];
+
+        for (int kid_index : parent.next_nodes) {
+
+            node& kid = mt.nodes_container[kid_index];
+
+            //every parent is visited once, so kid can only have it already if next_nodes lists kid twice
+            if (std::find(kid.prev_nodes.begin(), kid.prev_nodes.end(), parent_index) == kid.prev_nodes.end()) {
+                kid.prev_nodes.push_back(parent_index);
+            }
+
+            walk_push(walk, kid_index);
+        }
+    }
+}
+
+/*
+    Step 3, consolidation. After the build the graph can hold several nodes for the same activity that
+    could just as well be one node. Pairs of same activity nodes are ranked by how close their mean times
+    are, and merged if the result keeps the graph valid:
+      - the merged time is not before any parent's time and not after any kid's time (same rule as check_valid_merge)
+      - neither node can reach the other, otherwise the merge would create a loop
+      - both or neither are start nodes, start counts are taken from the whole node
+    Both checks only look around the two nodes, using prev_nodes which are kept up to date while merging.
+    The reachability search gives up (and the pair is skipped) after CONSOLIDATE_BUDGET nodes, so a pass
+    stays close to linear. Rounds repeat until nothing merges. The kept node is the one with the lower index.
+*/
+#define CONSOLIDATE_BUDGET 1024
+
+struct consolidation_pair {
+
+    float score;
+    int keep;
+    int remove;
+
+    bool operator<(const consolidation_pair &other) const { return score < other.score; }
+};
+
+//1 if to can be reached from from, or if the search ran out of budget
+int may_reach(master_trace &mt, int from, int to) {
+
+    static thread_local graph_walk walk;
+    walk_begin(walk, mt);
+    walk.pending.clear();
+    walk_push(walk, from);
+
+    int visited = 0;
+    int node_index;
+    while ((node_index = walk_next(walk)) != -1) {
+
+        if (node_index == to) { return 1; }
+        if (++visited > CONSOLIDATE_BUDGET) { return 1; }
+
+        for (int kid_index : mt.nodes_container[node_index].next_nodes) { walk_push(walk, kid_index); }
+    }
+
+    return 0;
+}
+
+void add_edge_count(node &from, int to_index, int count) {
+
+    for (int i = 0; i < from.next_nodes.size(); i++) {
+        if (from.next_nodes[i] == to_index) {
+            from.next_nodes_counts[i] += count;
+            return;
+        }
+    }
+
+    from.next_nodes.push_back(to_index);
+    from.next_nodes_counts.push_back(count);
+}
+
+void replace_prev_node(node &n, int old_index, int new_index) {
+
+    int *old_it = std::find(n.prev_nodes.begin(), n.prev_nodes.end(), old_index);
+    if (old_it == n.prev_nodes.end()) { return; }
+
+    if (std::find(n.prev_nodes.begin(), n.prev_nodes.end(), new_index) != n.prev_nodes.end()) {
+        n.prev_nodes.erase(old_it);
+    } else {
+        *old_it = new_index;
+    }
+}
+
+int can_consolidate(master_trace &mt, const std::vector<char> &is_base, int keep, int remove) {
+
+    const node &a = mt.nodes_container[keep];
+    const node &b = mt.nodes_container[remove];
+
+    if (a.deleted || b.deleted || is_base[keep] != is_base[remove]) { return 0; }
+
+    float time = merge_time(a.event_count, a.average_time, b.event_count, b.average_time);
+
+    for (const node *n : { &a, &b }) {
+        for (int prev_index : n->prev_nodes) {
+            if (mt.nodes_container[prev_index].average_time > time) { return 0; }
+        }
+        for (int kid_index : n->next_nodes) {
+            if (mt.nodes_container[kid_index].average_time < time) { return 0; }
+        }
+    }
+
+    return !may_reach(mt, keep, remove) && !may_reach(mt, remove, keep);
+}
+
+//moves everything of remove over to keep and frees remove
+void consolidate_nodes(master_trace &mt, int keep, int remove) {
+
+    node &a = mt.nodes_container[keep];
+    node &b = mt.nodes_container[remove];
+
+    a.average_time = merge_time(a.event_count, a.average_time, b.event_count, b.average_time);
+    a.event_count += b.event_count;
+    a.end_count   += b.end_count;
+
+    //a repeated activity can leave a node pointing at itself, that edge stays a self edge on keep
+    for (int i = 0; i < b.next_nodes.size(); i++) {
+
+        int kid_index = b.next_nodes[i] == remove ? keep : b.next_nodes[i];
+        add_edge_count(a, kid_index, b.next_nodes_counts[i]);
+
+        if (kid_index == keep) {
+            if (std::find(a.prev_nodes.begin(), a.prev_nodes.end(), keep) == a.prev_nodes.end()) { a.prev_nodes.push_back(keep); }
+        } else {
+            replace_prev_node(mt.nodes_container[kid_index], remove, keep);
+        }
+    }
+
+    for (int prev_index : b.prev_nodes) {
+
+        if (prev_index == remove) { continue; }
+
+        node &prev = mt.nodes_container[prev_index];
+        for (int i = 0; i < prev.next_nodes.size(); i++) {
+            if (prev.next_nodes[i] == remove) {
+                int count = prev.next_nodes_counts[i];
+                prev.next_nodes.erase(prev.next_nodes.begin() + i);
+                prev.next_nodes_counts.erase(prev.next_nodes_counts.begin() + i);
+                add_edge_count(prev, keep, count);
+                break;
+            }
+        }
+
+        if (std::find(a.prev_nodes.begin(), a.prev_nodes.end(), prev_index) == a.prev_nodes.end()) {
+            a.prev_nodes.push_back(prev_index);
+        }
+    }
+
+    for (int w = 0; w < mt.variant_words && (remove + 1) * mt.variant_words <= mt.variant_bits.size(); w++) {
+        if (mt.variant_bits.size() < (keep + 1) * mt.variant_words) { break; }
+        mt.variant_bits[keep * mt.variant_words + w] |= mt.variant_bits[remove * mt.variant_words + w];
+    }
+
+    remove_base_node(mt, remove);
+    free_node(mt, remove);
+}
+
+//returns the number of nodes merged away. history (if given) is updated to point at the kept nodes
+int step_3_clean_graph(master_trace &mt, merge_history *history = nullptr) {
+
+    phase_timer timer(PHASE_CONSOLIDATE);
+    clear_prev_nodes(mt);
+    set_prev_nodes(mt);
+
+    std::vector<char> is_base(mt.nodes_container.size(), 0);
+    for (int i : mt.base_nodes) { is_base[i] = 1; }
+
+    std::vector<int> merged_into(mt.nodes_container.size(), -1);
+    std::vector<int> touched(mt.nodes_container.size(), -1);
+    int merged = 0;
+
+    for (int round = 0; ; round++) {
+
+        //same activity nodes sorted by time, neighbours in that order are the candidates
+        std::vector<int> by_activity;
+        for (int i = 0; i < mt.nodes_container.size(); i++) {
+            if (!mt.nodes_container[i].deleted) { by_activity.push_back(i); }
+        }
+        std::sort(by_activity.begin(), by_activity.end(), [&](int x, int y) {
+            const node &a = mt.nodes_container[x];
+            const node &b = mt.nodes_container[y];
+            if (a.name_id != b.name_id) { return a.name_id < b.name_id; }
+            if (a.average_time != b.average_time) { return a.average_time < b.average_time; }
+            return x < y;
+        });
+
+        std::vector<consolidation_pair> pairs;
+        for (int i = 1; i < by_activity.size(); i++) {
+
+            const node &a = mt.nodes_container[by_activity[i - 1]];
+            const node &b = mt.nodes_container[by_activity[i]];
+            if (a.name_id != b.name_id) { continue; }
+
+            consolidation_pair p;
+            p.score  = b.average_time - a.average_time;
+            p.keep   = std::min(by_activity[i - 1], by_activity[i]);
+            p.remove = std::max(by_activity[i - 1], by_activity[i]);
+            pairs.push_back(p);
+        }
+        std::stable_sort(pairs.begin(), pairs.end());
+
+        int round_merged = 0;
+        for (const consolidation_pair &p : pairs) {
+
+            //a merged node's time has moved, its old pairs are redone next round
+            if (touched[p.keep] == round || touched[p.remove] == round) { continue; }
+            if (!can_consolidate(mt, is_base, p.keep, p.remove)) { continue; }
+
+            consolidate_nodes(mt, p.keep, p.remove);
+            merged_into[p.remove] = p.keep;
+            touched[p.keep] = touched[p.remove] = round;
+            round_merged++;
+        }
+
+        merged += round_merged;
+        if (round_merged == 0) { break; }
+        log("Nodes were merged. Attempting again... ", round_merged);
+    }
+
+    if (history) {
+        for (auto &variant : history->variants) {
+            for (merge_record &record : variant.second) {
+                for (int &i : record.nodes) {
+                    while (merged_into[i] != -1) { i = merged_into[i]; }
+                }
+            }
+        }
+        index_merge_starts(*history);
+    }
+
+    log("Step 3 merged nodes: ", merged);
+    return merged;
+}
+
+time_t window_start(time_t newest, float window_days) {
+
+    return newest - (time_t)(window_days * 86400);
+}
+
+//non follow version of the window, only keeps cases that started within window_days of the newest one
+void apply_window(event_log &data, float window_days) {
+
+    time_t newest = 0;
+    for (const trace &t : data.traces) {
+        if (!t.events.empty() && t.events[0].time > newest) { newest = t.events[0].time; }
+    }
+
+    time_t cutoff = window_start(newest, window_days);
+    std::vector<trace> kept;
+    for (const trace &t : data.traces) {
+        if (!t.events.empty() && t.events[0].time >= cutoff) { kept.push_back(t); }
+    }
+
+    log("Window keeps traces: " + std::to_string(kept.size()) + " of ", (int)data.traces.size());
+    data.traces = kept;
+}
+
+/*
+    Time deviation, how well the graph's mean times describe the log: the mean absolute difference between
+    when each event happened (relative to the start of its trace) and the average_time of the node it was
+    merged into. The node each event ended up in comes from the paths recorded while building (merge_history),
+    so scoring is a single pass over the traces. Traces are scored in fixed size chunks on a thread pool,
+    chunk sums are added in order so the result does not depend on the thread count.
+    Traces of variants that were not merged (beyond SIZE, or merged before a snapshot was loaded) are skipped.
+*/
+struct time_deviation {
+
+    double mean = 0;         //seconds
+    long long events = 0;    //events scored
+    int skipped = 0;         //traces without a recorded path
+};
+
+time_deviation calc_time_diff(const master_trace &mt, const merge_history &history, const std::vector<trace> &traces, int threads = 0) {
+
+    phase_timer timer(PHASE_TIME_DIFF);
+    const int chunk_size = 1024;
+    int chunks = (traces.size() + chunk_size - 1) / chunk_size;
+
+    std::vector<double> sums(chunks, 0);
+    std::vector<long long> counts(chunks, 0);
+    std::vector<int> skipped(chunks, 0);
+
+    parallel_for(chunks, threads, [&](int c) {
+
+        for (int i = c * chunk_size; i < std::min((int)traces.size(), (c + 1) * chunk_size); i++) {
+
+            const trace &t = traces[i];
+            std::unordered_map<std::string, std::deque<merge_record> >::const_iterator it = history.variants.find(t.shorthand);
+            if (t.events.empty() || it == history.variants.end() || it->second.empty()) { skipped[c]++; continue; }
+
+            const std::vector<int> &path = it->second.front().nodes;
+            int length = std::min(path.size(), t.events.size());
+
+            for (int k = 0; k < length; k++) {
+                float rel_time = t.events[k].time - t.events[0].time;
+                float diff = mt.nodes_container[path[k]].average_time - rel_time;
+                sums[c] += diff < 0 ? -diff : diff;
+            }
+            counts[c] += length;
+        }
+    });
+
+    time_deviation result;
+    double sum = 0;
+    for (int c = 0; c < chunks; c++) {
+        sum += sums[c];
+        result.events += counts[c];
+        result.skipped += skipped[c];
+    }
+    if (result.events > 0) { result.mean = sum / result.events; }
+
+    return result;
+}
+
+/*
+    Baseline DFG, the graph generate_graph.py draws as "_old" with pm4py (discover_dfg_typed and clean_time):
+    one node per activity, an edge for every two activities that directly follow each other in a trace (with
+    how often they do), how many traces start and end with each activity, and each activity's mean time since
+    the start of its trace. It is counted from the already parsed log, so comparing old and new needs no second
+    parse. Traces are counted in chunks on the thread pool, each worker into its own counts, and the time sums
+    of the chunks are added in order, so the mean times do not depend on the thread count.
+*/
+struct baseline_dfg {
+
+    int activities = 0;
+    std::vector<long long> follows;     //[from * activities + to]
+    std::vector<long long> starts;
+    std::vector<long long> ends;
+    std::vector<long long> occurrences;
+    std::vector<double> time_sums;      //seconds since the start of the trace
+};
+
+void init_baseline(baseline_dfg &dfg, int activities) {
+
+    dfg.activities = activities;
+    dfg.follows.assign(activities * activities, 0);
+    dfg.starts.assign(activities, 0);
+    dfg.ends.assign(activities, 0);
+    dfg.occurrences.assign(activities, 0);
+    dfg.time_sums.assign(activities, 0);
+}
+
+//the activity an event's shorthand letter stands for, -1 if it has none
+int activity_of(const event &e, int activities) {
+
+    int a = (unsigned char)e.type - 'A';
+    return a >= 0 && a < activities ? a : -1;
+}
+
+baseline_dfg discover_baseline(const event_log &data, int threads = 0) {
+
+    const int chunk_size = 1024;
+    int chunks = (data.traces.size() + chunk_size - 1) / chunk_size;
+    int activities = data.activity_names.size();
+
+    int workers = threads > 0 ? threads : std::thread::hardware_concurrency();
+    workers = std::max(1, std::min(workers, chunks));
+
+    //one set of counts per worker, the follows matrix is activities^2 so one per chunk would not fit for large
+    //logs. the counts add up the same whichever worker did a chunk, the time sums are kept per chunk instead
+    std::vector<baseline_dfg> partial(workers);
+    std::vector<double> time_sums((size_t)chunks * activities, 0);
+
+    parallel_for(workers, workers, [&](int w) {
+
+        baseline_dfg &dfg = partial[w];
+        init_baseline(dfg, activities);
+
+        for (int c = w; c < chunks; c += workers) {
+
+            double *sums = time_sums.data() + (size_t)c * activities;
+
+            for (int i = c * chunk_size; i < std::min((int)data.traces.size(), (c + 1) * chunk_size); i++) {
+
+                const std::vector<event> &events = data.traces[i].events;
+                int prev = -1;
+
+                for (int k = 0; k < events.size(); k++) {
+
+                    int a = activity_of(events[k], activities);
+                    if (a == -1) { prev = -1; continue; }
+
+                    dfg.occurrences[a]++;
+                    sums[a] += events[k].time - events[0].time;
+                    if (k == 0)                 { dfg.starts[a]++; }
+                    if (k == events.size() - 1) { dfg.ends[a]++; }
+                    if (prev != -1)             { dfg.follows[prev * activities + a]++; }
+                    prev = a;
+                }
+            }
+        }
+    });
+
+    baseline_dfg dfg;
+    init_baseline(dfg, activities);
+    for (const baseline_dfg &p : partial) {
+        for (int i = 0; i < dfg.follows.size(); i++) { dfg.follows[i] += p.follows[i]; }
+        for (int a = 0; a < activities; a++) {
+            dfg.starts[a]      += p.starts[a];
+            dfg.ends[a]        += p.ends[a];
+            dfg.occurrences[a] += p.occurrences[a];
+        }
+    }
+    for (int c = 0; c < chunks; c++) {
+        for (int a = 0; a < activities; a++) { dfg.time_sums[a] += time_sums[(size_t)c * activities + a]; }
+    }
+
+    return dfg;
+}
+
+//connections[ii].txt / timestamps[ii].txt in the same format as the master_trace export, labelled by activity name
+int export_baseline(const baseline_dfg &dfg, const std::vector<std::string> &activity_names, std::string ii) {
+
+    std::string connections;
+    std::string timestamps;
+    int activities = dfg.activities;
+
+    for (int a = 0; a < activities; a++) {
+        if (dfg.occurrences[a] == 0) { continue; }
+        timestamps += activity_names[a] + " | " + seconds_to_timedelta_string(dfg.time_sums[a] / dfg.occurrences[a]) + "\n";
+    }
+
+    for (int from = 0; from < activities; from++) {
+        for (int to = 0; to < activities; to++) {
+            long long count = dfg.follows[from * activities + to];
+            if (count != 0) { connections += activity_names[from] + "," + activity_names[to] + "," + std::to_string(count) + "\n"; }
+        }
+    }
+
+    for (int a = 0; a < activities; a++) {
+        if (dfg.starts[a] != 0) { connections += "Start:" + activity_names[a] + "," + std::to_string(dfg.starts[a]) + "\n"; }
+    }
+    for (int a = 0; a < activities; a++) {
+        if (dfg.ends[a] != 0) { connections += "End:" + activity_names[a] + "," + std::to_string(dfg.ends[a]) + "\n"; }
+    }
+
+    return write_export("connections" + ii + ".txt", connections) &&
+           write_export("timestamps"  + ii + ".txt", timestamps);
+}
+
+/*
+    Replay (conformance checking). Each trace of the log is walked through the graph along its edges:
+    the first event has to match a start node, every following event a kid of the node before it, and the
+    last node has to be an end node. The builder can merge a trace's first event into a node in the middle
+    of the graph, so when no start node matches, any node of that activity may start. Where several nodes
+    would match, the one that can also take the next event is tried first, then the one closest in time,
+    backtracking (with a budget per trace) when the rest of the trace doesn't fit. An unfit trace reports
+    the first event the furthest attempt could not place.
+
+    Traces are split into one shard per thread. Each shard sums deviations into its own per node / per edge
+    arrays, which are added together in shard order at the end.
+*/
+struct replay_summary {
+
+    std::vector<char> fit;              //per trace
+    std::vector<int> first_deviation;   //per trace, index of the first event that did not replay, -1 if fit
+    std::vector<int> offsets;           //trace i's events are deviations[offsets[i], offsets[i + 1])
+    std::vector<float> deviations;      //node average_time - time of the event, NaN if the event was not replayed
+    int fitting = 0;
+};
+
+struct replay_totals {
+
+    std::vector<long long> node_events;
+    std::vector<double> node_abs;
+    std::vector<double> node_signed;
+    std::vector<long long> edge_count;  //edge j of node i is at edge_offsets[i] + j
+    std::vector<double> edge_abs;
+};
+
+int has_kid_of_type(const master_trace &mt, const node &n, char event_type) {
+
+    for (int kid_index : n.next_nodes) {
+        if (mt.nodes_container[kid_index].event_type == event_type) { return 1; }
+    }
+
+    return 0;
+}
+
+//scratch for replaying one trace, one per shard. the search keeps its own stack, one level per event,
+//so a trace of any length fits on a worker thread's stack
+struct replay_search {
+
+    std::vector<int> nodes;       //node event k is at on the path being tried
+    std::vector<int> slots;       //which candidate it was, for the edge
+    std::vector<int> best_nodes;  //the attempt that got furthest
+    std::vector<int> best_slots;
+    int furthest = 0;
+    int budget = 0;
+
+    std::vector<const int*> candidates; //where event k may go
+    std::vector<small_int_vector<8> > order; //the matching ones, best first
+    std::vector<int> tried;             //how many of order have been tried
+};
+
+//the candidates event k matches, best first: the ones that can take the next event (or end, for the last
+//event), then the one closest in time
+void order_candidates(const master_trace &mt, const trace &t, int k, const int *candidates, int count, small_int_vector<8> &order) {
+
+    float rel_time = t.events[k].time - t.events[0].time;
+    int last = k + 1 == t.events.size();
+
+    small_int_vector<8> continues;
+    order.clear();
+    for (int c = 0; c < count; c++) {
+
+        const node &n = mt.nodes_container[candidates[c]];
+        if (n.deleted || n.event_type != t.events[k].type) { continue; }
+
+        int cont = last ? n.end_count > 0 : has_kid_of_type(mt, n, t.events[k + 1].type);
+        float diff = fabs(n.average_time - rel_time);
+
+        int place = order.size();
+        while (place > 0) {
+            const node &other = mt.nodes_container[candidates[order[place - 1]]];
+            float other_diff = fabs(other.average_time - rel_time);
+            if (continues[place - 1] > cont || (continues[place - 1] == cont && other_diff <= diff)) { break; }
+            place--;
+        }
+        order.insert(order.begin() + place, c);
+        continues.insert(continues.begin() + place, cont);
+    }
+}
+
+//the first placed events of the path being tried, if no attempt got that far yet
+void keep_if_furthest(replay_search &search, int placed) {
+
+    if (placed <= search.furthest) { return; }
+
+    search.furthest = placed;
+    search.best_nodes.assign(search.nodes.begin(), search.nodes.begin() + placed);
+    search.best_slots.assign(search.slots.begin(), search.slots.begin() + placed);
+}
+
+/*
+    Places every event of the trace, candidates being where the first event may go and the kids of the
+    node event k was placed on for event k + 1. Depth first: the best candidate of an event is tried
+    first, the next one once nothing after it fits, until the budget runs out.
+*/
+int replay_from(const master_trace &mt, const trace &t, const int *candidates, int count, replay_search &search) {
+
+    int size = t.events.size();
+    search.candidates.resize(size);
+    search.order.resize(size);
+    search.tried.resize(size);
+
+    int k = 0;
+    while (k >= 0) {
+
+        //entering event k, from the node event k - 1 was placed on
+        if (search.tried[k] == -1) {
+
+            keep_if_furthest(search, k);
+
+            search.candidates[k] = candidates;
+            order_candidates(mt, t, k, candidates, count, search.order[k]);
+            search.tried[k] = 0;
+        }
+
+        if (search.tried[k] == search.order[k].size()) {
+            search.tried[k] = -1;
+            k--;
+            continue;
+        }
+
+        if (search.budget-- <= 0) { return 0; }
+
+        int c = search.order[k][search.tried[k]++];
+        int node_index = search.candidates[k][c];
+        search.nodes[k] = node_index;
+        search.slots[k] = c;
+
+        const node &n = mt.nodes_container[node_index];
+        if (k + 1 == size) {
+            keep_if_furthest(search, size);
+            if (n.end_count > 0) { return 1; }
+            continue;
+        }
+
+        candidates = n.next_nodes.begin();
+        count = n.next_nodes.size();
+        k++;
+    }
+
+    return 0;
+}
+
+void replay_trace(const master_trace &mt, const std::vector<int> &edge_offsets, const std::vector<std::vector<int> > &by_type,
+                  const trace &t, int trace_index, replay_summary &summary, replay_totals &totals, replay_search &search) {
+
+    if (t.events.empty()) { return; }
+
+    search.nodes.assign(t.events.size(), -1);
+    search.slots.assign(t.events.size(), -1);
+    search.best_nodes.clear();
+    search.best_slots.clear();
+    search.furthest = 0;
+    search.budget = 16 * t.events.size() + 64;
+
+    search.tried.assign(t.events.size(), -1);
+    int ended = replay_from(mt, t, mt.base_nodes.data(), mt.base_nodes.size(), search);
+    if (!ended) {
+        const std::vector<int> &same_type = by_type[(unsigned char)t.events[0].type];
+        search.budget = 16 * t.events.size() + 64;
+        search.tried.assign(t.events.size(), -1);
+        ended = replay_from(mt, t, same_type.data(), same_type.size(), search);
+    }
+
+    const std::vector<int> &nodes = ended ? search.nodes : search.best_nodes;
+    const std::vector<int> &slots = ended ? search.slots : search.best_slots;
+    int replayed = ended ? t.events.size() : search.furthest;
+
+    float *deviations = summary.deviations.data() + summary.offsets[trace_index];
+    for (int k = 0; k < replayed; k++) {
+
+        int node_index = nodes[k];
+        float deviation = mt.nodes_container[node_index].average_time - (float)(t.events[k].time - t.events[0].time);
+        deviations[k] = deviation;
+
+        totals.node_events[node_index]++;
+        totals.node_abs[node_index] += fabs(deviation);
+        totals.node_signed[node_index] += deviation;
+        if (k > 0) {
+            totals.edge_count[edge_offsets[nodes[k - 1]] + slots[k]]++;
+            totals.edge_abs[edge_offsets[nodes[k - 1]] + slots[k]] += fabs(deviation);
+        }
+    }
+
+    summary.fit[trace_index] = ended;
+    summary.first_deviation[trace_index] = ended ? -1 : replayed;
+}
+
+replay_summary replay_log(const master_trace &mt, const std::vector<trace> &traces, int threads, replay_totals &totals) {
+
+    replay_summary summary;
+    summary.fit.assign(traces.size(), 0);
+    summary.first_deviation.assign(traces.size(), -1);
+    summary.offsets.resize(traces.size() + 1, 0);
+    for (int i = 0; i < traces.size(); i++) { summary.offsets[i + 1] = summary.offsets[i] + traces[i].events.size(); }
+    summary.deviations.assign(summary.offsets.back(), std::numeric_limits<float>::quiet_NaN());
+
+    std::vector<int> edge_offsets(mt.nodes_container.size() + 1, 0);
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+        edge_offsets[i + 1] = edge_offsets[i] + mt.nodes_container[i].next_nodes.size();
+    }
+
+    std::vector<std::vector<int> > by_type(256);
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+        if (!mt.nodes_container[i].deleted) { by_type[(unsigned char)mt.nodes_container[i].event_type].push_back(i); }
+    }
+
+    if (threads <= 0) { threads = std::thread::hardware_concurrency(); }
+    int shards = std::max(1, std::min(threads, (int)traces.size()));
+
+    std::vector<replay_totals> shard_totals(shards);
+    parallel_for(shards, threads, [&](int s) {
+
+        replay_totals &own = shard_totals[s];
+        replay_search search;
+        own.node_events.assign(mt.nodes_container.size(), 0);
+        own.node_abs.assign(mt.nodes_container.size(), 0);
+        own.node_signed.assign(mt.nodes_container.size(), 0);
+        own.edge_count.assign(edge_offsets.back(), 0);
+        own.edge_abs.assign(edge_offsets.back(), 0);
+
+        long long begin = (long long)traces.size() * s / shards;
+        long long end   = (long long)traces.size() * (s + 1) / shards;
+        for (int i = begin; i < end; i++) {
+            replay_trace(mt, edge_offsets, by_type, traces[i], i, summary, own, search);
+        }
+    });
+
+    totals = shard_totals[0];
+    for (int s = 1; s < shards; s++) {
+        for (int i = 0; i < totals.node_events.size(); i++) {
+            totals.node_events[i] += shard_totals[s].node_events[i];
+            totals.node_abs[i]    += shard_totals[s].node_abs[i];
+            totals.node_signed[i] += shard_totals[s].node_signed[i];
+        }
+        for (int i = 0; i < totals.edge_count.size(); i++) {
+            totals.edge_count[i] += shard_totals[s].edge_count[i];
+            totals.edge_abs[i]   += shard_totals[s].edge_abs[i];
+        }
+    }
+
+    for (char f : summary.fit) { summary.fitting += f; }
+
+    return summary;
+}
+
+//deviations[ii].txt: mean deviation per node and edge, in seconds. unfit[ii].txt: trace index, first deviating event.
+//1 on success
+int export_replay(const master_trace &mt, const std::vector<trace> &traces, const replay_summary &summary,
+                  const replay_totals &totals, std::string ii) {
+
+    std::ofstream deviations(output_path("deviations" + ii + ".txt"));
+    std::ofstream unfit(output_path("unfit" + ii + ".txt"));
+
+    if (!deviations || !unfit) {
+        log("Error opening file for writing: " + output_path((deviations ? "unfit" : "deviations") + ii + ".txt"));
+        return 0;
+    }
+
+    deviations << "Fit:" << summary.fitting << "," << traces.size() << "\n";
+
+    int edge = 0;
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        const node &n = mt.nodes_container[i];
+        if (n.deleted) { continue; }
+
+        std::string node_s = node_name(mt, n) + std::to_string(n.creationID);
+        long long events = totals.node_events[i];
+        deviations << "Node:" << node_s << "," << events << ","
+                   << (events ? totals.node_abs[i] / events : 0) << "," << (events ? totals.node_signed[i] / events : 0) << "\n";
+    }
+
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        const node &n = mt.nodes_container[i];
+        std::string node_s = node_name(mt, n) + std::to_string(n.creationID);
+
+        for (int j = 0; j < n.next_nodes.size(); j++, edge++) {
+
+            const node &kid = mt.nodes_container[n.next_nodes[j]];
+            long long count = totals.edge_count[edge];
+            deviations << "Edge:" << node_s << "," << node_name(mt, kid) << kid.creationID << "," << count << ","
+                       << (count ? totals.edge_abs[edge] / count : 0) << "\n";
+        }
+    }
+
+    for (int i = 0; i < traces.size(); i++) {
+
+        if (summary.fit[i]) { continue; }
+
+        int k = summary.first_deviation[i];
+        unfit << i << "," << k << ",";
+        if (k < traces[i].events.size()) {
+            unfit << traces[i].events[k].name << "\n";
+        } else {
+            unfit << "(no end)\n";
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Online scoring. freeze_graph copies a finished graph into flat read only arrays (the edges of node i are
+    targets[offsets[i], offsets[i + 1])), so events can be scored without touching master_trace and any
+    number of threads can share one frozen_graph. A case's state is the node it is at and when it started.
+    For each event, score_events reports the node the case moved to, whether it got there along an existing
+    edge (or, for a first event, started at a start node), and how far the time since the case started is
+    from that node's average_time. A case that leaves the graph is placed on the closest node of the
+    activity so later events still get scored. make_live_event turns an activity name (as in the log)
+    into the event type the graph uses.
+*/
+struct frozen_graph {
+
+    std::vector<int> offsets;
+    std::vector<int> targets;
+    std::vector<float> times;
+    std::vector<char> types;
+    std::vector<int> starts;
+    std::vector<std::vector<int> > by_type;
+    std::unordered_map<std::string, char> type_of; //activity name -> event type
+};
+
+struct live_event {
+
+    long long case_id;
+    char type;           //the graph's shorthand letter, see make_live_event
+    time_t time;
+};
+
+struct case_state {
+
+    int node = -1;
+    time_t start = 0;
+    int events = 0;
+    int deviations = 0;  //events that did not follow an edge
+};
+
+struct event_score {
+
+    int node;            //-1 if the activity is not in the graph at all
+    char known_edge;
+    float deviation;     //node average_time - time since case start, seconds
+};
+
+frozen_graph freeze_graph(const master_trace &mt) {
+
+    frozen_graph g;
+    g.offsets.push_back(0);
+    g.by_type.resize(256);
+
+    for (int i = 0; i < mt.nodes_container.size(); i++) {
+
+        const node &n = mt.nodes_container[i];
+        g.times.push_back(n.average_time);
+        g.types.push_back(n.event_type);
+        if (!n.deleted) {
+            g.targets.insert(g.targets.end(), n.next_nodes.begin(), n.next_nodes.end());
+            g.by_type[(unsigned char)n.event_type].push_back(i);
+            g.type_of[node_name(mt, n)] = n.event_type;
+        }
+        g.offsets.push_back(g.targets.size());
+    }
+
+    g.starts = mt.base_nodes;
+
+    return g;
+}
+
+//an activity the graph has never seen gets type 0, which no node has, so it scores as not in the graph
+live_event make_live_event(const frozen_graph &g, long long case_id, const std::string &activity, time_t time) {
+
+    std::unordered_map<std::string, char>::const_iterator it = g.type_of.find(activity);
+
+    live_event e;
+    e.case_id = case_id;
+    e.type = it == g.type_of.end() ? 0 : it->second;
+    e.time = time;
+    return e;
+}
+
+//closest in time of the nodes in [first, last) with the right activity, -1 if there is none
+int closest_of_type(const frozen_graph &g, const int *first, const int *last, char type, float rel_time) {
+
+    int best = -1;
+    float best_diff = 0;
+
+    for (const int *it = first; it != last; it++) {
+
+        if (g.types[*it] != type) { continue; }
+
+        float diff = fabs(g.times[*it] - rel_time);
+        if (best == -1 || diff < best_diff) {
+            best = *it;
+            best_diff = diff;
+        }
+    }
+
+    return best;
+}
+
+event_score score_event(const frozen_graph &g, case_state &state, const live_event &e) {
+
+    if (state.events == 0) { state.start = e.time; }
+    float rel_time = e.time - state.start;
+
+    int target;
+    if (state.node == -1) {
+        target = closest_of_type(g, g.starts.data(), g.starts.data() + g.starts.size(), e.type, rel_time);
+    } else {
+        target = closest_of_type(g, g.targets.data() + g.offsets[state.node], g.targets.data() + g.offsets[state.node + 1], e.type, rel_time);
+    }
+
+    event_score score;
+    score.known_edge = target != -1;
+
+    if (target == -1) {
+        const std::vector<int> &same_type = g.by_type[(unsigned char)e.type];
+        target = closest_of_type(g, same_type.data(), same_type.data() + same_type.size(), e.type, rel_time);
+        state.deviations++;
+    }
+
+    score.node = target;
+    score.deviation = target == -1 ? 0 : g.times[target] - rel_time;
+
+    if (target != -1) { state.node = target; }
+    state.events++;
+
+    return score;
+}
+
+//scores a batch of events in order. cases are created on their first event, the caller erases finished ones
+void score_events(const frozen_graph &g, std::unordered_map<long long, case_state> &cases,
+                  const std::vector<live_event> &events, std::vector<event_score> &scores) {
+
+    scores.resize(events.size());
+
+    for (int i = 0; i < events.size(); i++) {
+        scores[i] = score_event(g, cases[events[i].case_id], events[i]);
+    }
+}
+
+/*
+    --score-bench. Replays the log's events in time order as a live stream (repeated until there are
+    at least a million events). Throughput comes from scoring them in batches of SCORE_BATCH, latency from
+    a second pass that times every event on its own. The clock's own cost is logged next to it, a
+    timed event can't take less than that.
+*/
+#define SCORE_BATCH 1024
+
+void score_benchmark(const master_trace &mt, const std::vector<trace> &traces) {
+
+    frozen_graph g = freeze_graph(mt);
+
+    std::vector<live_event> stream;
+    for (int i = 0; i < traces.size(); i++) {
+        for (const event &e : traces[i].events) {
+            stream.push_back(make_live_event(g, i, e.name, e.time));
+        }
+    }
+    std::stable_sort(stream.begin(), stream.end(), [](const live_event &a, const live_event &b) { return a.time < b.time; });
+
+    if (stream.empty()) {
+        log("Nothing to score");
+        return;
+    }
+
+    //later rounds get new case ids
+    int rounds = (1000000 + stream.size() - 1) / stream.size();
+    std::vector<live_event> batch;
+    std::vector<event_score> scores;
+    std::unordered_map<long long, case_state> cases;
+    cases.reserve(traces.size());
+
+    long long known = 0;
+    long long scored = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < stream.size(); i += SCORE_BATCH) {
+
+            batch.assign(stream.begin() + i, stream.begin() + std::min((int)stream.size(), i + SCORE_BATCH));
+            for (live_event &e : batch) { e.case_id += (long long)r * traces.size(); }
+
+            score_events(g, cases, batch, scores);
+
+            for (const event_score &s : scores) { known += s.known_edge; }
+            scored += batch.size();
+        }
+        cases.clear();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> event_ns;
+    event_ns.reserve(scored);
+    for (int r = 0; r < rounds; r++) {
+        for (const live_event &e : stream) {
+            live_event le = e;
+            le.case_id += (long long)r * traces.size();
+            case_state &state = cases[le.case_id];
+            std::chrono::steady_clock::time_point event_start = std::chrono::steady_clock::now();
+            score_event(g, state, le);
+            event_ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - event_start).count());
+        }
+        cases.clear();
+    }
+    std::sort(event_ns.begin(), event_ns.end());
+
+    std::vector<double> clock_ns(1000);
+    for (double &ns : clock_ns) {
+        std::chrono::steady_clock::time_point clock_start = std::chrono::steady_clock::now();
+        ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - clock_start).count();
+    }
+    std::sort(clock_ns.begin(), clock_ns.end());
+
+    log("Score bench events: " + std::to_string(scored) + " batches of " + std::to_string(SCORE_BATCH) +
+        " known edges: " + std::to_string(known));
+    log("Score bench events/s: ", (float)(scored / seconds));
+    log("Score bench ns/event p50: ", (float)event_ns[event_ns.size() / 2]);
+    log("Score bench ns/event p99: ", (float)event_ns[event_ns.size() * 99 / 100]);
+    log("Score bench ns/event p99.9: ", (float)event_ns[event_ns.size() * 999 / 1000]);
+    log("Score bench ns/event max: ", (float)event_ns.back());
+    log("Score bench clock ns (p50, included above): ", (float)clock_ns[clock_ns.size() / 2]);
+}
+
+/*
+    Case index. Which path every case took, so analysts can drill down without rerunning or reading the
+    XES again. Stored as one node path per variant (from the merge history) plus each case's variant, so
+    it stays small. Variants that were not merged into the graph have an empty path.
+    --case-index writes cases[ii].idx next to the connections file, --query-case / --query-node /
+    --query-edge answer questions from it (see README).
+*/
+#define CASE_INDEX_MAGIC   0x49435742 // "BWCI"
+#define CASE_INDEX_VERSION 1
+
+struct case_index {
+
+    std::vector<std::string> node_labels;   //name + creationID, as in connections.txt
+    std::vector<int> path_offsets;          //variant v's path is path_nodes[path_offsets[v], path_offsets[v + 1])
+    std::vector<int> path_nodes;
+    std::vector<std::string> case_ids;
+    std::vector<int> case_variants;
+
+    //built on load by index_case_lookups
+    std::unordered_map<std::string, int> case_lookup;
+    std::unordered_map<std::string, int> node_lookup;
+    std::vector<int> node_offsets;          //variants through node n are node_variants[node_offsets[n], node_offsets[n + 1])
+    std::vector<int> node_variants;
+    std::vector<int> variant_offsets;       //cases of variant v are variant_cases[variant_offsets[v], variant_offsets[v + 1])
+    std::vector<int> variant_cases;
+};
+
+//turns lists of (key, value) into offsets/values, keys in [0, keys)
+void group_by_key(const std::vector<std::pair<int, int> > &pairs, int keys, std::vector<int> &offsets, std::vector<int> &values) {
+
+    offsets.assign(keys + 1, 0);
+    for (const std::pair<int, int> &p : pairs) { offsets[p.first + 1]++; }
+    for (int k = 0; k < keys; k++) { offsets[k + 1] += offsets[k]; }
+
+    values.resize(pairs.size());
+    std::vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (const std::pair<int, int> &p : pairs) { values[next[p.first]++] = p.second; }
+}
+
+void index_case_lookups(case_index &idx) {
+
+    int variants = idx.path_offsets.size() - 1;
+
+    idx.case_lookup.clear();
+    for (int c = 0; c < idx.case_ids.size(); c++) { idx.case_lookup[idx.case_ids[c]] = c; }
+
+    idx.node_lookup.clear();
+    for (int n = 0; n < idx.node_labels.size(); n++) { idx.node_lookup[idx.node_labels[n]] = n; }
+
+    std::vector<std::pair<int, int> > pairs;
+    for (int v = 0; v < variants; v++) {
+        for (int i = idx.path_offsets[v]; i < idx.path_offsets[v + 1]; i++) {
+            //a variant can pass a node twice, list it once
+            if (std::find(idx.path_nodes.begin() + idx.path_offsets[v], idx.path_nodes.begin() + i, idx.path_nodes[i]) == idx.path_nodes.begin() + i) {
+                pairs.push_back(std::make_pair(idx.path_nodes[i], v));
+            }
+        }
+    }
+    group_by_key(pairs, idx.node_labels.size(), idx.node_offsets, idx.node_variants);
+
+    pairs.clear();
+    for (int c = 0; c < idx.case_variants.size(); c++) { pairs.push_back(std::make_pair(idx.case_variants[c], c)); }
+    group_by_key(pairs, variants, idx.variant_offsets, idx.variant_cases);
+}
+
+case_index build_case_index(const master_trace &mt, const merge_history &history, const std::vector<trace> &traces) {
+
+    case_index idx;
+
+    for (const node &n : mt.nodes_container) { idx.node_labels.push_back(node_name(mt, n) + std::to_string(n.creationID)); }
+
+    std::unordered_map<std::string, int> variant_ids;
+    idx.path_offsets.push_back(0);
+
+    for (const trace &t : traces) {
+
+        std::unordered_map<std::string, int>::iterator it = variant_ids.find(t.shorthand);
+        if (it == variant_ids.end()) {
+
+            std::unordered_map<std::string, std::deque<merge_record> >::const_iterator merged = history.variants.find(t.shorthand);
+            if (merged != history.variants.end() && !merged->second.empty()) {
+                const std::vector<int> &path = merged->second.front().nodes;
+                idx.path_nodes.insert(idx.path_nodes.end(), path.begin(), path.end());
+            }
+
+            it = variant_ids.insert(std::make_pair(t.shorthand, (int)idx.path_offsets.size() - 1)).first;
+            idx.path_offsets.push_back(idx.path_nodes.size());
+        }
+
+        idx.case_ids.push_back(t.case_id);
+        idx.case_variants.push_back(it->second);
+    }
+
+    index_case_lookups(idx);
+
+    return idx;
+}
+
+int save_case_index(std::string filename, const case_index &idx) {
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        log("Error opening case index for writing: " + filename);
+        return 0;
+    }
+
+    write_int(out, CASE_INDEX_MAGIC);
+    write_int(out, CASE_INDEX_VERSION);
+    write_string_vector(out, idx.node_labels);
+    write_int_vector(out, idx.path_offsets);
+    write_int_vector(out, idx.path_nodes);
+    write_string_vector(out, idx.case_ids);
+    write_int_vector(out, idx.case_variants);
+
+    if (!out) {
+        log("Error writing case index: " + filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+int load_case_index(std::string filename, case_index &idx) {
+
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        log("Error opening case index: " + filename);
+        return 0;
+    }
+
+    if (read_int(in) != CASE_INDEX_MAGIC || read_int(in) != CASE_INDEX_VERSION) {
+        log("Not a case index, or an unsupported version: " + filename);
+        return 0;
+    }
+
+    idx.node_labels   = read_string_vector(in);
+    idx.path_offsets  = read_int_vector(in);
+    idx.path_nodes    = read_int_vector(in);
+    idx.case_ids      = read_string_vector(in);
+    idx.case_variants = read_int_vector(in);
+
+    int variants = idx.path_offsets.size() - 1;
+    int valid = in && variants >= 0 && idx.case_ids.size() == idx.case_variants.size();
+    for (int i = 0; valid && i < variants; i++) {
+        valid = idx.path_offsets[i] <= idx.path_offsets[i + 1] && idx.path_offsets[i + 1] <= idx.path_nodes.size();
+    }
+    for (int n : idx.path_nodes)    { valid = valid && n >= 0 && n < idx.node_labels.size(); }
+    for (int v : idx.case_variants) { valid = valid && v >= 0 && v < variants; }
+
+    if (!valid) {
+        log("Corrupt case index: " + filename);
+        return 0;
+    }
+
+    index_case_lookups(idx);
+    return 1;
+}
+
+//nodes the case went through, empty if its variant is not in the graph. -1 if the case is unknown
+int case_path(const case_index &idx, const std::string &case_id, std::vector<int> &path) {
+
+    std::unordered_map<std::string, int>::const_iterator it = idx.case_lookup.find(case_id);
+    if (it == idx.case_lookup.end()) { return -1; }
+
+    int v = idx.case_variants[it->second];
+    path.assign(idx.path_nodes.begin() + idx.path_offsets[v], idx.path_nodes.begin() + idx.path_offsets[v + 1]);
+    return 0;
+}
+
+//cases through node from, or through the edge from -> to if to is not -1
+std::vector<int> cases_through(const case_index &idx, int from, int to = -1) {
+
+    std::vector<int> cases;
+
+    for (int i = idx.node_offsets[from]; i < idx.node_offsets[from + 1]; i++) {
+
+        int v = idx.node_variants[i];
+        int takes = to == -1;
+        for (int p = idx.path_offsets[v]; !takes && p + 1 < idx.path_offsets[v + 1]; p++) {
+            takes = idx.path_nodes[p] == from && idx.path_nodes[p + 1] == to;
+        }
+
+        if (takes) {
+            cases.insert(cases.end(), idx.variant_cases.begin() + idx.variant_offsets[v],
+                         idx.variant_cases.begin() + idx.variant_offsets[v + 1]);
+        }
+    }
+
+    std::sort(cases.begin(), cases.end());
+    return cases;
+}
+
+//answers --query-case/node/edge on stdout. args are the index file followed by a case id or node labels
+int run_case_query(const std::string &kind, const std::vector<std::string> &args) {
+
+    case_index idx;
+    if (!load_case_index(args[0], idx)) { return 1; }
+
+    if (kind == "case") {
+
+        std::vector<int> path;
+        if (case_path(idx, args[1], path) == -1) {
+            log("Unknown case: " + args[1]);
+            return 1;
+        }
+        for (int n : path) { std::cout << idx.node_labels[n] << "\n"; }
+        return 0;
+    }
+
+    std::vector<int> nodes;
+    for (int i = 1; i < args.size(); i++) {
+        std::unordered_map<std::string, int>::iterator it = idx.node_lookup.find(args[i]);
+        if (it == idx.node_lookup.end()) {
+            log("Unknown node: " + args[i]);
+            return 1;
+        }
+        nodes.push_back(it->second);
+    }
+
+    for (int c : cases_through(idx, nodes[0], kind == "edge" ? nodes[1] : -1)) {
+        std::cout << idx.case_ids[c] << "\n";
+    }
+
+    return 0;
+}
+
+/*
+    Partitioned mode. The log is parsed once, the traces are split into periods (month or quarter)
+    by the start time of their first event, and a graph is built for each period on its own thread.
+    Each period gets its own connections_[PERIOD].txt / timestamps_[PERIOD].txt, and partitions.txt
+    summarizes how each period differs from the one before it.
+*/
+struct partition {
+
+    std::string period;
+    std::vector<trace> traces;
+    std::vector<unique_trace> unique_traces;
+    master_trace mt;
+    float build_ms = 0;
+    time_deviation time_diff;
+};
+
+//"2025-04" or "2025-Q2". Empty if the kind is unknown
+std::string period_of(time_t t, std::string kind) {
+
+    std::tm* t_i = std::localtime(&t);
+
+    std::ostringstream oss;
+    if (kind == "month") {
+        oss << std::put_time(t_i, "%Y-%m");
+    } else if (kind == "quarter") {
+        oss << std::put_time(t_i, "%Y") << "-Q" << (t_i->tm_mon / 3) + 1;
+    }
+
+    return oss.str();
+}
+
+void build_partition(partition &p) {
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    p.unique_traces = step_1_calc_unique_traces(p.traces);
+    std::sort(p.unique_traces.begin(), p.unique_traces.end());
+    merge_history history;
+    p.mt = step_2_build_graph(p.unique_traces, &history);
+    export_data(p.mt, "_" + p.period);
+
+    //periods are already built in parallel
+    p.time_diff = calc_time_diff(p.mt, history, p.traces, 1);
+
+    p.build_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//edge counts by activity name instead of node, so graphs from different periods can be compared
+std::map<std::pair<std::string, std::string>, int> activity_edges(const master_trace &mt) {
+
+    std::map<std::pair<std::string, std::string>, int> edges;
+
+    for (const node &n : mt.nodes_container) {
+        if (n.deleted) { continue; }
+        for (int i = 0; i < n.next_nodes.size(); i++) {
+            edges[std::make_pair(node_name(mt, n), node_name(mt, mt.nodes_container[n.next_nodes[i]]))] += n.next_nodes_counts[i];
+        }
+    }
+
+    return edges;
+}
+
+//mean time of each activity over all of its nodes, weighted by event count
+std::map<std::string, float> activity_times(const master_trace &mt) {
+
+    std::map<std::string, float> times;
+    std::map<std::string, int> counts;
+
+    for (const node &n : mt.nodes_container) {
+        if (n.deleted) { continue; }
+        const std::string &name = node_name(mt, n);
+        times[name] = merge_time(counts[name], times[name], n.event_count, n.average_time);
+        counts[name] += n.event_count;
+    }
+
+    return times;
+}
+
+//1 on success
+int write_partition_summary(const std::vector<partition> &partitions, std::string filename) {
+
+    std::ofstream out(output_path(filename));
+    if (!out) {
+        log("Error opening partition summary for writing: " + output_path(filename));
+        return 0;
+    }
+
+    for (int p = 0; p < partitions.size(); p++) {
+
+        const partition &part = partitions[p];
+        std::map<std::pair<std::string, std::string>, int> edges = activity_edges(part.mt);
+        std::map<std::string, float> times = activity_times(part.mt);
+
+        int nodes = 0;
+        for (const node &n : part.mt.nodes_container) { nodes += n.deleted ? 0 : 1; }
+
+        out << "Period " << part.period << ": traces " << part.traces.size() << " variants " << part.unique_traces.size()
+            << " nodes " << nodes << " edges " << edges.size() << " build (ms) " << part.build_ms
+            << " time diff " << seconds_to_timedelta_string(part.time_diff.mean) << "\n";
+
+        if (p == 0) { continue; }
+
+        std::map<std::pair<std::string, std::string>, int> prev_edges = activity_edges(partitions[p - 1].mt);
+        std::map<std::string, float> prev_times = activity_times(partitions[p - 1].mt);
+
+        for (const auto &e : edges) {
+            if (prev_edges.find(e.first) == prev_edges.end()) {
+                out << "    new edge: " << e.first.first << " -> " << e.first.second << " (" << e.second << ")\n";
+            }
+        }
+
+        for (const auto &e : prev_edges) {
+            if (edges.find(e.first) == edges.end()) {
+                out << "    removed edge: " << e.first.first << " -> " << e.first.second << " (" << e.second << ")\n";
+            }
+        }
+
+        for (const auto &t : times) {
+            std::map<std::string, float>::iterator prev = prev_times.find(t.first);
+            if (prev == prev_times.end()) {
+                out << "    new activity: " << t.first << " " << seconds_to_timedelta_string(t.second) << "\n";
+            } else if (seconds_to_timedelta_string(prev->second) != seconds_to_timedelta_string(t.second)) {
+                out << "    time changed: " << t.first << " " << seconds_to_timedelta_string(prev->second)
+                    << " -> " << seconds_to_timedelta_string(t.second) << "\n";
+            }
+        }
+
+        for (const auto &t : prev_times) {
+            if (times.find(t.first) == times.end()) {
+                out << "    removed activity: " << t.first << "\n";
+            }
+        }
+    }
+
+    return 1;
+}
+
+//0 on success
+int partitioned_algorithm(event_log &data, const run_options &opts) {
+
+    if (opts.partition != "month" && opts.partition != "quarter") {
+        log("Unknown partition, use month or quarter: " + opts.partition);
+        return 1;
+    }
+
+    //std::map keeps the periods in order since the names sort chronologically
+    std::map<std::string, std::vector<trace> > buckets;
+    for (const trace &t : data.traces) {
+        if (t.events.empty()) { continue; }
+        buckets[period_of(t.events[0].time, opts.partition)].push_back(t);
+    }
+
+    std::vector<partition> partitions(buckets.size());
+    int i = 0;
+    for (auto &bucket : buckets) {
+        partitions[i].period = bucket.first;
+        partitions[i].traces.swap(bucket.second);
+        i++;
+    }
+
+    log("Building graphs for periods: ", (int)partitions.size());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    parallel_for(partitions.size(), opts.threads, [&](int p) { build_partition(partitions[p]); });
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (!write_partition_summary(partitions, "partitions.txt")) { return 1; }
+
+    log("All periods built, time (ms): ", ms);
+    return 0;
+}
+//done. 0 on success, 1 if an output could not be written
+int main_algorithm(event_log &data, std::string name, const run_options &opts, graph_snapshot &snapshot) {
+
+    if (opts.window_days > 0) { apply_window(data, opts.window_days); }
+
+    //Step 1
+    std::vector<unique_trace> unique_traces = step_1_calc_unique_traces(data.traces);
+    std::sort(unique_traces.begin(), unique_traces.end());
+
+    log("Unique Traces created: ", (int)unique_traces.size());
+
+    for (int i = 0; i < variants_to_merge(unique_traces); i++) {
+    
+
+        unique_trace &ut = unique_traces[i];
+
+        log("ShortHand: " + ut.shorthand + " i: ", i);
+
+        //for (int i = 0; i < ut.names.size(); i++) {
+
+          //  std::string name = ut.names[i];
+            //float time = ut.times[i];
+            //log(name + ": ", time);
+        //}
+
+    }
+ 
+
+    //Step 2
+    master_trace mt;
+    std::vector<unique_trace> merged_variants;
+    merge_history history; //the path every variant took, for scoring
+
+    if (snapshot.loaded) {
+        mt = snapshot.mt;
+        merged_variants = snapshot.variants;
+        merge_snapshot_delta(mt, merged_variants, unique_traces, &history);
+    } else {
+        graph_journal journal;
+        int journaling = !opts.journal_out.empty() && open_journal(journal, opts.journal_out);
+        background_exporter exporter;
+        if (opts.export_steps) { start_exporter(exporter); }
+        mt = step_2_build_graph(unique_traces, &history, journaling ? &journal : nullptr, opts.export_steps ? &exporter : nullptr);
+        if (journaling) {
+            close_journal(journal);
+            log("Build journal saved: " + opts.journal_out + ", steps: ", (int)journal.steps);
+        }
+        if (opts.export_steps && finish_exporter(exporter) != 0) { return 1; }
+        merged_variants.assign(unique_traces.begin(), unique_traces.begin() + variants_to_merge(unique_traces));
+    }
+    log("step2 done");
+
+    check_invariants(mt, "after step 2");
+
+    //Step 3
+    if (opts.consolidate) {
+        step_3_clean_graph(mt, &history);
+        check_invariants(mt, "after step 3");
+    }
+
+    // Not part of algorithm, just outputting data.
+    time_deviation time_diff = calc_time_diff(mt, history, data.traces, opts.threads);
+
+    log("-------------------------------");
+    log(name + " TIME_DIFF: ", (float)time_diff.mean);
+    log("events scored: " + std::to_string(time_diff.events) + " traces skipped: ", time_diff.skipped);
+    log("-------------------------------");
+
+    if (!export_data(mt, 9999) || !export_formats(mt, "9999", opts)) { return 1; }
+
+    if (opts.baseline) {
+        if (!export_baseline(discover_baseline(data, opts.threads), data.activity_names, "9999_old")) { return 1; }
+        log("Baseline DFG saved: connections9999_old.txt");
+    }
+
+    if (opts.conformance) {
+        replay_totals totals;
+        replay_summary replay = replay_log(mt, data.traces, opts.threads, totals);
+        if (!export_replay(mt, data.traces, replay, totals, "9999")) { return 1; }
+        log("Traces fitting the graph: " + std::to_string(replay.fitting) + " of ", (int)data.traces.size());
+    }
+
+    if (opts.score_bench) { score_benchmark(mt, data.traces); }
+
+    if (opts.case_index && save_case_index(output_path("cases9999.idx"), build_case_index(mt, history, data.traces))) {
+        log("Case index saved: cases9999.idx");
+    }
+
+    if (!opts.snapshot_out.empty()) {
+        save_snapshot(opts.snapshot_out, mt, data.activity_names, merged_variants);
+    }
+
+    return 0;
+}
+
+/*
+    Follow mode. The event log is a live XES file that completed traces get appended to.
+    Instead of rerunning everything, only traces appended since last time are read, added to the
+    variant table and merged into the graph. The byte offset, variant table and graph are kept in a
+    state file so a restarted process picks up where the last one stopped.
+
+    A trace is only consumed once its closing tag is in the file, so half written traces are read next time.
+*/
+#define FOLLOW_MAGIC   0x53465742 // "BWFS"
+#define FOLLOW_VERSION 3
+
+//a case inside the sliding window, kept so it can be taken out again when it expires
+struct window_case {
+
+    time_t start;
+    std::string shorthand;
+    std::vector<float> times; //relative to start, like unique_trace::times
+};
+
+struct follow_state {
+
+    long long offset = 0;
+    std::vector<unique_trace> unique_traces; //every variant seen so far (or in the window), not only the merged ones
+    std::unordered_map<std::string, int> variant_index;
+    graph_snapshot graph;
+
+    //only used with --window
+    time_t newest = 0;                //start time of the newest case seen, the window ends here
+    std::deque<window_case> window;   //ordered by start time
+    merge_history history;
+};
+
+void reset_follow_state(follow_state &state, event_log &data) {
+
+    state = follow_state();
+    data = event_log();
+}
+
+int save_follow_state(std::string filename, const follow_state &state, const event_log &data) {
+
+    //written to a temp file first so a crash mid write never leaves a broken state behind
+    std::string tmp = filename + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out) {
+        log("Error opening follow state for writing: " + tmp);
+        return 0;
+    }
+
+    write_int(out, FOLLOW_MAGIC);
+    write_int(out, FOLLOW_VERSION);
+    out.write((const char*)&state.offset, sizeof(state.offset));
+    out.write((const char*)&state.newest, sizeof(state.newest));
+    write_int(out, state.graph.mt.retracted);
+    write_unique_traces(out, state.unique_traces);
+
+    write_int(out, state.window.size());
+    for (const window_case &c : state.window) {
+        out.write((const char*)&c.start, sizeof(c.start));
+        write_string(out, c.shorthand);
+        write_int(out, c.times.size());
+        for (float f : c.times) { write_float(out, f); }
+    }
+
+    write_int(out, state.history.variants.size());
+    for (const auto &variant : state.history.variants) {
+        write_string(out, variant.first);
+        write_int(out, variant.second.size());
+        for (const merge_record &record : variant.second) {
+            write_int(out, record.count);
+            write_int_vector(out, record.nodes);
+            write_int(out, record.times.size());
+            for (float f : record.times) { write_float(out, f); }
+        }
+    }
+
+    write_snapshot(out, state.graph.mt, data.activity_names, state.graph.variants);
+    out.close();
+
+    if (!out) {
+        log("Error writing follow state: " + tmp);
+        return 0;
+    }
+
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        //rename does not replace an existing file on windows
+        std::remove(filename.c_str());
+        if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+            log("Error replacing follow state: " + filename);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int load_follow_state(std::string filename, follow_state &state, event_log &data) {
+
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) { return 0; }
+
+    if (read_int(in) != FOLLOW_MAGIC || read_int(in) != FOLLOW_VERSION) {
+        log("Follow state has wrong format or version: " + filename);
+        return 0;
+    }
+
+    follow_state loaded;
+    in.read((char*)&loaded.offset, sizeof(loaded.offset));
+    in.read((char*)&loaded.newest, sizeof(loaded.newest));
+    int retracted = read_int(in);
+    loaded.unique_traces = read_unique_traces(in);
+
+    int window_size = read_size(in);
+    for (int i = 0; i < window_size && in; i++) {
+        window_case c;
+        in.read((char*)&c.start, sizeof(c.start));
+        c.shorthand = read_string(in);
+        c.times.resize(read_size(in));
+        for (float &f : c.times) { f = read_float(in); }
+        loaded.window.push_back(c);
+    }
+
+    int history_size = read_size(in);
+    for (int i = 0; i < history_size && in; i++) {
+        std::deque<merge_record> &records = loaded.history.variants[read_string(in)];
+        int record_count = read_size(in);
+        for (int j = 0; j < record_count && in; j++) {
+            merge_record record;
+            record.count = read_int(in);
+            record.nodes = read_int_vector(in);
+            record.times.resize(read_size(in));
+            for (float &f : record.times) { f = read_float(in); }
+            records.push_back(record);
+        }
+    }
+    index_merge_starts(loaded.history);
+
+    std::vector<std::string> activity_names;
+    if (!in || !read_snapshot(in, loaded.graph.mt, activity_names, loaded.graph.variants)) {
+        log("Follow state is corrupt: " + filename);
+        return 0;
+    }
+    loaded.graph.loaded = 1;
+    loaded.graph.mt.retracted = retracted;
+
+    for (int i = 0; i < loaded.unique_traces.size(); i++) {
+        loaded.variant_index[loaded.unique_traces[i].shorthand] = i;
+    }
+
+    state = loaded;
+    data = event_log();
+    data.activity_names = activity_names;
+
+    return 1;
+}
+
+//position of the next "<trace>" or "<trace ...>" tag at or after pos
+size_t find_trace_start(const std::string &buffer, size_t pos) {
+
+    while ((pos = buffer.find("<trace", pos)) != std::string::npos) {
+
+        char c = pos + 6 < buffer.size() ? buffer[pos + 6] : '\0';
+        if (c == '>' || c == ' ' || c == '\t' || c == '\n' || c == '\r') { return pos; }
+        pos += 6;
+    }
+
+    return std::string::npos;
+}
+
+/*
+    Parses the complete traces appended to the file since offset into data.traces and moves offset
+    past the last one. Returns number of traces read, -1 if the file could not be read and -2 if the
+    file is now shorter than offset (it was truncated or rotated).
+*/
+int read_appended_traces(std::string filename, long long &offset, event_log &data) {
+
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        log("Error opening event log: " + filename);
+        return -1;
+    }
+
+    in.seekg(0, std::ios::end);
+    long long size = in.tellg();
+
+    if (size < offset) { return -2; }
+    if (size == offset) { return 0; }
+
+    std::string buffer(size - offset, '\0');
+    in.seekg(offset);
+    in.read(&buffer[0], buffer.size());
+    buffer.resize(in.gcount());
+
+    int added = 0;
+    size_t consumed = 0;
+    size_t start;
+
+    while ((start = find_trace_start(buffer, consumed)) != std::string::npos) {
+
+        size_t end = buffer.find("</trace>", start);
+        if (end == std::string::npos) { break; } //still being written
+
+        end += 8;
+
+        XMLDocument doc;
+        if (doc.Parse(buffer.c_str() + start, end - start) != XML_SUCCESS || doc.FirstChildElement("trace") == nullptr) {
+            log("Skipping malformed trace at byte: " + std::to_string(offset + start));
+        } else {
+            fill_trace(doc.FirstChildElement("trace"), data);
+            added++;
+        }
+
+        consumed = end;
+    }
+
+    offset += consumed;
+
+    return added;
+}
+
+//merges whatever changed in the variant table since last time into the graph
+void update_follow_graph(follow_state &state, int windowed) {
+
+    if (state.unique_traces.empty()) { return; }
+
+    std::vector<unique_trace> sorted = state.unique_traces;
+    std::sort(sorted.begin(), sorted.end());
+
+    //merge history is only needed to take cases out again, without a window it would just grow forever
+    merge_history *history = windowed ? &state.history : nullptr;
+
+    //empty graph, or every case in it expired
+    if (state.graph.mt.base_nodes.empty()) {
+        state.history = merge_history();
+        state.graph.mt = step_2_build_graph(sorted, history);
+        state.graph.variants.assign(sorted.begin(), sorted.begin() + variants_to_merge(sorted));
+        state.graph.loaded = 1;
+    } else {
+        merge_snapshot_delta(state.graph.mt, state.graph.variants, sorted, history);
+    }
+}
+
+window_case make_window_case(const trace &t) {
+
+    window_case c;
+    c.start = t.events[0].time;
+    c.shorthand = t.shorthand;
+    for (const event &e : t.events) {
+        c.times.push_back(e.time - c.start);
+    }
+
+    return c;
+}
+
+//cases mostly arrive in order, so this is almost always an append
+void add_window_case(std::deque<window_case> &window, const window_case &c) {
+
+    std::deque<window_case>::iterator it = window.end();
+    while (it != window.begin() && (it - 1)->start > c.start) { it--; }
+
+    window.insert(it, c);
+}
+
+//the opposite of add_trace_to_unique_traces. variants without cases are removed
+void remove_case_from_unique_traces(std::vector<unique_trace> &unique_traces,
+                                    std::unordered_map<std::string, int> &variant_index, const window_case &c) {
+
+    std::unordered_map<std::string, int>::iterator it = variant_index.find(c.shorthand);
+    if (it == variant_index.end()) { return; }
+
+    int index = it->second;
+    unique_trace &ut = unique_traces[index];
+
+    if (ut.count > 1) {
+        for (int k = 1; k < ut.times.size(); k++) {
+            ut.times[k] = unmerge_time(ut.count, ut.times[k], c.times[k]);
+        }
+        ut.count--;
+        return;
+    }
+
+    variant_index.erase(it);
+    if (index != unique_traces.size() - 1) {
+        unique_traces[index] = unique_traces.back();
+        variant_index[unique_traces[index].shorthand] = index;
+    }
+    unique_traces.pop_back();
+}
+
+//takes every case that started before the window out of the variant table and the graph
+int expire_window(follow_state &state, float window_days) {
+
+    time_t cutoff = window_start(state.newest, window_days);
+    int expired = 0;
+    int missing = 0;
+    std::vector<int> emptied;
+
+    while (!state.window.empty() && state.window.front().start < cutoff) {
+
+        const window_case &c = state.window.front();
+        remove_case_from_unique_traces(state.unique_traces, state.variant_index, c);
+
+        //only cases of the SIZE most common variants are in the graph
+        int in_graph = 0;
+        for (const unique_trace &ut : state.graph.variants) {
+            if (ut.shorthand == c.shorthand) { in_graph = 1; break; }
+        }
+        if (in_graph && !retract_case(state.graph.mt, state.history, state.graph.variants, c.shorthand, c.times, emptied)) {
+            missing++;
+        }
+
+        state.window.pop_front();
+        expired++;
+    }
+
+    drop_nodes(state.graph.mt, emptied);
+
+    if (missing) {
+        log("Expired cases with no merge history (was the state created without --window?): ", missing);
+    }
+
+    return expired;
+}
+
+//adds the traces read into data to the variant table and the graph, expiring what fell out of the window
+//(window_days 0 keeps everything). returns the number of cases expired
+int add_follow_traces(follow_state &state, event_log &data, float window_days) {
+
+    int windowed = window_days > 0;
+    int expired = 0;
+
+    if (windowed) {
+        for (const trace &t : data.traces) {
+            if (!t.events.empty() && t.events[0].time > state.newest) { state.newest = t.events[0].time; }
+        }
+    }
+
+    for (const trace &t : data.traces) {
+
+        if (t.events.empty()) { continue; }
+
+        if (windowed) {
+            if (t.events[0].time < window_start(state.newest, window_days)) { expired++; continue; }
+            add_window_case(state.window, make_window_case(t));
+        }
+
+        add_trace_to_unique_traces(state.unique_traces, state.variant_index, t);
+    }
+    data.traces.clear();
+
+    if (windowed) { expired += expire_window(state, window_days); }
+
+    update_follow_graph(state, windowed);
+    if (needs_compaction(state.graph.mt)) {
+        log("Follow: compacting graph, dropped nodes: ", (int)state.graph.mt.free_nodes.size());
+        compact_graph(state.graph.mt, &state.history);
+    }
+
+    return expired;
+}
+
+//runs until stopped, 1 if an output or the state could not be written. the state on disk then still
+//matches the outputs of the last round that went through, so a restart picks up from there
+int follow_event_log(const run_options &opts) {
+
+    std::string state_file = opts.follow_state;
+    if (state_file.empty()) { state_file = opts.event_log_filename + ".follow"; }
+
+    follow_state state;
+    event_log data;
+
+    if (load_follow_state(state_file, state, data)) {
+        log("Resuming follow from byte: " + std::to_string(state.offset));
+    } else {
+        log("No follow state found, reading " + opts.event_log_filename + " from the start");
+    }
+
+    while (true) {
+
+        std::clock_t start = std::clock();
+        int added = read_appended_traces(opts.event_log_filename, state.offset, data);
+
+        if (added == -2) {
+            log("Event log is shorter than before, it was probably rotated. Starting over");
+            reset_follow_state(state, data);
+            continue;
+        }
+
+        if (added > 0) {
+
+            int expired = add_follow_traces(state, data, opts.window_days);
+            if (!export_data(state.graph.mt, 9999) || !export_formats(state.graph.mt, "9999", opts) ||
+                !save_follow_state(state_file, state, data)) {
+                log("Follow stopped, " + state_file + " still holds the last round that was written");
+                return 1;
+            }
+
+            float ms = 1000.0f * (std::clock() - start) / CLOCKS_PER_SEC;
+            log("Follow: traces added: " + std::to_string(added) + " expired: " + std::to_string(expired) + 
+                " variants: " + std::to_string(state.unique_traces.size()) + " time (ms): ", ms);
+        }
+
+        if (added > 0 || metrics_requested) { write_metrics(); }
+
+        if (opts.follow_once) { break; }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds((int)(opts.follow_interval * 1000)));
+    }
+
+    return 0;
+}
+
+/*
+    Sliding window check (make check). Replays the log through follow mode's window in rounds of
+    appended traces, then rebuilds the window's cases from scratch and compares: the variant table
+    (counts and mean times) and, per activity and per pair of activities, the graph's node counts,
+    end counts, time sums and edge counts. Incremental and rebuilt graph can differ in shape (merge
+    order), those totals can't. Needs at most SIZE variants in the window so every case is in the graph.
+*/
+struct window_totals {
+
+    std::map<std::string, double> counts, ends, times, edges;
+};
+
+window_totals graph_totals(const master_trace &mt) {
+
+    window_totals totals;
+    for (const node &n : mt.nodes_container) {
+
+        if (n.deleted) { continue; }
+
+        const std::string &name = node_name(mt, n);
+        totals.counts[name] += n.event_count;
+        totals.ends[name]   += n.end_count;
+        totals.times[name]  += (double)n.event_count * n.average_time;
+        for (int k = 0; k < n.next_nodes.size(); k++) {
+            totals.edges[name + " > " + node_name(mt, mt.nodes_container[n.next_nodes[k]])] += n.next_nodes_counts[k];
+        }
+    }
+
+    return totals;
+}
+
+int compare_totals(const std::string &what, const std::map<std::string, double> &a, const std::map<std::string, double> &b) {
+
+    int differences = 0;
+    std::set<std::string> keys;
+    for (const auto &kv : a) { keys.insert(kv.first); }
+    for (const auto &kv : b) { keys.insert(kv.first); }
+
+    for (const std::string &key : keys) {
+        double x = a.count(key) ? a.at(key) : 0;
+        double y = b.count(key) ? b.at(key) : 0;
+        if (std::fabs(x - y) > 1e-3 * std::max(std::fabs(x), std::fabs(y)) + 1e-3) {
+            if (differences++ < 10) { log("Window check: " + what + " " + key + " " + std::to_string(x) + " rebuilt " + std::to_string(y)); }
+        }
+    }
+
+    return differences;
+}
+
+std::map<std::string, double> variant_table(const std::vector<unique_trace> &unique_traces, int times) {
+
+    std::map<std::string, double> table;
+    for (const unique_trace &ut : unique_traces) {
+        if (!times) { table[ut.shorthand] = ut.count; continue; }
+        for (int k = 0; k < ut.times.size(); k++) { table[ut.shorthand + ":" + std::to_string(k)] = ut.times[k]; }
+    }
+
+    return table;
+}
+
+//the follow state against the window's cases among seen, aggregated and built from scratch
+int compare_with_rebuild(const follow_state &state, std::vector<trace> seen, float window_days) {
+
+    event_log window;
+    window.traces.swap(seen);
+    apply_window(window, window_days);
+    std::vector<unique_trace> rebuilt = step_1_calc_unique_traces(window.traces);
+    std::sort(rebuilt.begin(), rebuilt.end());
+
+    int differences = 0;
+    differences += compare_totals("variant count", variant_table(state.unique_traces, 0), variant_table(rebuilt, 0));
+    differences += compare_totals("variant time", variant_table(state.unique_traces, 1), variant_table(rebuilt, 1));
+    differences += compare_totals("merged count", variant_table(state.graph.variants, 0), variant_table(rebuilt, 0));
+    differences += compare_totals("merged time", variant_table(state.graph.variants, 1), variant_table(rebuilt, 1));
+
+    window_totals incremental = graph_totals(state.graph.mt);
+    window_totals scratch = graph_totals(step_2_build_graph(rebuilt));
+    differences += compare_totals("node count", incremental.counts, scratch.counts);
+    differences += compare_totals("end count", incremental.ends, scratch.ends);
+    differences += compare_totals("time sum", incremental.times, scratch.times);
+    differences += compare_totals("edge count", incremental.edges, scratch.edges);
+
+    for (const node &n : state.graph.mt.nodes_container) {
+        if (!n.deleted && n.event_count <= 0) { differences++; }
+    }
+
+    return differences;
+}
+
+int check_window(const run_options &opts) {
+
+    const int rounds = 20;
+
+    XMLDocument xes_doc;
+    XMLElement* root_log = open_xes(opts.event_log_filename, xes_doc);
+    if (root_log == nullptr) { return 1; }
+
+    event_log full;
+    fill_event_log(root_log, full);
+
+    if (step_1_calc_unique_traces(full.traces).size() > SIZE) {
+        log("Window check needs a log with at most this many variants: ", SIZE);
+        return 1;
+    }
+
+    follow_state state;
+    event_log data;
+    data.activity_names = full.activity_names;
+
+    int expired = 0;
+    int differences = 0;
+
+    //compared after every round, a variant that only lost cases in a round isn't merged again to hide a drift
+    for (int r = 0; r < rounds; r++) {
+
+        std::vector<trace>::iterator end = full.traces.begin() + full.traces.size() * (r + 1) / rounds;
+        data.traces.assign(full.traces.begin() + full.traces.size() * r / rounds, end);
+        expired += add_follow_traces(state, data, opts.window_days);
+
+        int round_differences = compare_with_rebuild(state, std::vector<trace>(full.traces.begin(), end), opts.window_days);
+        if (round_differences) { log("Window check: differences after round " + std::to_string(r) + ": ", round_differences); }
+        differences += round_differences;
+    }
+
+    log("Window check: cases " + std::to_string(state.window.size()) + " expired " + std::to_string(expired) +
+        " differences: ", differences);
+
+    return differences == 0 ? 0 : 1;
+}
+
+/*
+    Batch mode. Every file in a directory (the Exempel folder for instance) is run through main_algorithm in
+    this one process, on a pool of workers. Each log gets a directory of its own under the output directory,
+    [OUT]/[LOG]/, that all of its files and its log output (log.txt) go to, so runs never overwrite each other.
+    The biggest logs are started first so one large log doesn't end up last. The walk scratch every worker
+    keeps (graph_walk) is reused from one log to the next. batch.txt lists every log with its times.
+
+    With --cache, outputs are also stored under a hash of the log's content, the options that change the
+    outputs and ALGORITHM_VERSION, [CACHE]/[HASH]/. A log whose hash is already there is copied from the
+    cache instead of being run. The entry's marker file is written last, so a half written entry is never used.
+    Bump ALGORITHM_VERSION whenever a change to the algorithm changes its outputs.
+
+    --watch keeps running after the first round and runs logs again as they are added or modified
+    (inotify on linux, elsewhere the directory is polled every --interval seconds).
+*/
+#define ALGORITHM_VERSION 1
+#define CACHE_MARKER "cached.txt"
+
+struct batch_job {
+
+    std::string name;
+    std::string log_file;
+    std::string out_dir;
+    long long size = 0;
+
+    int traces = 0;
+    double parse_seconds = 0;
+    double run_seconds = 0;
+    std::string status = "not run";
+};
+
+//1 if path is a directory afterwards
+int make_directory(const std::string &path) {
+
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) { return 0; }
+    closedir(dir);
+    return 1;
+}
+
+//names of the files in dir (not subdirectories or hidden files), sorted
+std::vector<std::string> files_in(const std::string &dir) {
+
+    std::vector<std::string> names;
+
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) { return names; }
+
+    for (struct dirent *entry = readdir(d); entry != nullptr; entry = readdir(d)) {
+
+        std::string name = entry->d_name;
+        if (name.empty() || name[0] == '.') { continue; }
+
+        struct stat info;
+        if (stat((dir + "/" + name).c_str(), &info) != 0 || !S_ISREG(info.st_mode)) { continue; }
+        names.push_back(name);
+    }
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+//removes the files files_in lists, 1 if all of them are gone
+int clear_directory(const std::string &dir) {
+
+    for (const std::string &name : files_in(dir)) {
+        if (std::remove((dir + "/" + name).c_str()) != 0) { return 0; }
+    }
+
+    return 1;
+}
+
+std::vector<batch_job> batch_jobs(const std::string &dir, const std::vector<std::string> &names) {
+
+    std::vector<batch_job> jobs;
+
+    for (const std::string &name : names) {
+
+        batch_job job;
+        job.name = name;
+        job.log_file = dir + "/" + name;
+
+        struct stat info;
+        if (stat(job.log_file.c_str(), &info) != 0) { continue; }
+        job.size = info.st_size;
+
+        jobs.push_back(job);
+    }
+
+    return jobs;
+}
+
+int copy_file(const std::string &from, const std::string &to) {
+
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    if (!in || !out) { return 0; }
+
+    out << in.rdbuf();
+    return out ? 1 : 0;
+}
+
+//every option that changes what gets written, so a cached result is only used for the same run
+std::string output_options(const run_options &opts) {
+
+    return "size " + std::to_string(SIZE) + " window " + std::to_string(opts.window_days) +
+           " consolidate " + std::to_string(opts.consolidate) + " conformance " + std::to_string(opts.conformance) +
+           " case_index " + std::to_string(opts.case_index) + " export_steps " + std::to_string(opts.export_steps) +
+           " dot " + std::to_string(opts.dot) + " json " + std::to_string(opts.json) + " svg " + std::to_string(opts.svg) +
+           " baseline " + std::to_string(opts.baseline);
+}
+
+//FNV-1a over the log, the options and the algorithm version, as hex. empty if the log can't be read
+std::string cache_key(const std::string &log_file, const run_options &opts) {
+
+    std::ifstream in(log_file, std::ios::binary);
+    if (!in) { return ""; }
+
+    unsigned long long hash = 14695981039346656037ULL;
+    std::string header = "v" + std::to_string(ALGORITHM_VERSION) + " " + output_options(opts) + "\n";
+    for (char c : header) { hash = (hash ^ (unsigned char)c) * 1099511628211ULL; }
+
+    std::vector<char> buffer(1 << 20);
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        for (std::streamsize i = 0; i < in.gcount(); i++) { hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL; }
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", hash);
+    return hex;
+}
+
+//1 if the job's outputs were copied from the cache. job.out_dir is expected to be empty
+int restore_cached(const std::string &entry, batch_job &job) {
+
+    std::ifstream marker(entry + "/" + CACHE_MARKER);
+    if (!(marker >> job.traces)) { return 0; }
+
+    for (const std::string &name : files_in(entry)) {
+        if (name == CACHE_MARKER) { continue; }
+        if (!copy_file(entry + "/" + name, job.out_dir + "/" + name)) {
+            clear_directory(job.out_dir); //the job runs instead, without half a copy lying around
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void store_cached(const std::string &entry, const batch_job &job) {
+
+    if (!make_directory(entry) || !clear_directory(entry)) { return; }
+
+    for (const std::string &name : files_in(job.out_dir)) {
+        if (!copy_file(job.out_dir + "/" + name, entry + "/" + name)) { return; }
+    }
+
+    std::ofstream marker(entry + "/" + CACHE_MARKER);
+    marker << job.traces << "\n";
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void run_batch_job(batch_job &job, run_options opts) {
+
+    std::ofstream job_log(job.out_dir + "/log.txt");
+    log_out = &job_log;
+    output_dir = job.out_dir + "/";
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    event_log data;
+    XMLDocument xes_doc;
+    XMLElement* root_log = open_xes(job.log_file, xes_doc);
+    if (root_log != nullptr) { fill_event_log(root_log, data); }
+    job.parse_seconds = seconds_since(start);
+    job.traces = data.traces.size();
+
+    if (root_log == nullptr) {
+        job.status = "not an event log";
+    } else if (data.traces.empty()) {
+        job.status = "no traces";
+    } else {
+        start = std::chrono::steady_clock::now();
+        graph_snapshot snapshot;
+        int failed = main_algorithm(data, job.log_file, opts, snapshot);
+        job.run_seconds = seconds_since(start);
+        job.status = failed ? "could not write outputs" : "ok";
+    }
+
+    log_out = &std::cerr;
+    output_dir.clear();
+}
+
+//runs the named logs of the batch directory, 0 if all of them went fine
+int run_batch_round(const run_options &opts, const std::vector<std::string> &names) {
+
+    std::vector<batch_job> jobs = batch_jobs(opts.batch_dir, names);
+    if (jobs.empty()) {
+        log("No logs found in: " + opts.batch_dir);
+        return 1;
+    }
+
+    if (!make_directory(opts.batch_out) || (!opts.cache_dir.empty() && !make_directory(opts.cache_dir))) {
+        log("Can't create output directory: " + opts.batch_out);
+        return 1;
+    }
+
+    //biggest first
+    std::vector<int> order(jobs.size());
+    for (int i = 0; i < order.size(); i++) { order[i] = i; }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].size > jobs[b].size; });
+
+    int workers = opts.threads > 0 ? opts.threads : std::max(1, (int)std::thread::hardware_concurrency());
+    workers = std::min(workers, (int)jobs.size());
+
+    //the workers already use every thread, the steps inside a job don't have to
+    run_options job_opts = opts;
+    job_opts.threads = workers > 1 ? 1 : opts.threads;
+    job_opts.snapshot_in.clear();
+    job_opts.snapshot_out.clear();
+    job_opts.journal_out.clear();
+
+    log("Batch: " + std::to_string(jobs.size()) + " logs, workers: ", workers);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    parallel_for(jobs.size(), workers, [&](int i) {
+
+        batch_job &job = jobs[order[i]];
+        job.out_dir = opts.batch_out + "/" + job.name;
+        if (!make_directory(job.out_dir)) {
+            job.status = "can't create " + job.out_dir;
+            return;
+        }
+
+        //outputs of an earlier run (graph9999.svg from a run with --svg...) must not be taken for this run's
+        if (!clear_directory(job.out_dir)) {
+            job.status = "can't clear " + job.out_dir;
+            return;
+        }
+
+        std::string key;
+        if (!opts.cache_dir.empty()) {
+            key = cache_key(job.log_file, opts);
+            if (!key.empty() && restore_cached(opts.cache_dir + "/" + key, job)) {
+                job.status = "ok (cached)";
+                return;
+            }
+        }
+
+        run_batch_job(job, job_opts);
+
+        if (!key.empty() && job.status == "ok") { store_cached(opts.cache_dir + "/" + key, job); }
+    });
+
+    double total = seconds_since(start);
+
+    std::string report = "log | traces | parse seconds | run seconds | status\n";
+    int failed = 0;
+    for (const batch_job &job : jobs) {
+        char times[64];
+        snprintf(times, sizeof(times), "%.3f | %.3f", job.parse_seconds, job.run_seconds);
+        report += job.name + " | " + std::to_string(job.traces) + " | " + times + " | " + job.status + "\n";
+        if (job.status.compare(0, 2, "ok") != 0) { failed++; }
+    }
+
+    char summary[128];
+    snprintf(summary, sizeof(summary), "total: %d logs, %d failed, %.3f seconds on %d workers\n",
+             (int)jobs.size(), failed, total, workers);
+    report += summary;
+
+    std::cerr << report;
+    if (!write_export(opts.batch_out + "/batch.txt", report)) { return 1; }
+
+    return failed == 0 ? 0 : 1;
+}
+
+//size and modification time of every file in dir, what the polling watch compares between rounds
+std::map<std::string, std::pair<long long, long long> > directory_state(const std::string &dir) {
+
+    std::map<std::string, std::pair<long long, long long> > state;
+    for (const std::string &name : files_in(dir)) {
+        struct stat info;
+        if (stat((dir + "/" + name).c_str(), &info) == 0) { state[name] = std::make_pair((long long)info.st_size, (long long)info.st_mtime); }
+    }
+
+    return state;
+}
+
+struct directory_watch {
+
+    std::string dir;
+    int inotify = -1;
+    std::map<std::string, std::pair<long long, long long> > known; //when polling
+};
+
+//started before the first round, so nothing written while it runs is missed
+void start_watch(directory_watch &watch, const std::string &dir) {
+
+    watch.dir = dir;
+
+#ifdef __linux__
+    watch.inotify = inotify_init();
+    if (watch.inotify != -1 && inotify_add_watch(watch.inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        close(watch.inotify);
+        watch.inotify = -1;
+    }
+    if (watch.inotify != -1) { return; }
+#endif
+
+    watch.known = directory_state(dir);
+}
+
+//blocks until logs are added or modified and returns their names
+std::vector<std::string> wait_for_changes(directory_watch &watch, float interval) {
+
+    std::set<std::string> changed;
+
+#ifdef __linux__
+    if (watch.inotify != -1) {
+
+        std::vector<char> buffer(64 * 1024);
+        while (true) {
+
+            int length = read(watch.inotify, buffer.data(), buffer.size());
+            if (length <= 0) { break; }
+
+            for (int i = 0; i < length; ) {
+                const struct inotify_event *e = (const struct inotify_event*)(buffer.data() + i);
+                if (e->len > 0 && e->name[0] != '.') { changed.insert(e->name); }
+                i += sizeof(struct inotify_event) + e->len;
+            }
+            if (changed.empty()) { continue; }
+
+            //whatever else lands right after is picked up in the same round
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            int pending = 0;
+            ioctl(watch.inotify, FIONREAD, &pending);
+            if (pending == 0) { break; }
+        }
+
+        return std::vector<std::string>(changed.begin(), changed.end());
+    }
+#endif
+
+    while (changed.empty()) {
+
+        std::this_thread::sleep_for(std::chrono::milliseconds((int)(interval * 1000)));
+
+        std::map<std::string, std::pair<long long, long long> > now = directory_state(watch.dir);
+        for (const std::pair<const std::string, std::pair<long long, long long> > &file : now) {
+            std::map<std::string, std::pair<long long, long long> >::iterator it = watch.known.find(file.first);
+            if (it == watch.known.end() || it->second != file.second) { changed.insert(file.first); }
+        }
+        watch.known = now;
+    }
+
+    return std::vector<std::string>(changed.begin(), changed.end());
+}
+
+int run_batch(const run_options &opts) {
+
+    directory_watch watch;
+    if (opts.watch) { start_watch(watch, opts.batch_dir); }
+
+    int result = run_batch_round(opts, files_in(opts.batch_dir));
+    if (!opts.watch) { return result; }
+
+    log("Watching: " + opts.batch_dir);
+    write_metrics();
+    while (true) {
+        std::vector<std::string> changed = wait_for_changes(watch, opts.follow_interval);
+        if (!changed.empty()) { run_batch_round(opts, changed); }
+        if (!changed.empty() || metrics_requested) { write_metrics(); }
+    }
+}
+
+/*
+    Graph service, --serve [SOCKET]. Parsed logs and the graphs built from them stay in memory and are
+    queried over a unix domain socket, one request per line:
+        build NAME LOG         parse LOG and build its graph, kept as NAME (replacing an older NAME)
+        list                   resident graphs, one line each: name, nodes, traces, build seconds
+        graph NAME [FORMAT]    the graph as connections (default), timestamps, json, dot or svg
+        node NAME NODE         a node, by index or label (B12): time, counts and edges
+        score NAME CASE        every event of a case of the log, scored against the graph as in online scoring
+        drop NAME
+        metrics [json]         the metrics (with --metrics), Prometheus text format unless json is asked for
+        stop                   shut the service down
+    Each reply is "ok BYTES" or "error BYTES" on a line of its own, followed by BYTES bytes of body.
+
+    Every connection is served on its own thread. A resident graph is never changed once built: a request
+    takes a shared_ptr to the current one under a short lock and works on that, so queries never wait for
+    a build. A build swaps the pointer when it is done, requests still holding the old graph finish on it.
+    --load-test [SOCKET] [NAME] [CLIENTS] [REQUESTS] measures request latency against a running service.
+*/
+#define SERVICE_BACKLOG 64
+
+struct resident_graph {
+
+    std::string log_file;
+    event_log data;
+    master_trace mt;
+    frozen_graph frozen;
+    std::unordered_map<std::string, int> node_lookup; //label -> node
+    std::unordered_map<std::string, int> case_lookup; //case id -> trace
+    double build_seconds = 0;
+};
+
+struct graph_service {
+
+    std::mutex lock;
+    std::map<std::string, std::shared_ptr<const resident_graph> > graphs;
+    run_options opts;
+    int listener = -1;
+    std::atomic<int> stopping;
+    std::set<int> clients;         //open connections, under lock
+    std::atomic<int> connections;  //connection threads still running
+};
+
+std::shared_ptr<const resident_graph> find_graph(graph_service &service, const std::string &name) {
+
+    std::lock_guard<std::mutex> guard(service.lock);
+    std::map<std::string, std::shared_ptr<const resident_graph> >::iterator it = service.graphs.find(name);
+    return it == service.graphs.end() ? nullptr : it->second;
+}
+
+//builds the graph the same way main_algorithm does, nullptr (with error set) if the log can't be used
+std::shared_ptr<resident_graph> build_resident(const std::string &log_file, const run_options &opts, std::string &error) {
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::shared_ptr<resident_graph> g = std::make_shared<resident_graph>();
+    g->log_file = log_file;
+
+    XMLDocument xes_doc;
+    XMLElement* root_log = open_xes(log_file, xes_doc);
+    if (root_log == nullptr) { error = "can't read event log " + log_file; return nullptr; }
+    fill_event_log(root_log, g->data);
+    if (opts.window_days > 0) { apply_window(g->data, opts.window_days); }
+    if (g->data.traces.empty()) { error = "no traces in " + log_file; return nullptr; }
+
+    std::vector<unique_trace> unique_traces = step_1_calc_unique_traces(g->data.traces);
+    std::sort(unique_traces.begin(), unique_traces.end());
+
+    merge_history history;
+    g->mt = step_2_build_graph(unique_traces, &history);
+    if (opts.consolidate) { step_3_clean_graph(g->mt, &history); }
+
+    g->frozen = freeze_graph(g->mt);
+    for (int i = 0; i < g->mt.nodes_container.size(); i++) {
+        if (!g->mt.nodes_container[i].deleted) { g->node_lookup[node_label(g->mt, i)] = i; }
+    }
+    for (int i = 0; i < g->data.traces.size(); i++) { g->case_lookup[g->data.traces[i].case_id] = i; }
+
+    g->build_seconds = seconds_since(start);
+    return g;
+}
+
+std::string describe_node(const resident_graph &g, int node_index) {
+
+    const node &n = g.mt.nodes_container[node_index];
+    std::string body = "node " + node_label(g.mt, node_index) + "\n";
+    body += "time " + number_string(n.average_time) + " (" + seconds_to_timedelta_string(n.average_time) + ")\n";
+    body += "count " + std::to_string(n.event_count) + "\n";
+    body += "end " + std::to_string(n.end_count) + "\n";
+
+    for (int i = 0; i < n.next_nodes.size(); i++) {
+        body += "edge " + node_label(g.mt, n.next_nodes[i]) + " " + std::to_string(n.next_nodes_counts[i]) + "\n";
+    }
+
+    return body;
+}
+
+//one line per event: activity, node it was placed on, 1 if it followed an edge, deviation in seconds
+std::string score_case(const resident_graph &g, const trace &t) {
+
+    case_state state;
+    std::string body;
+
+    for (const event &e : t.events) {
+
+        event_score score = score_event(g.frozen, state, make_live_event(g.frozen, 0, e.name, e.time));
+        body += e.name + " " + (score.node == -1 ? std::string("-") : node_label(g.mt, score.node)) + " " +
+                std::to_string((int)score.known_edge) + " " + number_string(score.deviation) + "\n";
+    }
+
+    return body;
+}
+
+//answers one request line. 1 on success, body holds the reply or the error
+int handle_request(graph_service &service, const std::string &line, std::string &body) {
+
+    std::istringstream in(line);
+    std::string verb;
+    std::string name;
+    in >> verb >> name;
+
+    if (verb == "list") {
+        std::lock_guard<std::mutex> guard(service.lock);
+        for (const std::pair<const std::string, std::shared_ptr<const resident_graph> > &entry : service.graphs) {
+            body += entry.first + " nodes " + std::to_string(entry.second->node_lookup.size()) +
+                    " traces " + std::to_string(entry.second->data.traces.size()) +
+                    " seconds " + number_string(entry.second->build_seconds) + "\n";
+        }
+        return 1;
+    }
+
+    if (verb == "metrics") {
+        if (!metrics_on) { body = "metrics are off, start the service with --metrics"; return 0; }
+        body = name == "json" ? metrics_json() : metrics_prometheus();
+        return 1;
+    }
+
+    if (verb == "stop") {
+        service.stopping = 1;
+        shutdown(service.listener, SHUT_RDWR);
+        return 1;
+    }
+
+    if (name.empty()) { body = "usage: " + verb + " NAME ..."; return 0; }
+
+    if (verb == "build") {
+
+        std::string log_file;
+        std::getline(in >> std::ws, log_file);
+        std::shared_ptr<resident_graph> built = build_resident(log_file, service.opts, body);
+        if (built == nullptr) { return 0; }
+
+        std::lock_guard<std::mutex> guard(service.lock);
+        service.graphs[name] = built;
+        body = "built " + name + " nodes " + std::to_string(built->node_lookup.size()) +
+               " seconds " + number_string(built->build_seconds) + "\n";
+        return 1;
+    }
+
+    if (verb == "drop") {
+        std::lock_guard<std::mutex> guard(service.lock);
+        if (service.graphs.erase(name) == 0) { body = "no graph " + name; return 0; }
+        return 1;
+    }
+
+    std::shared_ptr<const resident_graph> g = find_graph(service, name);
+    if (g == nullptr) { body = "no graph " + name; return 0; }
+
+    std::string arg;
+    in >> arg;
+
+    if (verb == "graph") {
+
+        std::string connections;
+        std::string timestamps;
+
+        if      (arg == "" || arg == "connections") { render_export(g->mt, body, timestamps); }
+        else if (arg == "timestamps")               { render_export(g->mt, connections, body); }
+        else if (arg == "json")                     { body = render_json(g->mt); }
+        else if (arg == "dot")                      { body = render_dot(g->mt); }
+        else if (arg == "svg")                      { body = render_svg(g->mt, 1); }
+        else { body = "unknown format " + arg; return 0; }
+        return 1;
+    }
+
+    if (verb == "nodes") {
+
+        for (int i = 0; i < g->mt.nodes_container.size(); i++) {
+            if (!g->mt.nodes_container[i].deleted) { body += node_label(g->mt, i) + "\n"; }
+        }
+        return 1;
+    }
+
+    if (verb == "node") {
+
+        //labels hold the activity name, which can have spaces
+        std::string rest;
+        std::getline(in, rest);
+        arg += rest;
+
+        int node_index = -1;
+        std::unordered_map<std::string, int>::const_iterator it = g->node_lookup.find(arg);
+        if (it != g->node_lookup.end()) {
+            node_index = it->second;
+        } else if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos) {
+            node_index = std::atoi(arg.c_str());
+        }
+
+        if (node_index < 0 || node_index >= g->mt.nodes_container.size() || g->mt.nodes_container[node_index].deleted) {
+            body = "no node " + arg;
+            return 0;
+        }
+
+        body = describe_node(*g, node_index);
+        return 1;
+    }
+
+    if (verb == "score") {
+
+        std::unordered_map<std::string, int>::const_iterator it = g->case_lookup.find(arg);
+        if (it == g->case_lookup.end()) { body = "no case " + arg; return 0; }
+
+        body = score_case(*g, g->data.traces[it->second]);
+        return 1;
+    }
+
+    body = "unknown request " + verb;
+    return 0;
+}
+
+#ifndef _WIN32
+
+int send_all(int fd, const std::string &data) {
+
+    for (size_t sent = 0; sent < data.size(); ) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0) { return 0; }
+        sent += n;
+    }
+
+    return 1;
+}
+
+void serve_connection(graph_service &service, int client) {
+
+    //the builder logs a lot, none of it belongs on the service's output
+    std::ostream discard(nullptr);
+    log_out = &discard;
+
+    {
+        std::lock_guard<std::mutex> guard(service.lock);
+        service.clients.insert(client);
+    }
+
+    std::string pending;
+    char buffer[4096];
+
+    while (!service.stopping) {
+
+        ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+        if (n <= 0) { break; }
+        pending.append(buffer, n);
+
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+            if (line.empty()) { continue; }
+
+            std::string body;
+            int ok = handle_request(service, line, body);
+            if (!send_all(client, (ok ? "ok " : "error ") + std::to_string(body.size()) + "\n" + body)) { break; }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(service.lock);
+        service.clients.erase(client);
+    }
+    close(client);
+    log_out = &std::cerr;
+    service.connections--;
+}
+
+int open_socket(const std::string &path, int listening) {
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) { log("Socket path too long: " + path); return -1; }
+    strcpy(address.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) { return -1; }
+
+    if (listening) {
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr*)&address, sizeof(address)) == -1 || listen(fd, SERVICE_BACKLOG) == -1) { close(fd); return -1; }
+    } else {
+        if (connect(fd, (sockaddr*)&address, sizeof(address)) == -1) { close(fd); return -1; }
+    }
+
+    return fd;
+}
+
+int run_service(const run_options &opts) {
+
+    signal(SIGPIPE, SIG_IGN);
+
+    graph_service service;
+    service.opts = opts;
+    service.stopping = 0;
+    service.connections = 0;
+    service.listener = open_socket(opts.serve, 1);
+    if (service.listener == -1) {
+        log("Can't listen on: " + opts.serve);
+        return 1;
+    }
+
+    log("Serving on: " + opts.serve);
+
+    //connections don't take SIGUSR1, so it interrupts accept and the metrics are written right away
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+
+    while (!service.stopping) {
+        int client = accept(service.listener, nullptr, nullptr);
+        if (metrics_requested) { write_metrics(); }
+        if (client == -1) { continue; }
+        service.connections++;
+
+        sigset_t previous;
+        pthread_sigmask(SIG_BLOCK, &usr1, &previous);
+        std::thread(serve_connection, std::ref(service), client).detach();
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+
+    //wake connections waiting for their next request, then wait for every one to finish
+    while (service.connections > 0) {
+        {
+            std::lock_guard<std::mutex> guard(service.lock);
+            for (int client : service.clients) { shutdown(client, SHUT_RD); }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    close(service.listener);
+    unlink(opts.serve.c_str());
+
+    log("Service stopped");
+    return 0;
+}
+
+//sends one request and reads its reply. 1 if the service answered ok
+int service_request(int fd, const std::string &request, std::string &body) {
+
+    if (!send_all(fd, request + "\n")) { return -1; }
+
+    std::string header;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1 && c != '\n') { header += c; }
+
+    size_t space = header.find(' ');
+    if (space == std::string::npos) { return -1; }
+
+    body.resize(std::atol(header.c_str() + space + 1));
+    for (size_t got = 0; got < body.size(); ) {
+        ssize_t n = recv(fd, &body[got], body.size() - got, 0);
+        if (n <= 0) { return -1; }
+        got += n;
+    }
+
+    return header.compare(0, space, "ok") == 0 ? 1 : 0;
+}
+
+//--request [SOCKET] [REQUEST...], prints the reply's body
+int run_client_request(const std::string &path, const std::string &request) {
+
+    int fd = open_socket(path, 0);
+    if (fd == -1) { log("Can't connect to: " + path); return 1; }
+
+    std::string body;
+    int ok = service_request(fd, request, body);
+    close(fd);
+
+    if (ok == 1) { std::cout << body; return 0; }
+
+    log("Request failed: " + body);
+    return 1;
+}
+
+/*
+    Load generator. CLIENTS connections send REQUESTS requests each, node queries over every node of the
+    graph with every tenth one fetching the whole graph, and the latency of each is recorded.
+*/
+int run_load_test(const std::string &path, const std::string &name, int clients, int requests) {
+
+    int fd = open_socket(path, 0);
+    std::string listing;
+    if (fd == -1) { log("Can't connect to: " + path); return 1; }
+    int listed = service_request(fd, "nodes " + name, listing);
+    close(fd);
+    if (listed == -1) { log("Can't connect to: " + path); return 1; }
+
+    //queried by label, deleted nodes leave gaps in the indexes
+    std::vector<std::string> labels;
+    std::istringstream lines(listing);
+    for (std::string line; std::getline(lines, line); ) {
+        if (!line.empty()) { labels.push_back(line); }
+    }
+    if (listed != 1 || labels.empty()) { log("No graph on the service: " + name); return 1; }
+    int nodes = labels.size();
+
+    std::vector<std::vector<double> > latencies(clients);
+    std::atomic<int> failed(0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int c = 0; c < clients; c++) {
+        workers.push_back(std::thread([&, c]() {
+
+            int fd = open_socket(path, 0);
+            if (fd == -1) { failed += requests; return; }
+
+            std::string body;
+            for (int r = 0; r < requests; r++) {
+
+                std::string request = r % 10 == 9 ? "graph " + name : "node " + name + " " + labels[(c * requests + r) % nodes];
+
+                std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+                int ok = service_request(fd, request, body);
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+
+                if (ok == -1) { failed += requests - r; break; }
+                if (ok == 0) { failed++; }
+            }
+            close(fd);
+        }));
+    }
+    for (std::thread &t : workers) { t.join(); }
+
+    double seconds = seconds_since(start);
+
+    std::vector<double> all;
+    for (const std::vector<double> &l : latencies) { all.insert(all.end(), l.begin(), l.end()); }
+    if (all.empty()) { log("No requests answered"); return 1; }
+    std::sort(all.begin(), all.end());
+
+    log("Load test requests: " + std::to_string(all.size()) + " clients: " + std::to_string(clients) + " failed: ", (int)failed);
+    log("Load test requests/s: ", (float)(all.size() / seconds));
+    log("Load test us p50: ", (float)all[all.size() / 2]);
+    log("Load test us p99: ", (float)all[all.size() * 99 / 100]);
+    log("Load test us max: ", (float)all.back());
+
+    return failed == 0 ? 0 : 1;
+}
+
+#else
+
+int run_service(const run_options &opts) {
+
+    log("The graph service needs unix domain sockets, it is not available on windows");
+    return 1;
+}
+
+int run_client_request(const std::string &path, const std::string &request) { return run_service(run_options()); }
+
+int run_load_test(const std::string &path, const std::string &name, int clients, int requests) { return run_service(run_options()); }
+
+#endif
+
+/*
+    Benchmarks, --bench [DIR] (repeatable). Every log in DIR is run through the stages of the build one
+    suite at a time, each suite repeated until it has run BENCH_MIN_SECONDS and BENCH_MIN_SAMPLES times,
+    and throughput and latency percentiles are printed. A sample is one timed batch (BENCH_BATCH items, or
+    one call for the suites that time whole calls) divided by its items, single items are too short to time,
+    so the percentiles are those of the batch means. get_closest_nodes, check_for_loops and check_valid_merge run
+    against the finished graph with the queries the merged variants make (closest node of each letter,
+    linked from the closest node of the letter before it). merge_master_trace merges the variants one at
+    a time as step 2 does. LOG: lines go nowhere while the suites run.
+
+    --golden [DIR] compares the graph of every log with DIR/[LOG].connections.txt / .timestamps.txt (and
+    writes the ones that are missing), so a speedup can't change results unnoticed.
+    --bench-nodes [N] also runs add_new_node, export_data and compact_graph on a synthetic graph of N nodes
+    (chains of BENCH_CHAIN nodes, every other chain dropped before compacting) and prints its size.
+    --bench-save [FILE] stores the results, --bench-compare [FILE] compares against stored ones and marks
+    suites whose median latency grew by more than BENCH_TOLERANCE (the median, since a busy machine
+    throws the mean off more). Either failing makes the exit code 1.
+*/
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MIN_SAMPLES 20
+#define BENCH_BATCH 1024
+#define BENCH_TOLERANCE 0.25
+#define BENCH_CHAIN 1000
+
+struct bench_suite {
+
+    std::string log;
+    std::string name;
+    std::string unit;            //what an item is: timestamps, events, calls...
+    long long items = 0;
+    double seconds = 0;
+    std::vector<double> ns;      //per item, one sample per timed batch
+};
+
+//results of the timed calls end up here, so the compiler can't drop the calls
+volatile long long bench_sink = 0;
+
+int bench_done(const bench_suite &suite) {
+
+    return suite.seconds >= BENCH_MIN_SECONDS && suite.ns.size() >= BENCH_MIN_SAMPLES;
+}
+
+void bench_sample(bench_suite &suite, std::chrono::steady_clock::time_point start, long long items) {
+
+    double seconds = seconds_since(start);
+    if (items == 0) { return; }
+    suite.seconds += seconds;
+    suite.items += items;
+    suite.ns.push_back(seconds * 1e9 / items);
+}
+
+double percentile(std::vector<double> sorted, double p) {
+
+    if (sorted.empty()) { return 0; }
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min((int)sorted.size() - 1, (int)(p * sorted.size()))];
+}
+
+//the queries step 2 makes for the merged variants: node to attempt and the node it would be linked from
+struct merge_query {
+
+    int variant;
+    int letter;
+    int node;
+    int prev;
+    int skip_loop;
+};
+
+std::vector<merge_query> merge_queries(master_trace &mt, const std::vector<unique_trace> &unique_traces) {
+
+    std::vector<merge_query> queries;
+    clear_used_nodes(mt);
+
+    for (int v = 0; v < variants_to_merge(unique_traces); v++) {
+
+        const unique_trace &ut = unique_traces[v];
+        int prev = -1;
+
+        for (int i = 0; i < ut.events.size(); i++) {
+
+            std::vector<int> closest = get_closest_nodes(mt, ut.events[i], ut.times[i]);
+            if (closest.empty()) { prev = -1; continue; }
+
+            merge_query q;
+            q.variant = v;
+            q.letter = i;
+            q.node = closest.back();
+            q.prev = prev;
+            q.skip_loop = prev == -1 || i == ut.events.size() - 1;
+            if (prev != -1) {
+                for (int kid : mt.nodes_container[prev].next_nodes) { q.skip_loop |= kid == q.node; }
             }
+            queries.push_back(q);
+
+            prev = q.node;
         }
+    }
 
-    
+    return queries;
+}
+
+//runs every suite on one log. 0 if the log can't be read, golden is set to 0 on a mismatch
+int bench_log(const std::string &log_file, const std::string &name, const run_options &opts,
+              std::vector<bench_suite> &suites, int &golden) {
+
+    XMLDocument xes_doc;
+    XMLElement* root_log = open_xes(log_file, xes_doc);
+    if (root_log == nullptr) { return 0; }
+
+    std::vector<std::string> timestamps;
+    for (XMLElement* t = root_log->FirstChildElement("trace"); t != nullptr; t = t->NextSiblingElement("trace")) {
+        for (XMLElement* e = t->FirstChildElement("event"); e != nullptr; e = e->NextSiblingElement("event")) {
+            for (XMLElement* a = e->FirstChildElement(); a != nullptr; a = a->NextSiblingElement()) {
+                const char* key = a->Attribute("key");
+                if (key && std::string(key) == "time:timestamp" && a->Attribute("value")) { timestamps.push_back(a->Attribute("value")); }
+            }
+        }
     }
 
-    //Step 3
-    //step_3_clean_graph(mt);
+    long long sink = 0; //stored to bench_sink at the end
+    bench_suite suite;
+    suite.log = name;
+
+    suite.name = "parse_timestamp"; suite.unit = "timestamps";
+    while (!bench_done(suite) && !timestamps.empty()) {
+        for (int i = 0; i < timestamps.size(); i += BENCH_BATCH) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int end = std::min((int)timestamps.size(), i + BENCH_BATCH);
+            for (int j = i; j < end; j++) { sink += parse_timestamp(timestamps[j]); }
+            bench_sample(suite, start, end - i);
+        }
+    }
+    suites.push_back(suite);
+
+    event_log data;
+    suite = bench_suite(); suite.log = name; suite.name = "fill_event_log"; suite.unit = "events";
+    while (!bench_done(suite)) {
+        data = event_log();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        fill_event_log(root_log, data);
+        bench_sample(suite, start, data.events);
+        if (data.events == 0) { break; }
+    }
+    suites.push_back(suite);
 
-    // Not part of algorithm, just outputting data.
-    //float time_diff = calc_time_diff(mt, data.events, data.traces);
+    if (data.traces.empty()) {
+        log("No traces in " + log_file);
+        return 0;
+    }
 
-    //log("-------------------------------");
-    //log(name + " TIME_DIFF: ", time_diff);
-    //log("-------------------------------");
+    std::vector<unique_trace> unique_traces;
+    suite = bench_suite(); suite.log = name; suite.name = "step_1_calc_unique_traces"; suite.unit = "traces";
+    while (!bench_done(suite)) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        unique_traces = step_1_calc_unique_traces(data.traces);
+        bench_sample(suite, start, data.traces.size());
+    }
+    suites.push_back(suite);
+    std::sort(unique_traces.begin(), unique_traces.end());
+
+    //built the way main_algorithm builds it, for the golden files and the suites below
+    master_trace mt = step_2_build_graph(unique_traces);
+
+    suite = bench_suite(); suite.log = name; suite.name = "merge_master_trace"; suite.unit = "variants";
+    std::vector<unique_trace> first(unique_traces.begin(), unique_traces.begin() + 1);
+    while (!bench_done(suite) && variants_to_merge(unique_traces) > 1) {
+        master_trace built = step_2_build_graph(first);
+        for (int i = 1; i < variants_to_merge(unique_traces); i++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            sink += merge_master_trace(built, unique_traces[i]).size();
+            bench_sample(suite, start, 1);
+        }
+    }
+    suites.push_back(suite);
+
+    std::vector<merge_query> queries = merge_queries(mt, unique_traces);
+
+    suite = bench_suite(); suite.log = name; suite.name = "get_closest_nodes"; suite.unit = "calls";
+    while (!bench_done(suite) && !queries.empty()) {
+        for (int i = 0; i < queries.size(); i += BENCH_BATCH) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int end = std::min((int)queries.size(), i + BENCH_BATCH);
+            for (int j = i; j < end; j++) {
+                const unique_trace &ut = unique_traces[queries[j].variant];
+                sink += get_closest_nodes(mt, ut.events[queries[j].letter], ut.times[queries[j].letter]).size();
+            }
+            bench_sample(suite, start, end - i);
+        }
+    }
+    suites.push_back(suite);
+
+    //the attempts are checked the way step 2 checks them outside a recursion, the finished graph keeps
+    //its time order so none of them can hit the broken invariant
+    for (int loops = 1; loops >= 0; loops--) {
+
+        suite = bench_suite(); suite.log = name; suite.name = loops ? "check_for_loops" : "check_valid_merge"; suite.unit = "calls";
+        while (!bench_done(suite) && !queries.empty()) {
+            for (int i = 0; i < queries.size(); i += BENCH_BATCH) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                int end = std::min((int)queries.size(), i + BENCH_BATCH);
+                for (int j = i; j < end; j++) {
+                    const merge_query &q = queries[j];
+                    const unique_trace &ut = unique_traces[q.variant];
+                    mt.attempt_node  = q.node;
+                    mt.attempt_prev  = q.prev;
+                    mt.attempt_count = ut.count;
+                    mt.attempt_time  = ut.times[q.letter];
+                    float next_time = q.letter + 1 < ut.times.size() ? ut.times[q.letter + 1] : -1;
+                    sink += loops ? check_for_loops(mt) : check_valid_merge(mt, next_time, ut, q.letter, q.skip_loop);
+                }
+                bench_sample(suite, start, end - i);
+            }
+        }
+        suites.push_back(suite);
+    }
+
+    mt.attempt_node = -1;
+    mt.attempt_prev = -1;
+
+    suite = bench_suite(); suite.log = name; suite.name = "export_data"; suite.unit = "calls";
+    output_dir = "bench_output/";
+    make_directory(output_dir);
+    while (!bench_done(suite)) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        export_data(mt, 9999);
+        bench_sample(suite, start, 1);
+    }
+    output_dir = "";
+    suites.push_back(suite);
+
+    bench_sink = sink;
+
+    if (!opts.golden_dir.empty()) {
+
+        std::string connections;
+        std::string timestamps_text;
+        render_export(mt, connections, timestamps_text);
+
+        std::string files[2] = { opts.golden_dir + "/" + name + ".connections.txt", opts.golden_dir + "/" + name + ".timestamps.txt" };
+        std::string contents[2] = { connections, timestamps_text };
+
+        for (int f = 0; f < 2; f++) {
+
+            std::ifstream in(files[f], std::ios::binary);
+            if (!in) {
+                std::ofstream out(files[f], std::ios::binary);
+                out << contents[f];
+                if (out.flush()) {
+                    std::cout << "golden saved: " << files[f] << "\n";
+                } else {
+                    std::cout << "can't write golden file: " << files[f] << "\n";
+                    golden = 0;
+                }
+                continue;
+            }
+
+            std::stringstream stored;
+            stored << in.rdbuf();
+            if (stored.str() != contents[f]) {
+                std::cout << "GOLDEN MISMATCH: " << files[f] << "\n";
+                golden = 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+//chains of BENCH_CHAIN nodes, one variant each, the last one shorter if nodes doesn't divide
+master_trace synthetic_graph(int nodes) {
+
+    master_trace mt;
+    mt.total_node_count = 0;
+
+    for (int c = 0; c * BENCH_CHAIN < nodes; c++) {
+
+        unique_trace ut;
+        ut.count = 1 + c % 7;
+        ut.shorthand = "chain" + std::to_string(c);
+        int length = std::min(BENCH_CHAIN, nodes - c * BENCH_CHAIN);
+        for (int k = 0; k < length; k++) {
+            ut.events.push_back('A' + k % 20);
+            ut.names.push_back("Activity_" + std::to_string(k % 20));
+            ut.times.push_back(k);
+        }
+
+        int prev = -1;
+        for (int k = 0; k < length; k++) { prev = add_new_node(mt, ut, k, prev, k == length - 1, 1); }
+    }
+
+    return mt;
+}
+
+//drops every other chain the way the sliding window drops nodes, leaving them for compact_graph
+void drop_every_other_chain(master_trace &mt) {
+
+    std::vector<int> kept;
+    for (int c = 0; c < mt.base_nodes.size(); c++) {
+
+        if (c % 2 == 0) { kept.push_back(mt.base_nodes[c]); continue; }
+
+        std::vector<int> chain;
+        for (int n = mt.base_nodes[c]; ; n = mt.nodes_container[n].next_nodes[0]) {
+            chain.push_back(n);
+            if (mt.nodes_container[n].next_nodes.empty()) { break; }
+        }
+        for (int n : chain) { free_node(mt, n); }
+    }
+
+    mt.base_nodes = kept;
+}
+
+//the suites of --bench-nodes, golden is set to 0 if compaction leaves a broken graph
+void bench_large_graph(int nodes, std::vector<bench_suite> &suites, int &golden) {
+
+    std::string name = "synthetic_" + std::to_string(nodes);
+    bench_suite suite;
+
+    suite.log = name; suite.name = "add_new_node"; suite.unit = "nodes";
+    master_trace mt;
+    while (!bench_done(suite)) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mt = synthetic_graph(nodes);
+        bench_sample(suite, start, mt.nodes_container.size());
+    }
+    suites.push_back(suite);
+
+    suite = bench_suite(); suite.log = name; suite.name = "export_data"; suite.unit = "nodes";
+    output_dir = "bench_output/";
+    make_directory(output_dir);
+    while (!bench_done(suite)) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        export_data(mt, 9999);
+        bench_sample(suite, start, mt.nodes_container.size());
+    }
+    output_dir = "";
+    suites.push_back(suite);
+
+    long long bytes = graph_bytes(mt);
+
+    suite = bench_suite(); suite.log = name; suite.name = "compact_graph"; suite.unit = "nodes";
+    while (!bench_done(suite)) {
+        master_trace dropped = mt;
+        drop_every_other_chain(dropped);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        compact_graph(dropped);
+        bench_sample(suite, start, mt.nodes_container.size());
+
+        int kept = 0;
+        for (int c = 0; c * BENCH_CHAIN < nodes; c += 2) { kept += std::min(BENCH_CHAIN, nodes - c * BENCH_CHAIN); }
+        int broken = dropped.nodes_container.size() != kept;
+        for (int i = 0; i < dropped.nodes_container.size() && !broken; i++) {
+            broken = dropped.nodes_container[i].creationID != i || dropped.nodes_container[i].deleted;
+            for (int kid : dropped.nodes_container[i].next_nodes) { broken |= kid < 0 || kid >= kept; }
+        }
+        if (broken) {
+            std::cout << name << ": compact_graph left a broken graph\n";
+            golden = 0;
+            break;
+        }
+    }
+    suites.push_back(suite);
+
+    std::cout << name << ": " << mt.nodes_container.size() << " nodes, graph " << bytes / (1024 * 1024) << " MB, "
+              << bytes / std::max<long long>(1, mt.nodes_container.size()) << " bytes per node\n";
+}
+
+//log \t suite \t items per second \t p50 \t p90 \t p99 (ns per item over the timed batches), as p50 by log and suite
+std::map<std::pair<std::string, std::string>, double> load_bench_results(const std::string &filename) {
+
+    std::map<std::pair<std::string, std::string>, double> results;
+    std::ifstream in(filename);
+    std::string line;
+
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields;
+        std::stringstream ss(line);
+        std::string field;
+        while (std::getline(ss, field, '\t')) { fields.push_back(field); }
+        if (fields.size() >= 4) { results[std::make_pair(fields[0], fields[1])] = std::atof(fields[3].c_str()); }
+    }
+
+    return results;
+}
+
+//one line of the results table, 1 if the suite regressed against the baseline
+int print_bench_suite(const bench_suite &suite, const std::map<std::pair<std::string, std::string>, double> &baseline) {
+
+    //merge_master_trace has nothing to do for a log with one variant
+    if (suite.items == 0) { return 0; }
+
+    double rate = suite.seconds > 0 ? suite.items / suite.seconds : 0;
+    double p50 = percentile(suite.ns, 0.5);
+    int regressed = 0;
+
+    std::string versus;
+    std::map<std::pair<std::string, std::string>, double>::const_iterator it = baseline.find(std::make_pair(suite.log, suite.name));
+    if (it != baseline.end() && it->second > 0) {
+        char ratio[64];
+        snprintf(ratio, sizeof(ratio), "p50 %+.1f%%", (p50 / it->second - 1) * 100);
+        versus = ratio;
+        if (p50 > it->second * (1 + BENCH_TOLERANCE)) {
+            versus += " REGRESSED";
+            regressed = 1;
+        }
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-24s %-26s %12lld %12.0f %10.0f %10.0f %10.0f  %s\n",
+             suite.log.c_str(), suite.name.c_str(), suite.items, rate, p50,
+             percentile(suite.ns, 0.9), percentile(suite.ns, 0.99), versus.c_str());
+    std::cout << line << std::flush;
+
+    return regressed;
+}
+
+int run_benchmarks(const run_options &opts) {
+
+    std::map<std::pair<std::string, std::string>, double> baseline;
+    if (!opts.bench_compare.empty()) {
+        baseline = load_bench_results(opts.bench_compare);
+        if (baseline.empty()) { std::cout << "no baseline in " << opts.bench_compare << ", nothing to compare\n"; }
+    }
+    if (!opts.golden_dir.empty()) { make_directory(opts.golden_dir); }
+
+    std::ostringstream discard;
+    std::vector<bench_suite> suites;
+    int golden = 1;
+    int regressions = 0;
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-24s %-26s %12s %12s %10s %10s %10s  %s\n",
+             "log", "suite", "items", "items/s", "p50 ns/it", "p90 ns/it", "p99 ns/it", "vs baseline");
+    std::cout << line;
+
+    for (const std::string &dir : opts.bench_dirs) {
+        for (const std::string &name : files_in(dir)) {
+
+            int first = suites.size();
+            log_out = &discard;
+            int ok = bench_log(dir + "/" + name, name, opts, suites, golden);
+            log_out = &std::cerr;
+            discard.str("");
+            if (!ok) { std::cout << name << ": can't be benchmarked, skipped\n"; continue; }
+
+            for (int s = first; s < suites.size(); s++) { regressions += print_bench_suite(suites[s], baseline); }
+        }
+    }
+
+    if (opts.bench_nodes > 0) {
+        int first = suites.size();
+        log_out = &discard;
+        bench_large_graph(opts.bench_nodes, suites, golden);
+        log_out = &std::cerr;
+        discard.str("");
+        for (int s = first; s < suites.size(); s++) { regressions += print_bench_suite(suites[s], baseline); }
+    }
+
+    if (!opts.bench_save.empty()) {
+        std::ofstream out(opts.bench_save);
+        for (const bench_suite &suite : suites) {
+            out << suite.log << "\t" << suite.name << "\t" << (suite.seconds > 0 ? suite.items / suite.seconds : 0) << "\t"
+                << percentile(suite.ns, 0.5) << "\t" << percentile(suite.ns, 0.9) << "\t" << percentile(suite.ns, 0.99) << "\n";
+        }
+        std::cout << "results saved: " << opts.bench_save << "\n";
+    }
+
+    if (regressions > 0) { std::cout << "suites regressed: " << regressions << "\n"; }
+    if (!golden) { std::cout << "graphs differ from the golden files\n"; }
+
+    return regressions == 0 && golden ? 0 : 1;
+}
+
+/*
+    Shared library, compiled with -DDESKTOP_LIBRARY by `make library` instead of main. The C interface
+    in desktop_api.h wraps the same steps main_algorithm runs: a log is parsed into a desktop_log, its
+    variants are aggregated once, and each built graph is flattened into arrays that callers (desktop.py)
+    read in place. Nothing here calls exit, failures return NULL / -1 and set desktop_last_error.
+*/
+#ifdef DESKTOP_LIBRARY
+
+#include "desktop_api.h"
+
+struct desktop_log {
+
+    event_log data;
+    std::vector<unique_trace> unique_traces;
+    std::vector<int> variant_counts;
+    int aggregated = 0;
+};
+
+struct desktop_graph {
+
+    master_trace mt;
+    std::vector<float> seconds;
+    std::vector<int> counts;
+    std::vector<int> end_counts;
+    std::vector<int> activities;
+    std::vector<std::string> labels;
+    std::vector<int> edge_sources;
+    std::vector<int> edge_targets;
+    std::vector<int> edge_counts;
+    std::string rendered;
+};
+
+thread_local std::string api_error;
+thread_local std::ostringstream api_discard;
+thread_local int api_logging = 0;
+
+//every call that does work starts here. library callers get no LOG: lines unless they ask for them
+void api_enter() {
+    api_error.clear();
+    api_discard.str("");
+    log_out = api_logging ? &std::cerr : &api_discard;
+}
+
+const char* api_fail(const std::string &error) {
+    api_error = error;
+    return nullptr;
+}
+
+void flatten_graph(desktop_graph &g) {
+
+    //dropped nodes would leave holes in the arrays
+    for (const node &n : g.mt.nodes_container) {
+        if (n.deleted) { compact_graph(g.mt); break; }
+    }
+
+    for (int i = 0; i < g.mt.nodes_container.size(); i++) {
+        const node &n = g.mt.nodes_container[i];
+        g.seconds.push_back(n.average_time);
+        g.counts.push_back(n.event_count);
+        g.end_counts.push_back(n.end_count);
+        g.activities.push_back((unsigned char)n.event_type - 'A');
+        g.labels.push_back(node_label(g.mt, i));
+    }
+
+    export_view view;
+    collect_export(g.mt, view);
+    for (const std::pair<int, int> &edge : view.edges) {
+        const node &parent = g.mt.nodes_container[edge.first];
+        g.edge_sources.push_back(edge.first);
+        g.edge_targets.push_back(parent.next_nodes[edge.second]);
+        g.edge_counts.push_back(parent.next_nodes_counts[edge.second]);
+    }
+}
+
+extern "C" {
+
+int desktop_api_version(void) { return DESKTOP_API_VERSION; }
+
+const char* desktop_last_error(void) { return api_error.c_str(); }
+
+void desktop_set_logging(int enabled) { api_logging = enabled; }
+
+desktop_log* desktop_parse_log(const char *filename) {
+
+    api_enter();
+
+    try {
+        XMLDocument xes_doc;
+        XMLElement* root_log = open_xes(filename, xes_doc);
+        if (root_log == nullptr) { api_fail(std::string("can't read event log ") + filename); return nullptr; }
+
+        desktop_log *l = new desktop_log();
+        fill_event_log(root_log, l->data);
+        return l;
+    } catch (const std::exception &e) {
+        api_fail(e.what());
+        return nullptr;
+    }
+}
+
+void desktop_free_log(desktop_log *log) { delete log; }
+
+int desktop_log_traces(const desktop_log *log)     { return log->data.traces.size(); }
+int desktop_log_events(const desktop_log *log)     { return log->data.events; }
+int desktop_log_activities(const desktop_log *log) { return log->data.activity_names.size(); }
+
+const char* desktop_log_activity(const desktop_log *log, int activity) {
+    if (activity < 0 || activity >= log->data.activity_names.size()) { return api_fail("no activity " + std::to_string(activity)); }
+    return log->data.activity_names[activity].c_str();
+}
+
+int desktop_aggregate(desktop_log *log) {
+
+    api_enter();
+
+    if (!log->aggregated) {
+        try {
+            log->unique_traces = step_1_calc_unique_traces(log->data.traces);
+        } catch (const std::exception &e) {
+            api_fail(e.what());
+            return -1;
+        }
+        std::sort(log->unique_traces.begin(), log->unique_traces.end());
+        for (const unique_trace &ut : log->unique_traces) { log->variant_counts.push_back(ut.count); }
+        log->aggregated = 1;
+    }
+
+    return log->unique_traces.size();
+}
+
+const char* desktop_variant(const desktop_log *log, int variant) {
+    if (variant < 0 || variant >= log->unique_traces.size()) { return api_fail("no variant " + std::to_string(variant)); }
+    return log->unique_traces[variant].shorthand.c_str();
+}
+
+const int* desktop_variant_counts(const desktop_log *log) { return log->variant_counts.data(); }
+
+desktop_graph* desktop_build_graph(desktop_log *log, int consolidate) {
+
+    if (desktop_aggregate(log) == -1) { return nullptr; }
+    if (log->unique_traces.empty()) { api_fail("no traces in the log"); return nullptr; }
+
+    desktop_graph *g = nullptr;
+    try {
+        g = new desktop_graph();
+        merge_history history;
+        g->mt = step_2_build_graph(log->unique_traces, &history);
+        if (consolidate) { step_3_clean_graph(g->mt, &history); }
+        flatten_graph(*g);
+        api_discard.str("");
+        return g;
+    } catch (const std::exception &e) {
+        delete g;
+        api_fail(e.what());
+        return nullptr;
+    }
+}
+
+void desktop_free_graph(desktop_graph *graph) { delete graph; }
+
+int desktop_graph_nodes(const desktop_graph *graph)  { return graph->labels.size(); }
+int desktop_graph_edges(const desktop_graph *graph)  { return graph->edge_sources.size(); }
+int desktop_graph_starts(const desktop_graph *graph) { return graph->mt.base_nodes.size(); }
+
+const float* desktop_node_seconds(const desktop_graph *graph)  { return graph->seconds.data(); }
+const int* desktop_node_counts(const desktop_graph *graph)     { return graph->counts.data(); }
+const int* desktop_node_end_counts(const desktop_graph *graph) { return graph->end_counts.data(); }
+const int* desktop_node_activities(const desktop_graph *graph) { return graph->activities.data(); }
+const int* desktop_edge_sources(const desktop_graph *graph)    { return graph->edge_sources.data(); }
+const int* desktop_edge_targets(const desktop_graph *graph)    { return graph->edge_targets.data(); }
+const int* desktop_edge_counts(const desktop_graph *graph)     { return graph->edge_counts.data(); }
+const int* desktop_start_nodes(const desktop_graph *graph)     { return graph->mt.base_nodes.data(); }
+
+const char* desktop_node_label(const desktop_graph *graph, int node) {
+    if (node < 0 || node >= graph->labels.size()) { return api_fail("no node " + std::to_string(node)); }
+    return graph->labels[node].c_str();
+}
+
+const char* desktop_render(desktop_graph *graph, const char *format) {
+
+    api_enter();
+
+    std::string kind = format;
+    std::string other;
+    graph->rendered.clear();
+
+    if      (kind == "connections") { render_export(graph->mt, graph->rendered, other); }
+    else if (kind == "timestamps")  { render_export(graph->mt, other, graph->rendered); }
+    else if (kind == "json")        { graph->rendered = render_json(graph->mt); }
+    else if (kind == "dot")         { graph->rendered = render_dot(graph->mt); }
+    else if (kind == "svg")         { graph->rendered = render_svg(graph->mt, 1); }
+    else { return api_fail("unknown format " + kind); }
+
+    return graph->rendered.c_str();
+}
 
-    export_data(mt, 9999);
-    
 }
-      
+
+#else
+
 //done
 int main(int argc, char* argv[]) {
 
-    std::string event_log_filename = "Exempel/DomesticDeclarations.xes_";
+    run_options opts;
+
+    for (int i = 1; i < argc; i++) {
+
+        std::string arg = argv[i];
+
+        if        (arg == "--load-snapshot" && i + 1 < argc) {
+            opts.snapshot_in = argv[++i];
+        } else if (arg == "--save-snapshot" && i + 1 < argc) {
+            opts.snapshot_out = argv[++i];
+        } else if (arg == "--follow") {
+            opts.follow = 1;
+        } else if (arg == "--follow-once") {
+            opts.follow = 1;
+            opts.follow_once = 1;
+        } else if (arg == "--follow-state" && i + 1 < argc) {
+            opts.follow_state = argv[++i];
+        } else if (arg == "--interval" && i + 1 < argc) {
+            opts.follow_interval = std::atof(argv[++i]);
+        } else if (arg == "--window" && i + 1 < argc) {
+            opts.window_days = std::atof(argv[++i]);
+        } else if (arg == "--check-window") {
+            opts.check_window = 1;
+        } else if (arg == "--partition" && i + 1 < argc) {
+            opts.partition = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = std::atoi(argv[++i]);
+        } else if (arg == "--consolidate") {
+            opts.consolidate = 1;
+        } else if (arg == "--conformance") {
+            opts.conformance = 1;
+        } else if (arg == "--score-bench") {
+            opts.score_bench = 1;
+        } else if (arg == "--case-index") {
+            opts.case_index = 1;
+        } else if ((arg == "--query-case" || arg == "--query-node") && i + 2 < argc) {
+            opts.query = arg.substr(8);
+            opts.query_args.assign(argv + i + 1, argv + i + 3);
+            i += 2;
+        } else if (arg == "--dot") {
+            opts.dot = 1;
+        } else if (arg == "--json") {
+            opts.json = 1;
+        } else if (arg == "--svg") {
+            opts.svg = 1;
+        } else if (arg == "--baseline") {
+            opts.baseline = 1;
+        } else if (arg == "--batch" && i + 1 < argc) {
+            opts.batch_dir = argv[++i];
+        } else if (arg == "--batch-out" && i + 1 < argc) {
+            opts.batch_out = argv[++i];
+        } else if (arg == "--cache" && i + 1 < argc) {
+            opts.cache_dir = argv[++i];
+        } else if (arg == "--watch") {
+            opts.watch = 1;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            opts.serve = argv[++i];
+        } else if (arg == "--request" && i + 2 < argc) {
+            opts.client = "request";
+            opts.client_args.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (arg == "--load-test" && i + 2 < argc) {
+            opts.client = "load-test";
+            opts.client_args.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            opts.metrics = argv[++i];
+        } else if (arg == "--bench" && i + 1 < argc) {
+            opts.bench_dirs.push_back(argv[++i]);
+        } else if (arg == "--golden" && i + 1 < argc) {
+            opts.golden_dir = argv[++i];
+        } else if (arg == "--bench-save" && i + 1 < argc) {
+            opts.bench_save = argv[++i];
+        } else if (arg == "--bench-compare" && i + 1 < argc) {
+            opts.bench_compare = argv[++i];
+        } else if (arg == "--bench-nodes" && i + 1 < argc) {
+            opts.bench_nodes = std::atoi(argv[++i]);
+        } else if (arg == "--export-steps") {
+            opts.export_steps = 1;
+        } else if (arg == "--journal" && i + 1 < argc) {
+            opts.journal_out = argv[++i];
+        } else if (arg == "--journal-step" && i + 2 < argc) {
+            opts.journal_in = argv[++i];
+            opts.journal_step = argv[++i];
+        } else if (arg == "--query-edge" && i + 3 < argc) {
+            opts.query = "edge";
+            opts.query_args.assign(argv + i + 1, argv + i + 4);
+            i += 3;
+        } else {
+            opts.event_log_filename = arg;
+        }
+    }
+
+    std::string event_log_filename = opts.event_log_filename;
+
+    if (!opts.metrics.empty()) {
+        metrics_prefix = opts.metrics;
+        metrics_on = 1;
+        std::atexit(write_metrics);
+#ifndef _WIN32
+        //no SA_RESTART, so a watch waiting on inotify wakes up to write them
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_metrics;
+        sigaction(SIGUSR1, &action, nullptr);
+#endif
+    }
+
+    if (!opts.query.empty()) { return run_case_query(opts.query, opts.query_args); }
+
+    if (!opts.journal_in.empty()) { return export_journal_step(opts.journal_in, opts.journal_step); }
+
+    if (!opts.batch_dir.empty()) { return run_batch(opts); }
+
+    if (!opts.bench_dirs.empty() || opts.bench_nodes > 0) { return run_benchmarks(opts); }
+
+    if (!opts.serve.empty()) { return run_service(opts); }
 
-    if (argc >= 2) { event_log_filename = argv[1]; }
+    if (opts.client == "request") {
+        std::string request;
+        for (int i = 1; i < opts.client_args.size(); i++) { request += (i > 1 ? " " : "") + opts.client_args[i]; }
+        return run_client_request(opts.client_args[0], request);
+    }
+
+    if (opts.client == "load-test") {
+        std::vector<std::string> &args = opts.client_args;
+        return run_load_test(args[0], args[1], args.size() > 2 ? std::atoi(args[2].c_str()) : 4,
+                             args.size() > 3 ? std::atoi(args[3].c_str()) : 1000);
+    }
+
+    if (opts.check_window) { return check_window(opts); }
+
+    if (opts.follow) {
+        log("Following: " + event_log_filename);
+        return follow_event_log(opts);
+    }
 
     log("Running algorithm on: " + event_log_filename);
 
+    event_log log_data;
+    graph_snapshot snapshot;
+
+    //activity names come from the snapshot first so the shorthand letters match the stored graph
+    if (!opts.snapshot_in.empty()) {
+        if (!load_snapshot(opts.snapshot_in, snapshot.mt, log_data.activity_names, snapshot.variants)) { exit(1); }
+        snapshot.loaded = 1;
+    }
+
     XMLDocument xes_doc;
     XMLElement* root_log = open_xes(event_log_filename, xes_doc);
-    event_log log_data;
+    if (root_log == nullptr) { exit(1); }
     fill_event_log(root_log, log_data);
-    main_algorithm(log_data, event_log_filename);
-    
+
+    if (!opts.partition.empty()) {
+        if (opts.window_days > 0) { apply_window(log_data, opts.window_days); }
+        return partitioned_algorithm(log_data, opts);
+    }
+
+    return main_algorithm(log_data, event_log_filename, opts, snapshot);
 }
+
+#endif
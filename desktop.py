@@ -0,0 +1,160 @@
+import ctypes
+import os
+import sys
+from pathlib import Path
+
+# Python side of desktop_api.h. Build the library first: make library
+#
+#   log = desktop.Log("Exempel/log.xes")
+#   graph = log.build()
+#   graph.edge_counts, graph.node_seconds   # memoryviews straight over the library's arrays
+#   graph.render("connections")
+#
+# The arrays are not copied, each one keeps the library's graph alive for as long as it is around.
+# numpy.frombuffer(graph.edge_counts, dtype=numpy.int32) wraps one without a copy as well.
+
+API_VERSION = 1
+
+def _load():
+
+    here = Path(__file__).resolve().parent
+    names = ["desktop.dll"] if sys.platform == "win32" else ["libdesktop.so", "libdesktop.dylib"]
+
+    for name in names:
+        path = here / name
+        if path.exists():
+            return ctypes.CDLL(str(path))
+
+    raise OSError("desktop library not found next to desktop.py, run: make library")
+
+_lib = _load()
+
+_int_p   = ctypes.POINTER(ctypes.c_int)
+_float_p = ctypes.POINTER(ctypes.c_float)
+
+def _declare(name, restype, *argtypes):
+    f = getattr(_lib, name)
+    f.restype = restype
+    f.argtypes = list(argtypes)
+
+_declare("desktop_api_version", ctypes.c_int)
+_declare("desktop_last_error", ctypes.c_char_p)
+_declare("desktop_set_logging", None, ctypes.c_int)
+
+_declare("desktop_parse_log", ctypes.c_void_p, ctypes.c_char_p)
+_declare("desktop_free_log", None, ctypes.c_void_p)
+_declare("desktop_log_traces", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_log_events", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_log_activities", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_log_activity", ctypes.c_char_p, ctypes.c_void_p, ctypes.c_int)
+
+_declare("desktop_aggregate", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_variant", ctypes.c_char_p, ctypes.c_void_p, ctypes.c_int)
+_declare("desktop_variant_counts", _int_p, ctypes.c_void_p)
+
+_declare("desktop_build_graph", ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int)
+_declare("desktop_free_graph", None, ctypes.c_void_p)
+_declare("desktop_graph_nodes", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_graph_edges", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_graph_starts", ctypes.c_int, ctypes.c_void_p)
+_declare("desktop_node_seconds", _float_p, ctypes.c_void_p)
+_declare("desktop_node_label", ctypes.c_char_p, ctypes.c_void_p, ctypes.c_int)
+for _name in ["desktop_node_counts", "desktop_node_end_counts", "desktop_node_activities",
+              "desktop_edge_sources", "desktop_edge_targets", "desktop_edge_counts", "desktop_start_nodes"]:
+    _declare(_name, _int_p, ctypes.c_void_p)
+
+_declare("desktop_render", ctypes.c_char_p, ctypes.c_void_p, ctypes.c_char_p)
+
+if _lib.desktop_api_version() != API_VERSION:
+    raise OSError("desktop library is version %d, desktop.py expects %d" % (_lib.desktop_api_version(), API_VERSION))
+
+def set_logging(enabled):
+    _lib.desktop_set_logging(1 if enabled else 0)
+
+def _error():
+    return _lib.desktop_last_error().decode()
+
+def _view(owner, pointer, ctype, size):
+    # a memoryview over size values at pointer, no copy. it keeps owner (and so the memory) alive
+    array = (ctype * size).from_address(ctypes.addressof(pointer.contents)) if size else (ctype * 0)()
+    array.owner = owner
+    return memoryview(array).cast("B").cast("f" if ctype is ctypes.c_float else "i")
+
+class Log:
+
+    def __init__(self, filename):
+        self._handle = _lib.desktop_parse_log(os.fsencode(filename))
+        if not self._handle:
+            raise IOError(_error())
+        self.traces = _lib.desktop_log_traces(self._handle)
+        self.events = _lib.desktop_log_events(self._handle)
+        self.activities = [_lib.desktop_log_activity(self._handle, i).decode()
+                           for i in range(_lib.desktop_log_activities(self._handle))]
+        self._variants = None
+
+    def variants(self):
+        # [(shorthand, count)], most frequent first
+        if self._variants is None:
+            count = _lib.desktop_aggregate(self._handle)
+            if count == -1:
+                raise RuntimeError(_error())
+            counts = _lib.desktop_variant_counts(self._handle)
+            self._variants = [(_lib.desktop_variant(self._handle, i).decode(), counts[i]) for i in range(count)]
+        return self._variants
+
+    def build(self, consolidate=False):
+        return Graph(self, _lib.desktop_build_graph(self._handle, 1 if consolidate else 0))
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.desktop_free_log(self._handle)
+            self._handle = None
+
+class Graph:
+
+    def __init__(self, log, handle):
+        if not handle:
+            raise RuntimeError(_error())
+        self._handle = handle
+        self.activities = log.activities
+
+        nodes = _lib.desktop_graph_nodes(handle)
+        edges = _lib.desktop_graph_edges(handle)
+
+        # the views hold on to a _GraphHandle, the graph is freed once neither this object nor a view is left
+        owner = _GraphHandle(handle)
+        self._owner = owner
+
+        self.node_seconds    = _view(owner, _lib.desktop_node_seconds(handle), ctypes.c_float, nodes)
+        self.node_counts     = _view(owner, _lib.desktop_node_counts(handle), ctypes.c_int, nodes)
+        self.node_end_counts = _view(owner, _lib.desktop_node_end_counts(handle), ctypes.c_int, nodes)
+        self.node_activities = _view(owner, _lib.desktop_node_activities(handle), ctypes.c_int, nodes)
+        self.edge_sources    = _view(owner, _lib.desktop_edge_sources(handle), ctypes.c_int, edges)
+        self.edge_targets    = _view(owner, _lib.desktop_edge_targets(handle), ctypes.c_int, edges)
+        self.edge_counts     = _view(owner, _lib.desktop_edge_counts(handle), ctypes.c_int, edges)
+        self.start_nodes     = _view(owner, _lib.desktop_start_nodes(handle), ctypes.c_int, _lib.desktop_graph_starts(handle))
+        self.labels = [_lib.desktop_node_label(handle, i).decode() for i in range(nodes)]
+
+    def render(self, format="connections"):
+        # connections, timestamps, json, dot or svg, the same text the desktop program writes
+        text = _lib.desktop_render(self._handle, format.encode())
+        if text is None:
+            raise ValueError(_error())
+        return text.decode()
+
+    def dfg(self):
+        # the graph the way generate_graph.py reads it from connections.txt: dfg, start and end activities
+        dfg = {}
+        for s, t, c in zip(self.edge_sources, self.edge_targets, self.edge_counts):
+            dfg[(self.labels[s], self.labels[t])] = c
+        start = {self.labels[n]: self.node_counts[n] for n in self.start_nodes}
+        end = {self.labels[n]: self.node_end_counts[n] for n in range(len(self.labels)) if self.node_end_counts[n] != 0}
+        return dfg, start, end
+
+class _GraphHandle:
+
+    def __init__(self, handle):
+        self.handle = handle
+
+    def __del__(self):
+        _lib.desktop_free_graph(self.handle)
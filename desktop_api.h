@@ -0,0 +1,64 @@
+/*
+    C interface to the algorithm, built by `make library` into desktop.dll / libdesktop.so.
+
+    A log is parsed once into a desktop_log, aggregated into variants and built into a desktop_graph.
+    The graph's data is handed out as flat arrays owned by the graph, valid until desktop_free_graph:
+    nodes are numbered 0..nodes-1 (the number in a node's label), edges are listed in export order as
+    three parallel arrays of source node, target node and count. Strings returned are owned by the
+    handle they came from. Functions returning a handle return NULL on failure, see desktop_last_error.
+    Every handle is used by one thread at a time, different handles can be used from different threads.
+*/
+#ifndef DESKTOP_API_H
+#define DESKTOP_API_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DESKTOP_API_VERSION 1
+
+typedef struct desktop_log desktop_log;
+typedef struct desktop_graph desktop_graph;
+
+int desktop_api_version(void);
+const char* desktop_last_error(void);        /* the calling thread's last error, "" if none */
+void desktop_set_logging(int enabled);       /* LOG: lines on stderr for the calling thread, off by default */
+
+/* parse */
+desktop_log* desktop_parse_log(const char *filename);
+void desktop_free_log(desktop_log *log);
+int desktop_log_traces(const desktop_log *log);
+int desktop_log_events(const desktop_log *log);
+int desktop_log_activities(const desktop_log *log);
+const char* desktop_log_activity(const desktop_log *log, int activity);
+
+/* aggregate, returns the number of variants. done by desktop_build_graph if not called first */
+int desktop_aggregate(desktop_log *log);
+const char* desktop_variant(const desktop_log *log, int variant);    /* shorthand, most frequent first */
+const int* desktop_variant_counts(const desktop_log *log);
+
+/* build, consolidate runs step 3 as --consolidate does */
+desktop_graph* desktop_build_graph(desktop_log *log, int consolidate);
+void desktop_free_graph(desktop_graph *graph);
+int desktop_graph_nodes(const desktop_graph *graph);
+int desktop_graph_edges(const desktop_graph *graph);
+int desktop_graph_starts(const desktop_graph *graph);
+
+const float* desktop_node_seconds(const desktop_graph *graph);      /* average time since case start */
+const int* desktop_node_counts(const desktop_graph *graph);
+const int* desktop_node_end_counts(const desktop_graph *graph);
+const int* desktop_node_activities(const desktop_graph *graph);     /* index into the log's activities */
+const char* desktop_node_label(const desktop_graph *graph, int node);
+const int* desktop_edge_sources(const desktop_graph *graph);
+const int* desktop_edge_targets(const desktop_graph *graph);
+const int* desktop_edge_counts(const desktop_graph *graph);
+const int* desktop_start_nodes(const desktop_graph *graph);
+
+/* export, format is connections, timestamps, json, dot or svg. valid until the next render or free */
+const char* desktop_render(desktop_graph *graph, const char *format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,15 +13,14 @@ from pm4py.visualization.dfg.variants import timeline as timeline_gviz_generator
 
 import pandas as pd
 
-if (len(sys.argv) != 5):
-    print("Usage: OutputName connections timestamps olddata")
+if (len(sys.argv) != 3 and len(sys.argv) != 5 and len(sys.argv) != 6):
+    print("Usage: OutputName eventlog  (builds the graph through the desktop library, see desktop.py)")
+    print("       OutputName connections timestamps olddata")
+    print("       OutputName connections timestamps old_connections old_timestamps  (from desktop --baseline)")
     exit(0)
 
 out_file_new  = sys.argv[1] + "_new.png"
 out_file_old  = sys.argv[1] + "_old.png"
-conn_file     = sys.argv[2]
-time_file     = sys.argv[3]
-old_data_file = sys.argv[4]
 
 
 #log = pm4py.read_xes(old_data_file)
@@ -39,48 +38,67 @@ old_data_file = sys.argv[4]
 #average_offset = absolute_offset_seconds.mean()
 #print(f"Average offset: {average_offset:.2f} seconds")
 
-activity_durations = {}
-
-with open(time_file, "r") as file:
-    for line in file:
-        if '|' in line:
-            activity, duration = line.strip().split("|")
-            activity = activity.strip()
-            duration = duration.strip()
-            activity_durations[activity] = pd.to_timedelta(duration)
-
-print(activity_durations)
-
-# Read the DFG data from a text file
-dfg = {}
-start_activities = {}
-end_activities = {}
-
-with open(conn_file, "r") as file:
-    for line in file:
-        line = line.strip()
-        if line.startswith("Start:"):
-            activity = line.split(":")[1]
-            target, freq = activity.split(",")
-            print(target)
-            print(freq)
-            start_activities[target] = int(freq)
-        elif line.startswith("End:"):
-            activity = line.split(":")[1]
-            target, freq = activity.split(",")
-            end_activities[target] = int(freq)
-        else:
-            source, target, freq = line.split(",")
-            dfg[(source, target)] = int(freq)
-
-
-#print(dfg)
-print(start_activities)
-print(end_activities)
-
-
-gviz = timeline_gviz_generator.apply(dfg, activity_durations, parameters={"format": "png", "start_activities": start_activities,
-                                                                    "end_activities": end_activities})
-print(gviz)
-
-dfg_visualizer.save(gviz, out_file_new)
+def read_timestamps(time_file):
+
+    activity_durations = {}
+
+    with open(time_file, "r") as file:
+        for line in file:
+            if '|' in line:
+                activity, duration = line.strip().split("|")
+                activity = activity.strip()
+                duration = duration.strip()
+                activity_durations[activity] = pd.to_timedelta(duration)
+
+    return activity_durations
+
+def read_connections(conn_file):
+
+    # Read the DFG data from a text file
+    dfg = {}
+    start_activities = {}
+    end_activities = {}
+
+    with open(conn_file, "r") as file:
+        for line in file:
+            line = line.strip()
+            if line.startswith("Start:"):
+                activity = line.split(":")[1]
+                target, freq = activity.split(",")
+                start_activities[target] = int(freq)
+            elif line.startswith("End:"):
+                activity = line.split(":")[1]
+                target, freq = activity.split(",")
+                end_activities[target] = int(freq)
+            else:
+                source, target, freq = line.split(",")
+                dfg[(source, target)] = int(freq)
+
+    return dfg, start_activities, end_activities
+
+def draw(dfg, start_activities, end_activities, activity_durations, out_file):
+
+    gviz = timeline_gviz_generator.apply(dfg, activity_durations, parameters={"format": "png", "start_activities": start_activities,
+                                                                        "end_activities": end_activities})
+    dfg_visualizer.save(gviz, out_file)
+
+
+def draw_files(conn_file, time_file, out_file):
+
+    dfg, start_activities, end_activities = read_connections(conn_file)
+    draw(dfg, start_activities, end_activities, read_timestamps(time_file), out_file)
+
+
+if (len(sys.argv) == 3):
+    # no desktop run and no text files in between, the graph comes straight from the library's arrays
+    import desktop
+    graph = desktop.Log(sys.argv[2]).build()
+    dfg, start_activities, end_activities = graph.dfg()
+    activity_durations = {label: pd.to_timedelta(float(seconds), unit="s") for label, seconds in zip(graph.labels, graph.node_seconds)}
+    draw(dfg, start_activities, end_activities, activity_durations, out_file_new)
+else:
+    draw_files(sys.argv[2], sys.argv[3], out_file_new)
+
+# the baseline graph (connections9999_old.txt / timestamps9999_old.txt) written by desktop --baseline
+if (len(sys.argv) == 6):
+    draw_files(sys.argv[4], sys.argv[5], out_file_old)
@@ -0,0 +1,419 @@
+/*
+    Generates synthetic event logs (XES, or CSV) for benchmarks and regression runs of desktop.
+
+    A log is built from a set of variant templates, each a sequence of activities. Fresh templates are
+    random walks over a random successor graph between the activities, so variants share prefixes the
+    way real processes do. A share of the templates is derived from an earlier one instead: a loop
+    repeats a stretch of it, concurrency reorders a block of it (the same activities seen in another
+    order). Every case picks a template with Zipf-skewed frequencies (rank r has weight 1 / r^zipf) and
+    gets timestamps from the chosen gap distribution, each activity with its own mean gap.
+
+    Every case draws from its own random stream, seeded by the seed and the case number, and only
+    mt19937_64 is used with our own transforms, so the same arguments give the same log on any thread
+    count and any compiler. Cases are rendered in chunks on worker threads and written in order.
+*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <set>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+
+#define CHUNK_CASES 2048
+#define MAX_ACTIVITIES 190 //desktop names activities 'A' + index in a char
+#define RESOURCES 20
+
+void log(std::string s)          { std::cerr << "LOG: " << s << std::endl; }
+void log(std::string s, int i)   { s += std::to_string(i); log(s); }
+void log(std::string s, float i) { s += std::to_string(i); log(s); }
+
+struct generator_options {
+
+    std::string out_file;
+    std::string format = "xes";
+    long long cases = 1000;
+    int activities = 10;
+    int variants = 50;
+    float zipf = 1.0f;
+    float loops = 0.1f;         //share of the templates with a loop
+    float concurrency = 0.1f;   //share of the templates with a reordered block
+    int min_length = 3;
+    int max_length = 12;
+    std::string gaps = "exp";   //exp, uniform, normal or lognormal
+    float mean_gap = 3600;      //seconds between the events of a case
+    float arrival = 600;        //seconds between case starts
+    long long start = 1704067200; //2024-01-01T00:00:00Z
+    unsigned long long seed = 1;
+    int threads = 0;
+};
+
+struct process_model {
+
+    std::vector<std::string> activity_names;
+    std::vector<float> activity_gaps;                //mean gap before each activity
+    std::vector<std::vector<int> > templates;
+    std::vector<double> cumulative;                  //zipf weights, summed and normalized
+};
+
+//splitmix64, spreads the seed and the case number over the generator's state
+unsigned long long mix(unsigned long long x) {
+
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+//[0, 1)
+double uniform(std::mt19937_64 &rng) { return (rng() >> 11) * (1.0 / 9007199254740992.0); }
+
+int pick(std::mt19937_64 &rng, int n) { return (int)(uniform(rng) * n); }
+
+double gap_seconds(std::mt19937_64 &rng, const std::string &kind, double mean) {
+
+    if (kind == "uniform") { return uniform(rng) * 2 * mean; }
+
+    if (kind == "normal" || kind == "lognormal") {
+        //box-muller
+        double z = std::sqrt(-2 * std::log(1 - uniform(rng))) * std::cos(6.283185307179586 * uniform(rng));
+        if (kind == "normal") { return std::max(0.0, mean + z * mean / 4); }
+        return std::exp(std::log(mean) - 0.5 + z); //sigma 1, so the mean stays mean
+    }
+
+    return -std::log(1 - uniform(rng)) * mean;
+}
+
+//a random walk over the successor graph, from one of the first few activities
+std::vector<int> fresh_template(std::mt19937_64 &rng, const generator_options &opts, const std::vector<std::vector<int> > &successors) {
+
+    int length = opts.min_length + pick(rng, opts.max_length - opts.min_length + 1);
+    std::vector<int> t(1, pick(rng, std::min(3, opts.activities)));
+
+    while (t.size() < length) {
+        const std::vector<int> &next = successors[t.back()];
+        t.push_back(next[pick(rng, next.size())]);
+    }
+
+    return t;
+}
+
+//repeats a stretch of up to 3 activities once or twice
+std::vector<int> loop_template(std::mt19937_64 &rng, std::vector<int> t) {
+
+    int from = pick(rng, t.size());
+    int length = 1 + pick(rng, std::min(3, (int)t.size() - from));
+    std::vector<int> stretch(t.begin() + from, t.begin() + from + length);
+
+    for (int r = 1 + pick(rng, 2); r > 0; r--) {
+        t.insert(t.begin() + from + length, stretch.begin(), stretch.end());
+    }
+
+    return t;
+}
+
+//shuffles a block of 2 to 4 activities
+std::vector<int> concurrent_template(std::mt19937_64 &rng, std::vector<int> t) {
+
+    if (t.size() < 2) { return t; }
+
+    int length = 2 + pick(rng, std::min(3, (int)t.size() - 1));
+    int from = pick(rng, t.size() - length + 1);
+
+    for (int i = length - 1; i > 0; i--) {
+        std::swap(t[from + i], t[from + pick(rng, i + 1)]);
+    }
+
+    return t;
+}
+
+int build_model(const generator_options &opts, process_model &model) {
+
+    std::mt19937_64 rng(mix(opts.seed));
+
+    for (int a = 0; a < opts.activities; a++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Activity_%02d", a + 1);
+        model.activity_names.push_back(name);
+        model.activity_gaps.push_back(opts.mean_gap * (0.5 + uniform(rng)));
+    }
+
+    //every activity is followed by one to three others
+    std::vector<std::vector<int> > successors(opts.activities);
+    for (int a = 0; a < opts.activities; a++) {
+        for (int s = 1 + pick(rng, 3); s > 0; s--) { successors[a].push_back(pick(rng, opts.activities)); }
+    }
+
+    std::set<std::vector<int> > seen;
+    long long attempts = 0;
+
+    while (model.templates.size() < opts.variants && attempts++ < (long long)opts.variants * 100) {
+
+        double roll = uniform(rng);
+        std::vector<int> t;
+
+        if (!model.templates.empty() && roll < opts.loops) {
+            t = loop_template(rng, model.templates[pick(rng, model.templates.size())]);
+        } else if (!model.templates.empty() && roll < opts.loops + opts.concurrency) {
+            t = concurrent_template(rng, model.templates[pick(rng, model.templates.size())]);
+        } else {
+            t = fresh_template(rng, opts, successors);
+        }
+
+        if (seen.insert(t).second) { model.templates.push_back(t); }
+    }
+
+    if (model.templates.size() < opts.variants) {
+        log("Only this many distinct variants could be made, allow more activities or longer traces: ", (int)model.templates.size());
+    }
+
+    double total = 0;
+    for (int r = 0; r < model.templates.size(); r++) {
+        total += 1.0 / std::pow(r + 1, (double)opts.zipf);
+        model.cumulative.push_back(total);
+    }
+    for (double &c : model.cumulative) { c /= total; }
+
+    return !model.templates.empty();
+}
+
+void append_digits(std::string &out, long long value, int width) {
+
+    char buffer[24];
+    int n = 0;
+    do { buffer[n++] = '0' + value % 10; value /= 10; } while (value > 0 || n < width);
+    while (n > 0) { out += buffer[--n]; }
+}
+
+//"2024-01-01T10:00:00.000+00:00", without going through gmtime for every event
+void append_timestamp(std::string &out, long long t) {
+
+    long long days = t / 86400;
+    long long secs = t % 86400;
+
+    //days since 1970-01-01 to a civil date
+    days += 719468;
+    long long era = days / 146097;
+    long long doe = days - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    long long day = doy - (153 * mp + 2) / 5 + 1;
+    long long month = mp < 10 ? mp + 3 : mp - 9;
+    long long year = yoe + era * 400 + (month <= 2);
+
+    append_digits(out, year, 4);   out += '-';
+    append_digits(out, month, 2);  out += '-';
+    append_digits(out, day, 2);    out += 'T';
+    append_digits(out, secs / 3600, 2);       out += ':';
+    append_digits(out, secs / 60 % 60, 2);    out += ':';
+    append_digits(out, secs % 60, 2);         out += ".000+00:00";
+}
+
+void render_case(const generator_options &opts, const process_model &model, long long c, std::string &out) {
+
+    std::mt19937_64 rng(mix(opts.seed ^ mix(c + 1)));
+
+    double u = uniform(rng);
+    int variant = std::lower_bound(model.cumulative.begin(), model.cumulative.end(), u) - model.cumulative.begin();
+    variant = std::min(variant, (int)model.templates.size() - 1);
+
+    //cases arrive one per arrival period, anywhere in it
+    double time = opts.start + (c + uniform(rng)) * opts.arrival;
+
+    std::string case_id = "Case_";
+    append_digits(case_id, c + 1, 6);
+
+    if (opts.format == "xes") {
+        out += "\t<trace>\n\t\t<string key=\"concept:name\" value=\"" + case_id + "\"/>\n";
+    }
+
+    const std::vector<int> &t = model.templates[variant];
+    for (int i = 0; i < t.size(); i++) {
+
+        if (i > 0) { time += gap_seconds(rng, opts.gaps, model.activity_gaps[t[i]]); }
+        int resource = pick(rng, RESOURCES) + 1;
+
+        if (opts.format == "xes") {
+            out += "\t\t<event>\n\t\t\t<string key=\"concept:name\" value=\"" + model.activity_names[t[i]] + "\"/>\n";
+            out += "\t\t\t<date key=\"time:timestamp\" value=\"";
+            append_timestamp(out, (long long)time);
+            out += "\"/>\n\t\t\t<string key=\"org:resource\" value=\"User";
+            append_digits(out, resource, 2);
+            out += "\"/>\n\t\t</event>\n";
+        } else {
+            out += case_id + "," + model.activity_names[t[i]] + ",";
+            append_timestamp(out, (long long)time);
+            out += ",User";
+            append_digits(out, resource, 2);
+            out += "\n";
+        }
+    }
+
+    if (opts.format == "xes") { out += "\t</trace>\n"; }
+}
+
+/*
+    Workers take chunks in order and render them, the calling thread writes each chunk as soon as it and
+    every chunk before it are done. At most 2 chunks per worker are held, so memory stays flat however
+    large the log is.
+*/
+struct chunk_queue {
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::map<long long, std::string> done;
+    long long next = 0;     //next chunk to hand out
+    long long written = 0;  //next chunk to write
+};
+
+int write_log(const generator_options &opts, const process_model &model) {
+
+    FILE *out = fopen(opts.out_file.c_str(), "wb");
+    if (out == nullptr) {
+        log("Error opening log for writing: " + opts.out_file);
+        return 0;
+    }
+
+    std::string head;
+    if (opts.format == "xes") {
+        head = "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+               "<log xes.version=\"1.0\" xes.features=\"nested-attributes\" openxes.version=\"1.0RC7\">\n"
+               "\t<extension name=\"Organizational\" prefix=\"org\" uri=\"http://www.xes-standard.org/org.xesext\"/>\n"
+               "\t<extension name=\"Time\" prefix=\"time\" uri=\"http://www.xes-standard.org/time.xesext\"/>\n"
+               "\t<extension name=\"Concept\" prefix=\"concept\" uri=\"http://www.xes-standard.org/concept.xesext\"/>\n"
+               "\t<string key=\"concept:name\" value=\"synthetic\"/>\n";
+    } else {
+        head = "case:concept:name,concept:name,time:timestamp,org:resource\n";
+    }
+    int ok = fwrite(head.data(), 1, head.size(), out) == head.size();
+
+    int threads = opts.threads > 0 ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+    long long chunks = (opts.cases + CHUNK_CASES - 1) / CHUNK_CASES;
+    chunk_queue queue;
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; w++) {
+        workers.push_back(std::thread([&]() {
+            while (true) {
+
+                long long k;
+                {
+                    std::unique_lock<std::mutex> guard(queue.lock);
+                    queue.changed.wait(guard, [&]() { return queue.next - queue.written < 2 * threads; });
+                    k = queue.next++;
+                }
+                if (k >= chunks) { return; }
+
+                std::string text;
+                for (long long c = k * CHUNK_CASES; c < std::min(opts.cases, (k + 1) * CHUNK_CASES); c++) {
+                    render_case(opts, model, c, text);
+                }
+
+                std::lock_guard<std::mutex> guard(queue.lock);
+                queue.done[k].swap(text);
+                queue.changed.notify_all();
+            }
+        }));
+    }
+
+    for (long long k = 0; k < chunks; k++) {
+
+        std::string text;
+        {
+            std::unique_lock<std::mutex> guard(queue.lock);
+            queue.changed.wait(guard, [&]() { return queue.done.count(k) != 0; });
+            text.swap(queue.done[k]);
+            queue.done.erase(k);
+            queue.written++;
+            queue.changed.notify_all();
+        }
+
+        ok = ok && fwrite(text.data(), 1, text.size(), out) == text.size();
+    }
+
+    for (std::thread &w : workers) { w.join(); }
+
+    if (opts.format == "xes") { ok = ok && fputs("</log>\n", out) >= 0; }
+    ok = fclose(out) == 0 && ok;
+
+    if (!ok) { log("Error writing log: " + opts.out_file); }
+    return ok;
+}
+
+void usage() {
+
+    std::cerr <<
+        "Usage: generate_log -o FILE [options]\n"
+        "  --format xes|csv       (xes)\n"
+        "  --cases N              (1000)\n"
+        "  --activities N         (10, at most 190)\n"
+        "  --variants N           distinct variants (50)\n"
+        "  --zipf S               variant frequency skew, 0 is uniform (1)\n"
+        "  --loops P              share of variants with a repeated stretch (0.1)\n"
+        "  --concurrency P        share of variants with a reordered block (0.1)\n"
+        "  --min-length N         (3)\n"
+        "  --max-length N         (12)\n"
+        "  --gaps exp|uniform|normal|lognormal   time between events (exp)\n"
+        "  --mean-gap SECONDS     (3600)\n"
+        "  --arrival SECONDS      time between case starts (600)\n"
+        "  --seed N               (1)\n"
+        "  --threads N            (all cores)\n";
+}
+
+int main(int argc, char* argv[]) {
+
+    generator_options opts;
+
+    for (int i = 1; i < argc; i++) {
+
+        std::string arg = argv[i];
+        int has_value = i + 1 < argc;
+
+        if      (arg == "-o" && has_value)             { opts.out_file = argv[++i]; }
+        else if (arg == "--format" && has_value)       { opts.format = argv[++i]; }
+        else if (arg == "--cases" && has_value)        { opts.cases = std::atoll(argv[++i]); }
+        else if (arg == "--activities" && has_value)   { opts.activities = std::atoi(argv[++i]); }
+        else if (arg == "--variants" && has_value)     { opts.variants = std::atoi(argv[++i]); }
+        else if (arg == "--zipf" && has_value)         { opts.zipf = std::atof(argv[++i]); }
+        else if (arg == "--loops" && has_value)        { opts.loops = std::atof(argv[++i]); }
+        else if (arg == "--concurrency" && has_value)  { opts.concurrency = std::atof(argv[++i]); }
+        else if (arg == "--min-length" && has_value)   { opts.min_length = std::atoi(argv[++i]); }
+        else if (arg == "--max-length" && has_value)   { opts.max_length = std::atoi(argv[++i]); }
+        else if (arg == "--gaps" && has_value)         { opts.gaps = argv[++i]; }
+        else if (arg == "--mean-gap" && has_value)     { opts.mean_gap = std::atof(argv[++i]); }
+        else if (arg == "--arrival" && has_value)      { opts.arrival = std::atof(argv[++i]); }
+        else if (arg == "--seed" && has_value)         { opts.seed = std::strtoull(argv[++i], nullptr, 10); }
+        else if (arg == "--threads" && has_value)      { opts.threads = std::atoi(argv[++i]); }
+        else { usage(); return 1; }
+    }
+
+    if (opts.out_file.empty() || opts.cases < 1 || opts.variants < 1 || opts.activities < 1 ||
+        opts.activities > MAX_ACTIVITIES || opts.min_length < 1 || opts.max_length < opts.min_length ||
+        opts.mean_gap <= 0 || opts.arrival < 0 || (opts.format != "xes" && opts.format != "csv") ||
+        (opts.gaps != "exp" && opts.gaps != "uniform" && opts.gaps != "normal" && opts.gaps != "lognormal")) {
+        usage();
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    process_model model;
+    if (!build_model(opts, model)) { return 1; }
+    if (!write_log(opts, model)) { return 1; }
+
+    float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    log("Cases written: " + std::to_string(opts.cases) + " variants: " + std::to_string(model.templates.size()) +
+        " seconds: ", seconds);
+
+    return 0;
+}
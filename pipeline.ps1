@@ -2,6 +2,7 @@
 $exampleFolder = "Exempel"
 $exe           = "./desktop.exe"
 $python        = "python"
+$usePm4py      = $false    # draw with generate_graph.py (pm4py, needs desktop.dll: make library) instead of desktop.exe --svg
 
 $fileList = @()
 
@@ -13,27 +14,27 @@ if (Test-Path -Path $exampleFolder -PathType Container) {
 
         Write-Host "Examples to run found: $($fileList.Count)"
 
-        foreach ($fileName in $fileList) {
-
-            Write-Host "Running desktop.exe on"$fileName""
-            $argumentPath = "$exampleFolder" + "/" + "$fileName"
-
-            Write-Host "Attempting to run: $exe "$argumentPath""
-
-            # run desktop.exe
+        # every log in one process, each one's output (graph9999.svg...) in Graphs\[LOG]\
+        if (-not $usePm4py) {
             try {
-                Start-Process -FilePath $exe -ArgumentList "$argumentPath" -Wait
+                Start-Process -FilePath $exe -ArgumentList "--batch", "$exampleFolder", "--batch-out", "Graphs", "--svg" -Wait
             } catch {
-                Write-Error "Error running '$exe' for file '$argumentPath': $_"
+                Write-Error "Error running '$exe' on '$exampleFolder': $_"
             }
+            exit
+        }
 
+        foreach ($fileName in $fileList) {
+
+            $argumentPath = "$exampleFolder" + "/" + "$fileName"
 
-            # run generate_graph.py 
             $outputname = $fileName -replace "\.txt$", ""
             $outputpath = "Graphs\" + $outputname
             Write-Host $outputpath
+
+            # generate_graph.py builds the graph through desktop.dll, no desktop.exe run in between
             try {
-                Start-Process -FilePath $python -ArgumentList "test.py", "$outputpath", "connections.txt", "timestamps.txt", "$argumentPath" -Wait
+                Start-Process -FilePath $python -ArgumentList "generate_graph.py", "$outputpath", "$argumentPath" -Wait
             } catch {
                 Write-Error "Error generating graph: $_"
             }